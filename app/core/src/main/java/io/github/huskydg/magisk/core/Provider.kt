@@ -12,6 +12,11 @@ class Provider : BaseProvider() {
                 SuCallbackHandler.run(context!!, method, extras)
                 Bundle.EMPTY
             }
+            SuCallbackHandler.BATCH -> {
+                SuCallbackHandler.run(context!!, method, extras)
+                // The daemon resends the events one by one unless the batch is acknowledged
+                Bundle().apply { putBoolean(SuCallbackHandler.BATCH, true) }
+            }
             else -> Bundle.EMPTY
         }
     }
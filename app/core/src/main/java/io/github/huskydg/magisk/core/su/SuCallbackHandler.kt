@@ -20,6 +20,7 @@ object SuCallbackHandler {
     const val REQUEST = "request"
     const val LOG = "log"
     const val NOTIFY = "notify"
+    const val BATCH = "batch"
 
     fun run(context: Context, action: String?, data: Bundle?) {
         data ?: return
@@ -37,6 +38,31 @@ object SuCallbackHandler {
         when (action) {
             LOG -> handleLogging(context, data)
             NOTIFY -> handleNotify(context, data)
+            BATCH -> handleBatch(context, data)
+        }
+    }
+
+    // Batched events are flattened as "<index>.<key>" with the method in "<index>.action"
+    private fun handleBatch(context: Context, data: Bundle) {
+        val count = data.getIntComp("count", 0)
+        val records = Array(count) { Bundle() }
+        for (key in data.keySet()) {
+            val dot = key.indexOf('.')
+            val index = key.substring(0, dot.coerceAtLeast(0)).toIntOrNull() ?: continue
+            val bundle = records.getOrNull(index) ?: continue
+            val name = key.substring(dot + 1)
+            when (val value = data.get(key)) {
+                is Int -> bundle.putInt(name, value)
+                is Long -> bundle.putLong(name, value)
+                is Boolean -> bundle.putBoolean(name, value)
+                is String -> bundle.putString(name, value)
+            }
+        }
+        for (record in records) {
+            when (record.getString("action")) {
+                LOG -> handleLogging(context, record)
+                NOTIFY -> handleNotify(context, record)
+            }
         }
     }
 
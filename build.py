@@ -664,7 +664,17 @@ def patch_avd_file():
     src_file = f"/data/local/tmp/{input.name}"
     out_file = f"{src_file}.magisk"
 
-    proc = execv([adb_path, "shell", "sh", "/data/local/tmp/avd_patch.sh", src_file])
+    payload = "lz4" if args.lz4 else "xz"
+    proc = execv(
+        [
+            adb_path,
+            "shell",
+            f"PAYLOADCOMP={payload}",
+            "sh",
+            "/data/local/tmp/avd_patch.sh",
+            src_file,
+        ]
+    )
     if proc.returncode != 0:
         error("avd_patch.sh failed!")
 
@@ -833,6 +843,9 @@ def parse_args():
     avd_patch_parser.add_argument(
         "-b", "--build", action="store_true", help="build before patching"
     )
+    avd_patch_parser.add_argument(
+        "--lz4", action="store_true", help="compress embedded binaries with LZ4"
+    )
 
     cargo_parser = subparsers.add_parser(
         "cargo", help="call 'cargo' commands against the project"
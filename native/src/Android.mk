@@ -63,6 +63,7 @@ LOCAL_STATIC_LIBRARIES := \
     libbase \
     libpolicy \
     libxz \
+    liblz4 \
     libinit-rs
 
 LOCAL_SRC_FILES := \
@@ -95,6 +96,7 @@ LOCAL_STATIC_LIBRARIES := \
 
 LOCAL_SRC_FILES := \
     boot/main.cpp \
+    boot/batch.cpp \
     boot/bootimg.cpp \
     boot/compress.cpp \
     boot/format.cpp \
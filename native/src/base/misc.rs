@@ -68,12 +68,49 @@ impl<T: AsRef<[u8]> + ?Sized> BytesExt for T {
 
 pub trait MutBytesExt {
     fn patch(&mut self, from: &[u8], to: &[u8]) -> Vec<usize>;
+    fn patch_all(&mut self, patterns: &[(&[u8], &[u8])]) -> Vec<(usize, usize)>;
 }
 
 impl<T: AsMut<[u8]> + ?Sized> MutBytesExt for T {
     fn patch(&mut self, from: &[u8], to: &[u8]) -> Vec<usize> {
         ffi::mut_u8_patch(self.as_mut(), from, to)
     }
+
+    // Replace all patterns in a single pass over the buffer.
+    // Returns (pattern index, offset) of every replacement in buffer order.
+    fn patch_all(&mut self, patterns: &[(&[u8], &[u8])]) -> Vec<(usize, usize)> {
+        let buf = self.as_mut();
+        // Only positions starting with the first byte of some pattern are compared
+        let mut heads: [Vec<usize>; 256] = std::array::from_fn(|_| Vec::new());
+        for (i, (from, _)) in patterns.iter().enumerate() {
+            if let Some(&b) = from.first() {
+                heads[b as usize].push(i);
+            }
+        }
+
+        let mut v = Vec::new();
+        let mut pos = 0;
+        while let Some(skip) = buf[pos..]
+            .iter()
+            .position(|&b| !heads[b as usize].is_empty())
+        {
+            pos += skip;
+            let hit = heads[buf[pos] as usize]
+                .iter()
+                .find(|&&i| buf[pos..].starts_with(patterns[i].0));
+            let Some(&i) = hit else {
+                pos += 1;
+                continue;
+            };
+            let (from, to) = patterns[i];
+            let end = (pos + to.len()).min(buf.len());
+            buf[pos..(pos + from.len())].fill(0);
+            buf[pos..end].copy_from_slice(&to[..(end - pos)]);
+            v.push((i, pos));
+            pos += from.len();
+        }
+        v
+    }
 }
 
 // SAFETY: libc guarantees argc and argv are properly setup and are static
@@ -0,0 +1,248 @@
+#include <map>
+
+#include <base.hpp>
+
+#include "boot-rs.hpp"
+#include "magiskboot.hpp"
+#include "batch.hpp"
+
+using namespace std;
+
+// Keyed by absolute path, so 'cd' between actions keeps the files of each directory apart
+static map<string, batch_file> *files;
+static map<string, shared_ptr<const boot_img>> images;
+
+rust::Vec<uint8_t> &batch_file::bytes() {
+    if (cpio)
+        (*cpio)->dump(data);
+    return data;
+}
+
+static string abs_path(string_view name) {
+    if (name.empty() || name[0] == '/')
+        return string(name);
+    while (str_starts(name, "./"))
+        name.remove_prefix(2);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+        return string(name);
+    string path(cwd);
+    path += '/';
+    path += name;
+    return path;
+}
+
+bool batch_active() {
+    return files != nullptr;
+}
+
+batch_file *batch_find(const char *name) {
+    if (files == nullptr)
+        return nullptr;
+    auto it = files->find(abs_path(name));
+    return it == files->end() ? nullptr : &it->second;
+}
+
+batch_file &batch_create(const char *name) {
+    auto &file = (*files)[abs_path(name)];
+    file = batch_file();
+    return file;
+}
+
+shared_ptr<const boot_img> open_boot_img(const char *image) {
+    string key;
+    if (files) {
+        key = abs_path(image);
+        if (auto it = images.find(key); it != images.end())
+            return it->second;
+    }
+    auto boot = make_shared<const boot_img>(image);
+    if (boot->hdr == nullptr)
+        return nullptr;
+    if (files)
+        images[key] = boot;
+    return boot;
+}
+
+static void write_file(const string &path, batch_file &file) {
+    auto &data = file.bytes();
+    int fd = creat(path.data(), 0644);
+    xwrite(fd, data.data(), data.size());
+    close(fd);
+}
+
+static long long now_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Split a batch line into arguments, quotes group several words into one argument
+static vector<string> split_args(string_view line) {
+    vector<string> args;
+    string arg;
+    bool has_arg = false;
+    char quote = '\0';
+    for (char c : line) {
+        if (quote) {
+            if (c == quote)
+                quote = '\0';
+            else
+                arg += c;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            has_arg = true;
+        } else if (isspace(c)) {
+            if (has_arg)
+                args.push_back(std::move(arg));
+            arg.clear();
+            has_arg = false;
+        } else {
+            arg += c;
+            has_arg = true;
+        }
+    }
+    if (has_arg)
+        args.push_back(std::move(arg));
+    return args;
+}
+
+// Only commands that modify the archive can share a single load and dump.
+// test, exists and ls end a cpio invocation with their own status.
+static bool cpio_mergeable(const vector<string> &args) {
+    if (args.size() <= 2 || args[0] != "cpio")
+        return false;
+    for (size_t i = 2; i < args.size(); ++i) {
+        string_view cmd = args[i];
+        auto begin = cmd.find_first_not_of(' ');
+        if (begin == string_view::npos)
+            return false;
+        cmd = cmd.substr(begin);
+        cmd = cmd.substr(0, cmd.find(' '));
+        if (cmd != "add" && cmd != "rm" && cmd != "mv" && cmd != "mkdir" && cmd != "ln" &&
+            cmd != "extract" && cmd != "patch" && cmd != "backup" && cmd != "restore")
+            return false;
+    }
+    return true;
+}
+
+// Actions outside of the in-memory pipeline only see the working directory.
+// Files they reference are written out first, and dropped from memory
+// as the action may change them.
+static void write_referenced(const vector<string> &args, size_t first) {
+    for (size_t i = first; i < args.size(); ++i) {
+        for (auto &word : split_args(args[i])) {
+            auto it = files->find(abs_path(word));
+            if (it != files->end()) {
+                write_file(it->first, it->second);
+                files->erase(it);
+            }
+        }
+    }
+}
+
+static int run_batch_action(const vector<string> &args, vector<char *> &argv) {
+    int argc = argv.size() - 1;
+    string_view action = args[0];
+    if (str_starts(action, "--"))
+        action.remove_prefix(2);
+
+    if (action == "unpack" || action == "split" || action == "cd") {
+        // Components are written to memory
+        return run_action(argc, argv.data());
+    } else if (action == "repack") {
+        // Components are read from memory, only the new image is written
+        int ret = run_action(argc, argv.data());
+        images.clear();
+        return ret;
+    } else if (action == "cleanup") {
+        for (auto name : { KERNEL_FILE, RAMDISK_FILE, SECOND_FILE, EXTRA_FILE,
+                           KER_DTB_FILE, RECV_DTBO_FILE, DTB_FILE, BOOTCONFIG_FILE }) {
+            files->erase(abs_path(name));
+        }
+        return run_action(argc, argv.data());
+    } else if (action == "hexpatch" && args.size() > 2) {
+        write_referenced(args, 2);
+        if (batch_file *file = batch_find(args[1].data())) {
+            auto &data = file->bytes();
+            rust::Slice<uint8_t> buf(data.data(), data.size());
+            return rust::hexpatch_mem(buf, argc - 2, argv.data() + 2) ? 0 : 1;
+        }
+        return run_action(argc, argv.data());
+    } else if (action == "cpio" && args.size() > 1) {
+        write_referenced(args, 2);
+        if (batch_file *file = batch_find(args[1].data())) {
+            if (!file->cpio)
+                file->cpio = rust::new_cpio_archive();
+            return (*file->cpio)->commands(file->data, argc - 2, argv.data() + 2);
+        }
+        return run_action(argc, argv.data());
+    }
+
+    write_referenced(args, 1);
+    images.clear();
+    return run_action(argc, argv.data());
+}
+
+int batch(char *arg0, const char *file) {
+    vector<vector<string>> cmds;
+    auto parse = [&](string_view line) -> bool {
+        if (line.empty() || line[0] == '#')
+            return true;
+        auto args = split_args(line);
+        if (args.empty())
+            return true;
+        if (!cmds.empty()) {
+            auto &prev = cmds.back();
+            if (cpio_mergeable(args) && cpio_mergeable(prev) && args[1] == prev[1]) {
+                // Consecutive cpio commands on the same archive share a single load and dump
+                prev.insert(prev.end(), args.begin() + 2, args.end());
+                return true;
+            }
+        }
+        cmds.push_back(std::move(args));
+        return true;
+    };
+    if (file == "-"sv) {
+        file_readline(true, stdin, parse);
+    } else if (auto fp = xopen_file(file, "re")) {
+        file_readline(true, fp.get(), parse);
+    } else {
+        return 1;
+    }
+
+    map<string, batch_file> mem_files;
+    files = &mem_files;
+    int ret = 0;
+    auto start = now_ms();
+    for (auto &args : cmds) {
+        if (args[0] == "batch") {
+            fprintf(stderr, "Nested batch is not supported\n");
+            ret = 1;
+            break;
+        }
+        vector<char *> argv;
+        argv.push_back(arg0);
+        for (auto &arg : args)
+            argv.push_back(arg.data());
+        argv.push_back(nullptr);
+
+        auto begin = now_ms();
+        ret = run_batch_action(args, argv);
+        fprintf(stderr, "Batch [%s] finished in %lldms\n", args[0].data(), now_ms() - begin);
+        if (ret != 0) {
+            fprintf(stderr, "Batch [%s] returned %d\n", args[0].data(), ret);
+            break;
+        }
+    }
+
+    // Leave the working directories as if every action had run on its own
+    for (auto &[path, file] : mem_files)
+        write_file(path, file);
+    files = nullptr;
+    images.clear();
+
+    if (ret == 0)
+        fprintf(stderr, "Batch of %zu actions finished in %lldms\n", cmds.size(), now_ms() - start);
+    return ret;
+}
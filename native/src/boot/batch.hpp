@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+
+#include "boot-rs.hpp"
+#include "bootimg.hpp"
+
+// magiskboot batch keeps the parsed source image and the components unpacked from it
+// in memory, so only the final image has to be written. Outside of a batch, components
+// are files in the working directory.
+
+struct batch_file {
+    // Stale while a cpio archive is parsed in memory, use bytes() to read it
+    rust::Vec<uint8_t> data;
+    std::optional<rust::Box<rust::CpioArchive>> cpio;
+
+    rust::Vec<uint8_t> &bytes();
+};
+
+bool batch_active();
+// Returns nullptr if the file is not held in memory
+batch_file *batch_find(const char *name);
+// Replaces any previous content of the file
+batch_file &batch_create(const char *name);
+// Images are only parsed once per batch. Returns nullptr if the image is invalid.
+std::shared_ptr<const boot_img> open_boot_img(const char *image);
+
+int batch(char *arg0, const char *file);
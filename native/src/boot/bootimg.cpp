@@ -1,6 +1,7 @@
 #include <bit>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <span>
 
 #include <base.hpp>
@@ -9,6 +10,7 @@
 #include "bootimg.hpp"
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "batch.hpp"
 
 using namespace std;
 
@@ -34,12 +36,35 @@ static off_t compress(format_t type, int fd, const void *in, size_t size) {
 static void dump(const void *buf, size_t size, const char *filename) {
     if (size == 0)
         return;
+    if (batch_active()) {
+        rust_vec_stream(batch_create(filename).data).write(buf, size);
+        return;
+    }
     int fd = creat(filename, 0644);
     xwrite(fd, buf, size);
     close(fd);
 }
 
+static void dump_decompressed(format_t type, const void *buf, size_t size, const char *filename) {
+    if (batch_active()) {
+        auto ptr = get_decoder(type, make_unique<rust_vec_stream>(batch_create(filename).data));
+        ptr->write(buf, size);
+        return;
+    }
+    int fd = creat(filename, 0644);
+    decompress(type, fd, buf, size);
+    close(fd);
+}
+
+static bool component_exists(const char *filename) {
+    return batch_find(filename) || access(filename, R_OK) == 0;
+}
+
 static size_t restore(int fd, const char *filename) {
+    if (batch_file *file = batch_find(filename)) {
+        auto &data = file->bytes();
+        return xwrite(fd, data.data(), data.size());
+    }
     int ifd = xopen(filename, O_RDONLY);
     size_t size = lseek(ifd, 0, SEEK_END);
     lseek(ifd, 0, SEEK_SET);
@@ -151,8 +176,10 @@ void dyn_img_hdr::load_hdr_file() {
 
 boot_img::boot_img(const char *image) : map(image) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
-    for (const uint8_t *addr = map.buf(); addr < map.buf() + map.sz(); ++addr) {
-        format_t fmt = check_fmt(addr, map.sz());
+    const uint8_t *end = map.buf() + map.sz();
+    for (const uint8_t *addr = map.buf(); addr < end; ++addr) {
+        format_t fmt;
+        addr += scan_fmt(addr, end - addr, fmt);
         switch (fmt) {
         case CHROMEOS:
             // chromeos require external signing
@@ -179,7 +206,7 @@ boot_img::boot_img(const char *image) : map(image) {
             break;
         }
     }
-    exit(1);
+    // No valid header was found, hdr stays null
 }
 
 boot_img::~boot_img() {
@@ -433,13 +460,13 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
             z_hdr = reinterpret_cast<const zimage_hdr *>(kernel);
 
             const uint8_t* found_pos = 0;
-            
-            for (const uint8_t* search_pos = kernel + 0x28; search_pos < kernel + hdr->kernel_size(); search_pos++) {
-                //                                  ^^^^^^ +0x28 to search after zimage header and magic
-                if (check_fmt_lg(search_pos, hdr->kernel_size() - (search_pos - kernel)) != UNKNOWN) {
-                    found_pos = search_pos;
-                    search_pos = kernel + hdr->kernel_size();
-                }
+
+            // +0x28 to search after zimage header and magic
+            if (hdr->kernel_size() > 0x28) {
+                format_t fmt;
+                size_t len = hdr->kernel_size() - 0x28;
+                if (size_t off = scan_fmt(kernel + 0x28, len, fmt); off < len)
+                    found_pos = kernel + 0x28 + off;
             }
 
             if (found_pos != 0) {
@@ -481,7 +508,7 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
                 fprintf(stderr,
                         "! Invalid vendor image: vendor_ramdisk_table_entry_size != %zu\n",
                         sizeof(table_entry));
-                exit(1);
+                return false;
             }
 
             span<table_entry> table(
@@ -558,9 +585,7 @@ int split_image_dtb(const char *filename, bool skip_decomp) {
     if (int off = find_dtb_offset(img.buf(), img.sz()); off > 0) {
         format_t fmt = check_fmt_lg(img.buf(), img.sz());
         if (!skip_decomp && COMPRESSED(fmt)) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(fmt, fd, img.buf(), off);
-            close(fd);
+            dump_decompressed(fmt, img.buf(), off, KERNEL_FILE);
         } else {
             dump(img.buf(), off, KERNEL_FILE);
         }
@@ -573,7 +598,10 @@ int split_image_dtb(const char *filename, bool skip_decomp) {
 }
 
 int unpack(const char *image, bool skip_decomp, bool hdr) {
-    const boot_img boot(image);
+    auto img = open_boot_img(image);
+    if (!img)
+        return 1;
+    const boot_img &boot = *img;
 
     if (hdr)
         boot.hdr->dump_hdr_file();
@@ -581,9 +609,7 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     // Dump kernel
     if (!skip_decomp && COMPRESSED(boot.k_fmt)) {
         if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
+            dump_decompressed(boot.k_fmt, boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
         }
     } else {
         dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
@@ -618,9 +644,7 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
         }
     } else if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
         if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
+            dump_decompressed(boot.r_fmt, boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
         }
     } else {
         dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
@@ -632,9 +656,7 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     // Dump extra
     if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
         if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
+            dump_decompressed(boot.e_fmt, boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
         }
     } else {
         dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
@@ -657,8 +679,29 @@ write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
 
 #define file_align() file_align_with(boot.hdr->page_size())
 
-void repack(const char *src_img, const char *out_img, bool skip_comp) {
-    const boot_img boot(src_img);
+// A component to repack, kept in memory by magiskboot batch or a file in the working directory
+struct component : public byte_view {
+    explicit component(const char *filename) {
+        if (batch_file *file = batch_find(filename)) {
+            auto &data = file->bytes();
+            _buf = data.data();
+            _sz = data.size();
+        } else {
+            map.emplace(filename);
+            _buf = map->buf();
+            _sz = map->sz();
+        }
+    }
+
+private:
+    optional<mmap_data> map;
+};
+
+int repack(const char *src_img, const char *out_img, bool skip_comp) {
+    auto img = open_boot_img(src_img);
+    if (!img)
+        return 1;
+    const boot_img &boot = *img;
     fprintf(stderr, "Repack to boot image: [%s]\n", out_img);
 
     struct {
@@ -715,8 +758,8 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         // Copy zImage headers
         xwrite(fd, boot.z_hdr, boot.z_info.hdr_sz);
     }
-    if (access(KERNEL_FILE, R_OK) == 0) {
-        mmap_data m(KERNEL_FILE);
+    if (component_exists(KERNEL_FILE)) {
+        component m(KERNEL_FILE);
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.k_fmt)) {
             // Always use zopfli for zImage compression
             auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
@@ -752,7 +795,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     }
 
     // kernel dtb
-    if (access(KER_DTB_FILE, R_OK) == 0)
+    if (component_exists(KER_DTB_FILE))
         hdr->kernel_size() += restore(fd, KER_DTB_FILE);
     file_align();
 
@@ -797,8 +840,8 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
         hdr->ramdisk_size() = ramdisk_offset;
         file_align();
-    } else if (access(RAMDISK_FILE, R_OK) == 0) {
-        mmap_data m(RAMDISK_FILE);
+    } else if (component_exists(RAMDISK_FILE)) {
+        component m(RAMDISK_FILE);
         auto r_fmt = boot.r_fmt;
         if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != LZ4_LEGACY) {
             // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
@@ -817,15 +860,15 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
     // second
     off.second = lseek(fd, 0, SEEK_CUR);
-    if (access(SECOND_FILE, R_OK) == 0) {
+    if (component_exists(SECOND_FILE)) {
         hdr->second_size() = restore(fd, SECOND_FILE);
         file_align();
     }
 
     // extra
     off.extra = lseek(fd, 0, SEEK_CUR);
-    if (access(EXTRA_FILE, R_OK) == 0) {
-        mmap_data m(EXTRA_FILE);
+    if (component_exists(EXTRA_FILE)) {
+        component m(EXTRA_FILE);
         if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.e_fmt)) {
             hdr->extra_size() = compress(boot.e_fmt, fd, m.buf(), m.sz());
         } else {
@@ -835,7 +878,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     }
 
     // recovery_dtbo
-    if (access(RECV_DTBO_FILE, R_OK) == 0) {
+    if (component_exists(RECV_DTBO_FILE)) {
         hdr->recovery_dtbo_offset() = lseek(fd, 0, SEEK_CUR);
         hdr->recovery_dtbo_size() = restore(fd, RECV_DTBO_FILE);
         file_align();
@@ -843,7 +886,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
     // dtb
     off.dtb = lseek(fd, 0, SEEK_CUR);
-    if (access(DTB_FILE, R_OK) == 0) {
+    if (component_exists(DTB_FILE)) {
         hdr->dtb_size() = restore(fd, DTB_FILE);
         file_align();
     }
@@ -861,7 +904,7 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     }
 
     // bootconfig
-    if (access(BOOTCONFIG_FILE, R_OK) == 0) {
+    if (component_exists(BOOTCONFIG_FILE)) {
         hdr->bootconfig_size() = restore(fd, BOOTCONFIG_FILE);
         file_align();
     }
@@ -974,23 +1017,31 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         }
     }
 
+    dhtb_hdr *d_hdr = nullptr;
     if (boot.flags[DHTB_FLAG]) {
         // DHTB header
-        auto d_hdr = reinterpret_cast<dhtb_hdr *>(out.buf());
+        d_hdr = reinterpret_cast<dhtb_hdr *>(out.buf());
         memcpy(d_hdr, DHTB_MAGIC, 8);
         d_hdr->size = off.total - sizeof(dhtb_hdr);
-        sha256_hash(byte_view(out.buf() + sizeof(dhtb_hdr), d_hdr->size),
-                    byte_data(d_hdr->checksum, 32));
     } else if (boot.flags[BLOB_FLAG]) {
         // Blob header
         auto b_hdr = reinterpret_cast<blob_hdr *>(out.buf());
         b_hdr->size = off.total - sizeof(blob_hdr);
     }
 
+    // The DHTB checksum covers exactly the signed payload when the header directly
+    // follows it, so the signer can produce both digests in a single pass
+    bool fused_sha = d_hdr && boot.flags[AVB1_SIGNED_FLAG] && off.header == sizeof(dhtb_hdr);
+    if (d_hdr && !fused_sha) {
+        sha256_hash(byte_view(out.buf() + sizeof(dhtb_hdr), d_hdr->size),
+                    byte_data(d_hdr->checksum, 32));
+    }
+
     // Sign the image after we finish patching the boot image
     if (boot.flags[AVB1_SIGNED_FLAG]) {
         byte_view payload(out.buf() + off.header, off.total - off.header);
-        auto sig = rust::sign_boot_image(payload, "/boot", nullptr, nullptr);
+        byte_data sha = fused_sha ? byte_data(d_hdr->checksum, 32) : byte_data();
+        auto sig = rust::sign_boot_image(payload, "/boot", nullptr, nullptr, sha);
         if (!sig.empty()) {
             lseek(fd, off.total, SEEK_SET);
             xwrite(fd, sig.data(), sig.size());
@@ -998,10 +1049,13 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     }
 
     close(fd);
+    return 0;
 }
 
 int verify(const char *image, const char *cert) {
     const boot_img boot(image);
+    if (boot.hdr == nullptr)
+        return 1;
     if (cert == nullptr) {
         // Boot image parsing already checks if the image is signed
         return boot.flags[AVB1_SIGNED_FLAG] ? 0 : 1;
@@ -1013,7 +1067,9 @@ int verify(const char *image, const char *cert) {
 
 int sign(const char *image, const char *name, const char *cert, const char *key) {
     const boot_img boot(image);
-    auto sig = rust::sign_boot_image(boot.payload, name, cert, key);
+    if (boot.hdr == nullptr)
+        return 1;
+    auto sig = rust::sign_boot_image(boot.payload, name, cert, key, byte_data());
     if (sig.empty())
         return 1;
 
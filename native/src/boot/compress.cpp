@@ -623,11 +623,15 @@ out_strm_ptr get_decoder(format_t type, out_strm_ptr &&base) {
     }
 }
 
-void decompress(char *infile, const char *outfile) {
+// Errors are returned instead of exiting, magiskboot batch runs many actions in one process
+int decompress(char *infile, const char *outfile) {
     bool in_std = infile == "-"sv;
     bool rm_in = false;
+    int ret = 0;
 
     int in_fd = in_std ? STDIN_FILENO : xopen(infile, O_RDONLY);
+    if (in_fd < 0)
+        return 1;
     int out_fd = -1;
     out_strm_ptr strm;
 
@@ -639,8 +643,11 @@ void decompress(char *infile, const char *outfile) {
 
             fprintf(stderr, "Detected format: [%s]\n", fmt2name[type]);
 
-            if (!COMPRESSED(type))
-                LOGE("Input file is not a supported compressed type!\n");
+            if (!COMPRESSED(type)) {
+                fprintf(stderr, "Input file is not a supported compressed type!\n");
+                ret = 1;
+                break;
+            }
 
             /* If user does not provide outfile, infile has to be either
             * <path>.[ext], or '-'. Outfile will be either <path> or '-'.
@@ -651,8 +658,11 @@ void decompress(char *infile, const char *outfile) {
                 outfile = infile;
                 if (!in_std) {
                     ext = strrchr(infile, '.');
-                    if (ext == nullptr || strcmp(ext, fmt2ext[type]) != 0)
-                        LOGE("Input file is not a supported type!\n");
+                    if (ext == nullptr || strcmp(ext, fmt2ext[type]) != 0) {
+                        fprintf(stderr, "Input file is not a supported type!\n");
+                        ret = 1;
+                        break;
+                    }
 
                     // Strip out extension and remove input
                     *ext = '\0';
@@ -664,30 +674,43 @@ void decompress(char *infile, const char *outfile) {
             out_fd = outfile == "-"sv ?
                     STDOUT_FILENO :
                     xopen(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            strm = get_decoder(type, make_unique<fd_stream>(out_fd));
             if (ext) *ext = '.';
+            if (out_fd < 0) {
+                ret = 1;
+                break;
+            }
+            strm = get_decoder(type, make_unique<fd_stream>(out_fd));
+        }
+        if (!strm->write(buf, len)) {
+            fprintf(stderr, "Decompression error!\n");
+            ret = 1;
+            break;
         }
-        if (!strm->write(buf, len))
-            LOGE("Decompression error!\n");
     }
 
     strm.reset(nullptr);
     if (in_fd != STDIN_FILENO) close(in_fd);
-    if (out_fd != STDOUT_FILENO) close(out_fd);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) close(out_fd);
 
-    if (rm_in)
+    if (rm_in && ret == 0)
         unlink(infile);
+    return ret;
 }
 
-void compress(const char *method, const char *infile, const char *outfile) {
+int compress(const char *method, const char *infile, const char *outfile) {
     format_t fmt = name2fmt[method];
-    if (fmt == UNKNOWN)
-        LOGE("Unknown compression method: [%s]\n", method);
+    if (fmt == UNKNOWN) {
+        fprintf(stderr, "Unknown compression method: [%s]\n", method);
+        return 1;
+    }
 
     bool in_std = infile == "-"sv;
     bool rm_in = false;
+    int ret = 0;
 
     int in_fd = in_std ? STDIN_FILENO : xopen(infile, O_RDONLY);
+    if (in_fd < 0)
+        return 1;
     int out_fd = -1;
 
     if (outfile == nullptr) {
@@ -707,25 +730,33 @@ void compress(const char *method, const char *infile, const char *outfile) {
                 STDOUT_FILENO :
                 xopen(outfile,  O_WRONLY | O_CREAT | O_TRUNC, 0644);
     }
+    if (out_fd < 0) {
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        return 1;
+    }
 
     auto strm = get_encoder(fmt, make_unique<fd_stream>(out_fd));
 
     char buf[4096];
     size_t len;
     while ((len = read(in_fd, buf, sizeof(buf)))) {
-        if (!strm->write(buf, len))
-            LOGE("Compression error!\n");
+        if (!strm->write(buf, len)) {
+            fprintf(stderr, "Compression error!\n");
+            ret = 1;
+            break;
+        }
     }
 
     strm.reset(nullptr);
     if (in_fd != STDIN_FILENO) close(in_fd);
     if (out_fd != STDOUT_FILENO) close(out_fd);
 
-    if (rm_in)
+    if (rm_in && ret == 0)
         unlink(infile);
+    return ret;
 }
 
-bool decompress(rust::Slice<const uint8_t> buf, int fd) {
+bool decompress(rust::Slice<const uint8_t> buf, rust::Vec<uint8_t> &out) {
     format_t type = check_fmt(buf.data(), buf.length());
 
     if (!COMPRESSED(type)) {
@@ -733,7 +764,7 @@ bool decompress(rust::Slice<const uint8_t> buf, int fd) {
         return false;
     }
 
-    auto strm = get_decoder(type, make_unique<fd_stream>(fd));
+    auto strm = get_decoder(type, make_unique<rust_vec_stream>(out));
     if (!strm->write(buf.data(), buf.length())) {
         return false;
     }
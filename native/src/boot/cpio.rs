@@ -3,13 +3,18 @@
 use std::cmp::Ordering;
 use std::collections::{BTreeMap, HashMap};
 use std::fmt::{Display, Formatter};
-use std::fs::File;
-use std::io::{Read, Write};
+use std::fs::{File, canonicalize, metadata, remove_file, rename};
+use std::io::{IoSlice, Read, Write};
 use std::mem::size_of;
-use std::process::exit;
+use std::ops::{Deref, Range};
+use std::path::PathBuf;
+use std::rc::Rc;
 use std::str;
+use std::sync::atomic::{self, AtomicUsize};
+use std::thread;
+use std::time::{Duration, Instant};
 
-use argh::FromArgs;
+use argh::{EarlyExit, FromArgs};
 use bytemuck::{Pod, Zeroable, from_bytes};
 use num_traits::cast::AsPrimitive;
 use size::{Base, Size, Style};
@@ -20,8 +25,7 @@ use base::libc::{
     c_char, dev_t, gid_t, major, makedev, minor, mknod, mode_t, uid_t,
 };
 use base::{
-    BytesExt, EarlyExitExt, LoggedResult, MappedFile, ResultExt, Utf8CStr, Utf8CStrBuf, WriteExt,
-    cstr, log_err, map_args,
+    BytesExt, LoggedResult, MappedFile, ResultExt, Utf8CStr, Utf8CStrBuf, cstr, log_err, map_args,
 };
 
 use crate::check_env;
@@ -207,17 +211,55 @@ struct CpioHeader {
     check: [u8; 8],
 }
 
+#[derive(Clone)]
 struct Cpio {
     entries: BTreeMap<String, Box<CpioEntry>>,
 }
 
+#[derive(Clone)]
 struct CpioEntry {
     mode: mode_t,
     uid: uid_t,
     gid: gid_t,
     rdevmajor: dev_t,
     rdevminor: dev_t,
-    data: Vec<u8>,
+    data: CpioData,
+}
+
+// Entry bodies keep pointing into the loaded archive until they are modified
+#[derive(Clone)]
+enum CpioData {
+    Archive(Rc<dyn AsRef<[u8]>>, Range<usize>),
+    Owned(Vec<u8>),
+}
+
+impl CpioData {
+    fn to_mut(&mut self) -> &mut Vec<u8> {
+        if let CpioData::Archive(archive, range) = self {
+            *self = CpioData::Owned((**archive).as_ref()[range.clone()].to_vec());
+        }
+        match self {
+            CpioData::Owned(data) => data,
+            CpioData::Archive(..) => unreachable!(),
+        }
+    }
+}
+
+impl Deref for CpioData {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            CpioData::Archive(archive, range) => &(**archive).as_ref()[range.clone()],
+            CpioData::Owned(data) => data,
+        }
+    }
+}
+
+impl From<Vec<u8>> for CpioData {
+    fn from(data: Vec<u8>) -> Self {
+        CpioData::Owned(data)
+    }
 }
 
 impl Cpio {
@@ -227,7 +269,8 @@ impl Cpio {
         }
     }
 
-    fn load_from_data(data: &[u8]) -> LoggedResult<Self> {
+    fn load_from_data(archive: Rc<dyn AsRef<[u8]>>) -> LoggedResult<Self> {
+        let data = (*archive).as_ref();
         let mut cpio = Cpio::new();
         let mut pos = 0_usize;
         while pos < data.len() {
@@ -258,7 +301,7 @@ impl Cpio {
                 gid: x8u(&hdr.gid)?.as_(),
                 rdevmajor: x8u(&hdr.rdevmajor)?.as_(),
                 rdevminor: x8u(&hdr.rdevminor)?.as_(),
-                data: data[pos..(pos + file_sz)].to_vec(),
+                data: CpioData::Archive(archive.clone(), pos..(pos + file_sz)),
             });
             pos += file_sz;
             cpio.entries.insert(name, entry);
@@ -270,50 +313,122 @@ impl Cpio {
     fn load_from_file(path: &Utf8CStr) -> LoggedResult<Self> {
         eprintln!("Loading cpio: [{}]", path);
         let file = MappedFile::open(path)?;
-        Self::load_from_data(file.as_ref())
+        Self::load_from_data(Rc::new(file))
     }
 
-    fn dump(&self, path: &str) -> LoggedResult<()> {
-        eprintln!("Dumping cpio: [{}]", path);
-        let mut file = File::create(path)?;
+    // Headers, names and paddings are packed into one buffer, and gathered
+    // together with the entry bodies into as few writes as possible
+    fn write_parts<F>(&self, write: F) -> LoggedResult<()>
+    where
+        F: FnOnce(&mut [IoSlice]) -> LoggedResult<()>,
+    {
+        enum Part<'a> {
+            Meta(Range<usize>),
+            Data(&'a [u8]),
+        }
+        let mut meta = Vec::<u8>::new();
+        let mut parts = Vec::<Part>::with_capacity(self.entries.len() * 2 + 1);
+        let mut meta_start = 0usize;
         let mut pos = 0usize;
         let mut inode = 300000i64;
         for (name, entry) in &self.entries {
-            pos += file.write(
-                format!(
-                    "070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                    inode,
-                    entry.mode,
-                    entry.uid,
-                    entry.gid,
-                    1,
-                    0,
-                    entry.data.len(),
-                    0,
-                    0,
-                    entry.rdevmajor,
-                    entry.rdevminor,
-                    name.len() + 1,
-                    0
-                ).as_bytes(),
+            let header_start = meta.len();
+            write!(
+                meta,
+                "070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
+                inode,
+                entry.mode,
+                entry.uid,
+                entry.gid,
+                1,
+                0,
+                entry.data.len(),
+                0,
+                0,
+                entry.rdevmajor,
+                entry.rdevminor,
+                name.len() + 1,
+                0
             )?;
-            pos += file.write(name.as_bytes())?;
-            pos += file.write(&[0])?;
-            file.write_zeros(align_4(pos) - pos)?;
-            pos = align_4(pos);
-            pos += file.write(&entry.data)?;
-            file.write_zeros(align_4(pos) - pos)?;
+            meta.extend_from_slice(name.as_bytes());
+            meta.push(0);
+            pos += meta.len() - header_start;
+            meta.resize(meta.len() + align_4(pos) - pos, 0);
             pos = align_4(pos);
+            if !entry.data.is_empty() {
+                parts.push(Part::Meta(meta_start..meta.len()));
+                parts.push(Part::Data(&entry.data));
+                meta_start = meta.len();
+                pos += entry.data.len();
+                meta.resize(meta.len() + align_4(pos) - pos, 0);
+                pos = align_4(pos);
+            }
             inode += 1;
         }
-        pos += file.write(
-            format!("070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
-                inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0
-            ).as_bytes()
+        let trailer_start = meta.len();
+        write!(
+            meta,
+            "070701{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}{:08x}",
+            inode, 0o755, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0
         )?;
-        pos += file.write("TRAILER!!!\0".as_bytes())?;
-        file.write_zeros(align_4(pos) - pos)?;
-        Ok(())
+        meta.extend_from_slice("TRAILER!!!\0".as_bytes());
+        pos += meta.len() - trailer_start;
+        meta.resize(meta.len() + align_4(pos) - pos, 0);
+        parts.push(Part::Meta(meta_start..meta.len()));
+
+        let mut iov: Vec<IoSlice> = parts
+            .iter()
+            .map(|part| match part {
+                Part::Meta(range) => IoSlice::new(&meta[range.clone()]),
+                Part::Data(data) => IoSlice::new(data),
+            })
+            .collect();
+        write(&mut iov)
+    }
+
+    fn dump(&self, path: &str) -> LoggedResult<()> {
+        eprintln!("Dumping cpio: [{}]", path);
+
+        // Bodies may still be mapped from this very file, so it cannot be truncated.
+        // Write a new file next to the real target and rename it over, which keeps
+        // symlinks to the archive and its permissions intact.
+        let target = canonicalize(path).unwrap_or_else(|_| PathBuf::from(path));
+        let mut tmp = target.clone().into_os_string();
+        tmp.push(".tmp");
+        let tmp = PathBuf::from(tmp);
+        let res: LoggedResult<()> = try {
+            let mut file = File::create(&tmp)?;
+            if let Ok(meta) = metadata(&target) {
+                file.set_permissions(meta.permissions())?;
+            }
+            self.write_parts(|mut bufs| {
+                while !bufs.is_empty() {
+                    let len = file.write_vectored(bufs)?;
+                    if len == 0 {
+                        return Err(log_err!("failed to write cpio"));
+                    }
+                    IoSlice::advance_slices(&mut bufs, len);
+                }
+                Ok(())
+            })?;
+            rename(&tmp, &target)?;
+        };
+        if res.is_err() {
+            remove_file(&tmp).ok();
+        }
+        res
+    }
+
+    fn to_vec(&self) -> Vec<u8> {
+        let mut data = Vec::new();
+        self.write_parts(|bufs| {
+            for buf in bufs.iter() {
+                data.extend_from_slice(buf);
+            }
+            Ok(())
+        })
+        .ok();
+        data
     }
 
     fn rm(&mut self, path: &str, recursive: bool) {
@@ -361,7 +476,7 @@ impl Cpio {
             }
             S_IFLNK => {
                 buf.clear();
-                buf.push_str(str::from_utf8(entry.data.as_slice())?);
+                buf.push_str(str::from_utf8(&entry.data)?);
                 out.create_symlink_to(&buf)?;
             }
             S_IFBLK | S_IFCHR => {
@@ -431,7 +546,7 @@ impl Cpio {
                 gid: 0,
                 rdevmajor,
                 rdevminor,
-                data: content,
+                data: content.into(),
             }),
         );
         eprintln!("Add file [{}] ({:04o})", path, mode);
@@ -447,7 +562,7 @@ impl Cpio {
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
+                data: Vec::new().into(),
             }),
         );
         eprintln!("Create directory [{}] ({:04o})", dir, mode);
@@ -462,7 +577,7 @@ impl Cpio {
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: norm_path(src).as_bytes().to_vec(),
+                data: norm_path(src).into_bytes().into(),
             }),
         );
         eprintln!("Create symlink [{}] -> [{}]", dst, src);
@@ -523,18 +638,20 @@ impl Cpio {
             if !keep_verity {
                 if fstab {
                     eprintln!("Found fstab file [{}]", name);
-                    let len = patch_verity(entry.data.as_mut_slice());
-                    if len != entry.data.len() {
-                        entry.data.resize(len, 0);
+                    let data = entry.data.to_mut();
+                    let len = patch_verity(data.as_mut_slice());
+                    if len != data.len() {
+                        data.resize(len, 0);
                     }
                 } else if name == "verity_key" {
                     return false;
                 }
             }
             if !keep_force_encrypt && fstab {
-                let len = patch_encryption(entry.data.as_mut_slice());
-                if len != entry.data.len() {
-                    entry.data.resize(len, 0);
+                let data = entry.data.to_mut();
+                let len = patch_encryption(data.as_mut_slice());
+                if len != data.len() {
+                    data.resize(len, 0);
                 }
             }
             true
@@ -565,25 +682,30 @@ impl Cpio {
     }
 
     fn restore(&mut self) -> LoggedResult<()> {
-        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+        let mut pending = Vec::<(String, Box<CpioEntry>)>::new();
         let mut rm_list = String::new();
         self.entries
             .extract_if(|name, _| name.starts_with(".backup/"))
-            .for_each(|(name, mut entry)| {
+            .for_each(|(name, entry)| {
                 if name == ".backup/.rmlist" {
                     if let Ok(data) = str::from_utf8(&entry.data) {
                         rm_list.push_str(data);
                     }
                 } else if name != ".backup/.magisk" {
-                    let new_name = if name.ends_with(".xz") && entry.decompress() {
-                        &name[8..name.len() - 3]
-                    } else {
-                        &name[8..]
-                    };
-                    eprintln!("Restore [{}] -> [{}]", name, new_name);
-                    backups.insert(new_name.to_string(), entry);
+                    pending.push((name, entry));
                 }
             });
+        let times = xz_entries(&mut pending, false);
+        let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+        for ((name, entry), time) in pending.into_iter().zip(times) {
+            let new_name = if let Some(time) = time {
+                &name[8..name.len() - 3]
+            } else {
+                &name[8..]
+            };
+            eprintln!("Restore [{}] -> [{}]{}", name, new_name, fmt_time(time));
+            backups.insert(new_name.to_string(), entry);
+        }
         self.rm(".backup", false);
         if rm_list.is_empty() && backups.is_empty() {
             self.entries.clear();
@@ -601,6 +723,7 @@ impl Cpio {
 
     fn backup(&mut self, origin: &mut String, skip_compress: bool) -> LoggedResult<()> {
         let mut backups = HashMap::<String, Box<CpioEntry>>::new();
+        let mut pending = Vec::<(String, Box<CpioEntry>)>::new();
         let mut rm_list = String::new();
         backups.insert(
             ".backup".to_string(),
@@ -610,7 +733,7 @@ impl Cpio {
                 gid: 0,
                 rdevmajor: 0,
                 rdevminor: 0,
-                data: vec![],
+                data: Vec::new().into(),
             }),
         );
         let origin = Utf8CStr::from_string(origin);
@@ -636,7 +759,7 @@ impl Cpio {
                     Ordering::Greater => Action::Record(rhs.next().unwrap().0),
                     Ordering::Equal => {
                         let (l, le) = lhs.next().unwrap();
-                        let action = if re.data != le.data {
+                        let action = if *re.data != *le.data {
                             Action::Backup(l, le)
                         } else {
                             Action::Noop
@@ -655,15 +778,7 @@ impl Cpio {
                 }
             };
             match action {
-                Action::Backup(name, mut entry) => {
-                    let backup = if !skip_compress && entry.compress() {
-                        format!(".backup/{}.xz", name)
-                    } else {
-                        format!(".backup/{}", name)
-                    };
-                    eprintln!("Backup [{}] -> [{}]", name, backup);
-                    backups.insert(backup, entry);
-                }
+                Action::Backup(name, entry) => pending.push((name, entry)),
                 Action::Record(name) => {
                     eprintln!("Record new entry: [{}] -> [.backup/.rmlist]", name);
                     rm_list.push_str(&format!("{}\0", name));
@@ -671,6 +786,20 @@ impl Cpio {
                 Action::Noop => {}
             }
         }
+        let times = if skip_compress {
+            vec![None; pending.len()]
+        } else {
+            xz_entries(&mut pending, true)
+        };
+        for ((name, entry), time) in pending.into_iter().zip(times) {
+            let backup = if time.is_some() {
+                format!(".backup/{}.xz", name)
+            } else {
+                format!(".backup/{}", name)
+            };
+            eprintln!("Backup [{}] -> [{}]{}", name, backup, fmt_time(time));
+            backups.insert(backup, entry);
+        }
         if !rm_list.is_empty() {
             backups.insert(
                 ".backup/.rmlist".to_string(),
@@ -680,7 +809,7 @@ impl Cpio {
                     gid: 0,
                     rdevmajor: 0,
                     rdevminor: 0,
-                    data: rm_list.as_bytes().to_vec(),
+                    data: rm_list.into_bytes().into(),
                 }),
             );
         }
@@ -690,32 +819,71 @@ impl Cpio {
     }
 }
 
-impl CpioEntry {
-    pub(crate) fn compress(&mut self) -> bool {
-        if self.mode & S_IFMT != S_IFREG {
-            return false;
-        }
-        let mut compressed = Vec::new();
-        if !xz(&self.data, &mut compressed) {
-            eprintln!("xz compression failed");
-            return false;
+// Preset 9 xz encoders are memory hungry, keep the pool small
+const XZ_MAX_JOBS: usize = 4;
+
+// Compress regular file entries, or decompress the ones named *.xz, on a bounded pool.
+// Entries are converted in place, and the time spent on each converted entry is returned.
+fn xz_entries(entries: &mut [(String, Box<CpioEntry>)], compress: bool) -> Vec<Option<Duration>> {
+    let jobs: Vec<usize> = entries
+        .iter()
+        .enumerate()
+        .filter(|(_, (name, entry))| {
+            entry.mode & S_IFMT == S_IFREG && (compress || name.ends_with(".xz"))
+        })
+        .map(|(i, _)| i)
+        .collect();
+    let mut results: Vec<Option<(Vec<u8>, Duration)>> = vec![None; jobs.len()];
+
+    let inputs: Vec<&[u8]> = jobs.iter().map(|&i| &*entries[i].1.data).collect();
+    let next = AtomicUsize::new(0);
+    let workers = thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(XZ_MAX_JOBS)
+        .min(inputs.len());
+    let worker = || {
+        let mut done = Vec::new();
+        loop {
+            let i = next.fetch_add(1, atomic::Ordering::Relaxed);
+            let Some(&input) = inputs.get(i) else {
+                break;
+            };
+            let start = Instant::now();
+            let mut out = Vec::new();
+            let ok = if compress {
+                xz(input, &mut out)
+            } else {
+                unxz(input, &mut out)
+            };
+            done.push((i, ok.then(|| (out, start.elapsed()))));
         }
-        self.data = compressed;
-        true
-    }
-
-    pub(crate) fn decompress(&mut self) -> bool {
-        if self.mode & S_IFMT != S_IFREG {
-            return false;
+        done
+    };
+    thread::scope(|s| {
+        let handles: Vec<_> = (0..workers).map(|_| s.spawn(worker)).collect();
+        for h in handles {
+            for (i, result) in h.join().unwrap_or_default() {
+                results[i] = result;
+            }
         }
-        let mut decompressed = Vec::new();
-        if !unxz(&self.data, &mut decompressed) {
-            eprintln!("xz decompression failed");
-            return false;
+    });
+
+    let mut times = vec![None; entries.len()];
+    for (i, result) in jobs.into_iter().zip(results) {
+        match result {
+            Some((data, time)) => {
+                entries[i].1.data = data.into();
+                times[i] = Some(time);
+            }
+            None if compress => eprintln!("xz compression failed"),
+            None => eprintln!("xz decompression failed"),
         }
-        self.data = decompressed;
-        true
     }
+    times
+}
+
+fn fmt_time(time: Option<Duration>) -> String {
+    time.map_or_else(String::new, |t| format!(" ({}ms)", t.as_millis()))
 }
 
 impl Display for CpioEntry {
@@ -752,74 +920,170 @@ impl Display for CpioEntry {
     }
 }
 
-pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool {
-    let res: LoggedResult<()> = try {
-        if argc < 1 {
-            Err(log_err!("No arguments"))?;
+// Argument errors are reported as a status instead of exiting the process,
+// magiskboot batch runs many actions in a single process
+fn parse_cpio_args<T: FromArgs>(cmd: &[&str], args: &[&str]) -> Result<T, i32> {
+    T::from_args(cmd, args).map_err(|EarlyExit { output, status }| {
+        if status.is_err() {
+            eprintln!("{}", output);
         }
+        print_cpio_usage();
+        if status.is_ok() { 0 } else { 1 }
+    })
+}
 
-        let cmds = map_args(argc, argv)?;
+// Every command is parsed before the archive is touched
+fn parse_cpio_commands(
+    argc: i32,
+    argv: *const *const c_char,
+) -> LoggedResult<Result<(String, Vec<CpioAction>), i32>> {
+    if argc < 1 {
+        Err(log_err!("No arguments"))?;
+    }
 
-        let mut cli =
-            CpioCli::from_args(&["magiskboot", "cpio"], &cmds).on_early_exit(print_cpio_usage);
+    let cmds = map_args(argc, argv)?;
 
-        let file = Utf8CStr::from_string(&mut cli.file);
-        let mut cpio = if file.exists() {
-            Cpio::load_from_file(file)?
-        } else {
-            Cpio::new()
-        };
+    let cli: CpioCli = match parse_cpio_args(&["magiskboot", "cpio"], &cmds) {
+        Ok(cli) => cli,
+        Err(status) => return Ok(Err(status)),
+    };
 
-        for cmd in cli.commands {
-            if cmd.starts_with('#') {
-                continue;
-            }
-            let mut cli = CpioCommand::from_args(
-                &["magiskboot", "cpio", file],
-                cmd.split(' ')
-                    .filter(|x| !x.is_empty())
-                    .collect::<Vec<_>>()
-                    .as_slice(),
-            )
-            .on_early_exit(print_cpio_usage);
-
-            match &mut cli.action {
-                CpioAction::Test(_) => exit(cpio.test()),
-                CpioAction::Restore(_) => cpio.restore()?,
-                CpioAction::Patch(_) => cpio.patch(),
+    let mut actions = Vec::with_capacity(cli.commands.len());
+    for cmd in &cli.commands {
+        if cmd.starts_with('#') {
+            continue;
+        }
+        let args = cmd.split(' ').filter(|x| !x.is_empty()).collect::<Vec<_>>();
+        match parse_cpio_args::<CpioCommand>(&["magiskboot", "cpio", &cli.file], &args) {
+            Ok(cli) => actions.push(cli.action),
+            Err(status) => return Ok(Err(status)),
+        }
+    }
+    Ok(Ok((cli.file, actions)))
+}
+
+impl Cpio {
+    // Returns the status of test, exists and ls, which end the invocation
+    // without the archive being written back
+    fn run(&mut self, actions: Vec<CpioAction>) -> LoggedResult<Option<i32>> {
+        for mut action in actions {
+            match &mut action {
+                CpioAction::Test(_) => return Ok(Some(self.test())),
+                CpioAction::Restore(_) => self.restore()?,
+                CpioAction::Patch(_) => self.patch(),
                 CpioAction::Exists(Exists { path }) => {
-                    if cpio.exists(path) {
-                        exit(0);
-                    } else {
-                        exit(1);
-                    }
+                    return Ok(Some(if self.exists(path) { 0 } else { 1 }));
                 }
                 CpioAction::Backup(Backup {
                     origin,
                     skip_compress,
-                }) => cpio.backup(origin, *skip_compress)?,
-                CpioAction::Remove(Remove { path, recursive }) => cpio.rm(path, *recursive),
-                CpioAction::Move(Move { from, to }) => cpio.mv(from, to)?,
-                CpioAction::MakeDir(MakeDir { mode, dir }) => cpio.mkdir(*mode, dir),
-                CpioAction::Link(Link { src, dst }) => cpio.ln(src, dst),
-                CpioAction::Add(Add { mode, path, file }) => cpio.add(*mode, path, file)?,
+                }) => self.backup(origin, *skip_compress)?,
+                CpioAction::Remove(Remove { path, recursive }) => self.rm(path, *recursive),
+                CpioAction::Move(Move { from, to }) => self.mv(from, to)?,
+                CpioAction::MakeDir(MakeDir { mode, dir }) => self.mkdir(*mode, dir),
+                CpioAction::Link(Link { src, dst }) => self.ln(src, dst),
+                CpioAction::Add(Add { mode, path, file }) => self.add(*mode, path, file)?,
                 CpioAction::Extract(Extract { paths }) => {
                     if !paths.is_empty() && paths.len() != 2 {
                         Err(log_err!("invalid arguments"))?;
                     }
                     let mut it = paths.iter_mut();
-                    cpio.extract(it.next(), it.next())?;
+                    self.extract(it.next(), it.next())?;
                 }
                 CpioAction::List(List { path, recursive }) => {
-                    cpio.ls(path.as_str(), *recursive);
-                    exit(0);
+                    self.ls(path.as_str(), *recursive);
+                    return Ok(Some(0));
                 }
             };
         }
-        cpio.dump(file)?;
+        Ok(None)
+    }
+}
+
+pub fn cpio_commands(argc: i32, argv: *const *const c_char) -> i32 {
+    let res: LoggedResult<i32> = try {
+        let (mut file, actions) = match parse_cpio_commands(argc, argv)? {
+            Ok(cmds) => cmds,
+            Err(status) => return status,
+        };
+        let file = Utf8CStr::from_string(&mut file);
+
+        let mut cpio = if file.exists() {
+            Cpio::load_from_file(file)?
+        } else {
+            Cpio::new()
+        };
+
+        match cpio.run(actions)? {
+            Some(status) => status,
+            None => {
+                cpio.dump(file)?;
+                0
+            }
+        }
     };
     res.log_with_msg(|w| w.write_str("Failed to process cpio"))
-        .is_ok()
+        .unwrap_or(1)
+}
+
+// magiskboot batch keeps an archive parsed between the cpio actions on it
+pub struct CpioArchive(Option<Cpio>);
+
+pub fn new_cpio_archive() -> Box<CpioArchive> {
+    Box::new(CpioArchive(None))
+}
+
+impl CpioArchive {
+    // data holds the raw archive whenever it is not parsed
+    pub fn commands(&mut self, data: &mut Vec<u8>, argc: i32, argv: *const *const c_char) -> i32 {
+        let res: LoggedResult<i32> = try {
+            let (_, actions) = match parse_cpio_commands(argc, argv)? {
+                Ok(cmds) => cmds,
+                Err(status) => return status,
+            };
+
+            let mut cpio = match self.0.take() {
+                Some(cpio) => cpio,
+                None => {
+                    let archive = Rc::new(std::mem::take(data));
+                    match Cpio::load_from_data(archive.clone()) {
+                        Ok(cpio) => cpio,
+                        Err(e) => {
+                            *data = Rc::try_unwrap(archive).unwrap_or_default();
+                            Err(e)?
+                        }
+                    }
+                }
+            };
+
+            // Like a cpio action that does not dump the archive, a failure
+            // or an early status leaves it as it was before this action
+            let orig = cpio.clone();
+            let res = cpio.run(actions);
+            match res {
+                Ok(None) => {
+                    self.0 = Some(cpio);
+                    0
+                }
+                Ok(Some(status)) => {
+                    self.0 = Some(orig);
+                    status
+                }
+                Err(e) => {
+                    self.0 = Some(orig);
+                    Err(e)?
+                }
+            }
+        };
+        res.log_with_msg(|w| w.write_str("Failed to process cpio"))
+            .unwrap_or(1)
+    }
+
+    pub fn dump(&mut self, data: &mut Vec<u8>) {
+        if let Some(cpio) = self.0.take() {
+            *data = cpio.to_vec();
+        }
+    }
 }
 
 fn x8u(x: &[u8; 8]) -> LoggedResult<u32> {
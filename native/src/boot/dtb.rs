@@ -1,14 +1,12 @@
-use std::{cell::UnsafeCell, process::exit};
+use std::cell::UnsafeCell;
 
-use argh::FromArgs;
+use argh::{EarlyExit, FromArgs};
 use fdt::{
     Fdt, FdtError,
     node::{FdtNode, NodeProperty},
 };
 
-use base::{
-    EarlyExitExt, LoggedResult, MappedFile, ResultExt, Utf8CStr, libc::c_char, log_err, map_args,
-};
+use base::{LoggedResult, MappedFile, ResultExt, Utf8CStr, libc::c_char, log_err, map_args};
 
 use crate::{check_env, patch::patch_verity};
 
@@ -274,34 +272,37 @@ fn dtb_patch(file: &Utf8CStr) -> LoggedResult<bool> {
     Ok(patched)
 }
 
+// Test results and argument errors are returned instead of exiting the process,
+// magiskboot batch runs many actions in a single process
 pub fn dtb_commands(argc: i32, argv: *const *const c_char) -> bool {
-    let res: LoggedResult<()> = try {
+    let res: LoggedResult<bool> = try {
         if argc < 1 {
             Err(log_err!("No arguments"))?;
         }
         let cmds = map_args(argc, argv)?;
 
-        let mut cli =
-            DtbCli::from_args(&["magiskboot", "dtb"], &cmds).on_early_exit(print_dtb_usage);
+        let mut cli = match DtbCli::from_args(&["magiskboot", "dtb"], &cmds) {
+            Ok(cli) => cli,
+            Err(EarlyExit { output, status }) => {
+                if status.is_err() {
+                    eprintln!("{}", output);
+                }
+                print_dtb_usage();
+                return status.is_ok();
+            }
+        };
 
         let file = Utf8CStr::from_string(&mut cli.file);
 
         match cli.action {
             DtbAction::Print(Print { fstab }) => {
                 dtb_print(file, fstab)?;
+                true
             }
-            DtbAction::Test(_) => {
-                if !dtb_test(file)? {
-                    exit(1);
-                }
-            }
-            DtbAction::Patch(_) => {
-                if !dtb_patch(file)? {
-                    exit(1);
-                }
-            }
+            DtbAction::Test(_) => dtb_test(file)?,
+            DtbAction::Patch(_) => dtb_patch(file)?,
         }
     };
     res.log_with_msg(|w| w.write_str("Failed to process dtb"))
-        .is_ok()
+        .unwrap_or(false)
 }
@@ -43,6 +43,38 @@ format_t check_fmt(const void *buf, size_t len) {
     }
 }
 
+// Every magic check_fmt() matches at offset 0 starts with one of these bytes
+static const struct fmt_first_bytes {
+    bool table[256] = {};
+
+    fmt_first_bytes() {
+        for (const char *magic : {
+                CHROMEOS_MAGIC, BOOT_MAGIC, VENDOR_BOOT_MAGIC, GZIP1_MAGIC, GZIP2_MAGIC,
+                LZOP_MAGIC, XZ_MAGIC, "\x5d", BZIP_MAGIC, LZ41_MAGIC, LZ42_MAGIC,
+                LZ4_LEG_MAGIC, MTK_MAGIC, DTB_MAGIC, DHTB_MAGIC, TEGRABLOB_MAGIC }) {
+            table[(uint8_t) magic[0]] = true;
+        }
+    }
+
+    bool operator[](uint8_t b) const { return table[b]; }
+} first_bytes;
+
+size_t scan_fmt(const void *buf, size_t len, format_t &fmt) {
+    auto p = static_cast<const uint8_t *>(buf);
+    // zImage is identified by the magic at 0x24
+    const uint8_t z = ZIMAGE_MAGIC[0];
+    for (size_t off = 0; off < len; ++off) {
+        // Only run the full check on offsets where some magic could possibly start
+        if (!first_bytes[p[off]] && (len - off < 0x28 || p[off + 0x24] != z))
+            continue;
+        fmt = check_fmt(p + off, len - off);
+        if (fmt != UNKNOWN)
+            return off;
+    }
+    fmt = UNKNOWN;
+    return len;
+}
+
 const char *Fmt2Name::operator[](format_t fmt) {
     switch (fmt) {
         case GZIP:
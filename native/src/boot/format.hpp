@@ -80,6 +80,8 @@ public:
 };
 
 format_t check_fmt(const void *buf, size_t len);
+// Find the first offset in buf that check_fmt() recognizes, returns len if there is none
+size_t scan_fmt(const void *buf, size_t len, format_t &fmt);
 
 extern Name2Fmt name2fmt;
 extern Fmt2Name fmt2name;
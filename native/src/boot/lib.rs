@@ -4,11 +4,11 @@
 #![feature(try_blocks)]
 
 pub use base;
-use cpio::cpio_commands;
+use cpio::{CpioArchive, cpio_commands, new_cpio_archive};
 use dtb::dtb_commands;
 pub use libbz2_rs_sys::*;
 pub use libz_rs_sys::*;
-use patch::hexpatch;
+use patch::{hexpatch, hexpatch_mem};
 use payload::extract_boot_from_payload;
 use sign::{SHA, get_sha, sha1_hash, sha256_hash, sign_boot_image, verify_boot_image};
 use std::env;
@@ -21,6 +21,7 @@ mod payload;
 #[allow(warnings)]
 mod proto;
 mod sign;
+mod sparse;
 
 #[cxx::bridge]
 pub mod ffi {
@@ -34,7 +35,7 @@ pub mod ffi {
 
     unsafe extern "C++" {
         include!("compress.hpp");
-        fn decompress(buf: &[u8], fd: i32) -> bool;
+        fn decompress(buf: &[u8], out: &mut Vec<u8>) -> bool;
         fn xz(buf: &[u8], out: &mut Vec<u8>) -> bool;
         fn unxz(buf: &[u8], out: &mut Vec<u8>) -> bool;
 
@@ -55,8 +56,6 @@ pub mod ffi {
         fn output_size(self: &SHA) -> usize;
         fn sha1_hash(data: &[u8], out: &mut [u8]);
         fn sha256_hash(data: &[u8], out: &mut [u8]);
-
-        fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool;
     }
 
     #[namespace = "rust"]
@@ -66,16 +65,31 @@ pub mod ffi {
             partition: Utf8CStrRef,
             in_path: Utf8CStrRef,
             out_path: Utf8CStrRef,
+            sparse_image: bool,
         ) -> bool;
-        unsafe fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool;
+        unsafe fn cpio_commands(argc: i32, argv: *const *const c_char) -> i32;
         unsafe fn verify_boot_image(img: &BootImage, cert: *const c_char) -> bool;
         unsafe fn sign_boot_image(
             payload: &[u8],
             name: *const c_char,
             cert: *const c_char,
             key: *const c_char,
+            sha256: &mut [u8],
         ) -> Vec<u8>;
         unsafe fn dtb_commands(argc: i32, argv: *const *const c_char) -> bool;
+        unsafe fn hexpatch(argc: i32, argv: *const *const c_char) -> bool;
+
+        // In-memory variants used by magiskboot batch
+        unsafe fn hexpatch_mem(buf: &mut [u8], argc: i32, argv: *const *const c_char) -> bool;
+        type CpioArchive;
+        fn new_cpio_archive() -> Box<CpioArchive>;
+        unsafe fn commands(
+            self: &mut CpioArchive,
+            data: &mut Vec<u8>,
+            argc: i32,
+            argv: *const *const c_char,
+        ) -> i32;
+        fn dump(self: &mut CpioArchive, data: &mut Vec<u8>);
     }
 }
 
@@ -17,11 +17,12 @@
 #define NEW_BOOT        "new-boot.img"
 
 int unpack(const char *image, bool skip_decomp = false, bool hdr = false);
-void repack(const char *src_img, const char *out_img, bool skip_comp = false);
+int repack(const char *src_img, const char *out_img, bool skip_comp = false);
 int verify(const char *image, const char *cert);
 int sign(const char *image, const char *name, const char *cert, const char *key);
 int split_image_dtb(const char *filename, bool skip_decomp = false);
 int dtb_commands(int argc, char *argv[]);
+int run_action(int argc, char *argv[]);
 
 static inline bool check_env(const char *name) {
     using namespace std::string_view_literals;
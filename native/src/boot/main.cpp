@@ -3,6 +3,7 @@
 #include "boot-rs.hpp"
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "batch.hpp"
 
 using namespace std;
 
@@ -21,7 +22,7 @@ static void print_formats() {
     }
 }
 
-static void usage(char *arg0) {
+static int usage(char *arg0) {
     fprintf(stderr,
 R"EOF(MagiskBoot - Boot Image Modification Tool
 
@@ -70,16 +71,37 @@ Supported actions:
     If the certificate/private key pair is not provided, the AOSP
     verity key bundled in the executable will be used.
 
-  extract <payload.bin> [partition] [outfile]
+  batch <file>
+    Run the actions listed in <file> within this single process,
+    one action with its arguments per line, without the leading
+    'magiskboot'. Arguments can be grouped with quotes, lines starting
+    with '#' are ignored, and 'cd <dir>' changes the working directory.
+    The source image stays parsed, and the components unpacked from it
+    are kept in memory, cpio archives stay loaded between cpio actions.
+    Components are written to the working directory only when another
+    action needs them as files, or when the batch ends. Put 'cleanup'
+    last to only write the repacked image.
+    Stops at the first action that fails and returns its value.
+    <file> can be '-' to be STDIN.
+
+  extract [-s] <payload.bin> [partition] [outfile]
     Extract [partition] from <payload.bin> to [outfile].
     If [outfile] is not specified, then output to '[partition].img'.
     If [partition] is not specified, then attempt to extract either
     'init_boot' or 'boot'. Which partition was chosen can be determined
     by whichever 'init_boot.img' or 'boot.img' exists.
+    [partition] can be a comma separated list to extract several
+    partitions at once, [outfile] is then the output directory.
+    <payload.bin> can be an OTA zip with a stored payload.bin entry.
     <payload.bin> can be '-' to be STDIN.
+    If '-s' is provided, [outfile] is written as an Android sparse image.
 
-  hexpatch <file> <hexpattern1> <hexpattern2>
+  hexpatch <file> <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]
+  hexpatch <file> <patchfile>
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
+    Several pattern pairs are all replaced in a single pass over <file>.
+    <patchfile> lists one '<hexpattern1> <hexpattern2>' pair per line,
+    lines starting with '#' are ignored.
 
   cpio <incpio> [commands...]
     Do cpio commands to <incpio> (modifications are done in-place).
@@ -123,15 +145,12 @@ Supported actions:
     print_formats();
 
     fprintf(stderr, "\n\n");
-    exit(1);
+    return 1;
 }
 
-int main(int argc, char *argv[]) {
-    cmdline_logging();
-    umask(0);
-
+int run_action(int argc, char *argv[]) {
     if (argc < 2)
-        usage(argv[0]);
+        return usage(argv[0]);
 
     // Skip '--' for backwards compatibility
     string_view action(argv[1]);
@@ -162,7 +181,7 @@ int main(int argc, char *argv[]) {
     } else if (argc > 2 && action == "split") {
         if (argv[2] == "-n"sv) {
             if (argc == 3)
-                usage(argv[0]);
+                return usage(argv[0]);
             return split_image_dtb(argv[3], true);
         } else {
             return split_image_dtb(argv[2]);
@@ -173,7 +192,7 @@ int main(int argc, char *argv[]) {
         bool hdr = false;
         for (;;) {
             if (idx >= argc)
-                usage(argv[0]);
+                return usage(argv[0]);
             if (argv[idx][0] != '-')
                 break;
             for (char *flag = &argv[idx][1]; *flag; ++flag) {
@@ -182,7 +201,7 @@ int main(int argc, char *argv[]) {
                 else if (*flag == 'h')
                     hdr = true;
                 else
-                    usage(argv[0]);
+                    return usage(argv[0]);
             }
             ++idx;
         }
@@ -190,39 +209,54 @@ int main(int argc, char *argv[]) {
     } else if (argc > 2 && action == "repack") {
         if (argv[2] == "-n"sv) {
             if (argc == 3)
-                usage(argv[0]);
-            repack(argv[3], argv[4] ? argv[4] : NEW_BOOT, true);
+                return usage(argv[0]);
+            return repack(argv[3], argv[4] ? argv[4] : NEW_BOOT, true);
         } else {
-            repack(argv[2], argv[3] ? argv[3] : NEW_BOOT);
+            return repack(argv[2], argv[3] ? argv[3] : NEW_BOOT);
         }
     } else if (argc > 2 && action == "verify") {
         return verify(argv[2], argv[3]);
     } else if (argc > 2 && action == "sign") {
-        if (argc == 5) usage(argv[0]);
+        if (argc == 5) return usage(argv[0]);
         return sign(
                 argv[2],
                 argc > 3 ? argv[3] : "/boot",
                 argc > 5 ? argv[4] : nullptr,
                 argc > 5 ? argv[5] : nullptr);
     } else if (argc > 2 && action == "decompress") {
-        decompress(argv[2], argv[3]);
+        return decompress(argv[2], argv[3]);
     } else if (argc > 2 && str_starts(action, "compress")) {
-        compress(action[8] == '=' ? &action[9] : "gzip", argv[2], argv[3]);
-    } else if (argc > 4 && action == "hexpatch") {
-        return hexpatch(byte_view(argv[2]), byte_view(argv[3]), byte_view(argv[4])) ? 0 : 1;
+        return compress(action[8] == '=' ? &action[9] : "gzip", argv[2], argv[3]);
+    } else if (argc > 3 && action == "hexpatch") {
+        return rust::hexpatch(argc - 2, argv + 2) ? 0 : 1;
     } else if (argc > 2 && action == "cpio") {
-        return rust::cpio_commands(argc - 2, argv + 2) ? 0 : 1;
+        return rust::cpio_commands(argc - 2, argv + 2);
     } else if (argc > 2 && action == "dtb") {
         return rust::dtb_commands(argc - 2, argv + 2) ? 0 : 1;
     } else if (argc > 2 && action == "extract") {
+        bool sparse = argv[2] == "-s"sv;
+        int idx = sparse ? 3 : 2;
+        if (idx >= argc)
+            return usage(argv[0]);
         return rust::extract_boot_from_payload(
-                argv[2],
-                argc > 3 ? argv[3] : "",
-                argc > 4 ? argv[4] : ""
+                argv[idx],
+                argc > idx + 1 ? argv[idx + 1] : "",
+                argc > idx + 2 ? argv[idx + 2] : "",
+                sparse
                 ) ? 0 : 1;
+    } else if (argc > 2 && action == "batch") {
+        return batch(argv[0], argv[2]);
+    } else if (argc > 2 && action == "cd") {
+        return chdir(argv[2]) ? 1 : 0;
     } else {
-        usage(argv[0]);
+        return usage(argv[0]);
     }
 
     return 0;
 }
+
+int main(int argc, char *argv[]) {
+    cmdline_logging();
+    umask(0);
+    return run_action(argc, argv);
+}
@@ -1,4 +1,6 @@
-use base::{LoggedResult, MappedFile, MutBytesExt, Utf8CStr};
+use base::libc::{O_CLOEXEC, O_RDONLY, c_char};
+use base::{BufReadExt, LoggedResult, MappedFile, MutBytesExt, Utf8CStr, log_err, map_args};
+use std::io::BufReader;
 
 // SAFETY: assert(buf.len() >= 1) && assert(len <= buf.len())
 macro_rules! match_patterns {
@@ -102,21 +104,69 @@ fn hex2byte(hex: &[u8]) -> Vec<u8> {
     v
 }
 
-pub fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool {
-    let res: LoggedResult<bool> = try {
-        let file = Utf8CStr::from_bytes(file)?;
-        let from = Utf8CStr::from_bytes(from)?;
-        let to = Utf8CStr::from_bytes(to)?;
+fn load_patch_file(path: &Utf8CStr) -> LoggedResult<Vec<(String, String)>> {
+    let mut patterns = Vec::new();
+    BufReader::new(path.open(O_RDONLY | O_CLOEXEC)?).foreach_lines(|line| {
+        let mut words = line.split_whitespace();
+        if let (Some(from), Some(to)) = (words.next(), words.next())
+            && !from.starts_with('#')
+        {
+            patterns.push((from.to_string(), to.to_string()));
+        }
+        true
+    });
+    Ok(patterns)
+}
+
+// Returns the file to patch and its pattern pairs
+fn hexpatch_args(
+    argc: i32,
+    argv: *const *const c_char,
+) -> LoggedResult<(String, Vec<(String, String)>)> {
+    let args = map_args(argc, argv)?;
+    let patterns = match args.as_slice() {
+        [_, file] => load_patch_file(Utf8CStr::from_string(&mut file.to_string()))?,
+        [_, pairs @ ..] if pairs.len() % 2 == 0 => pairs
+            .chunks(2)
+            .map(|p| (p[0].to_string(), p[1].to_string()))
+            .collect(),
+        _ => Err(log_err!("invalid arguments"))?,
+    };
+    Ok((args[0].to_string(), patterns))
+}
 
-        let mut map = MappedFile::open_rw(file)?;
-        let pattern = hex2byte(from.as_bytes());
-        let patch = hex2byte(to.as_bytes());
+fn hexpatch_buf(buf: &mut [u8], patterns: &[(String, String)]) -> bool {
+    let bytes: Vec<(Vec<u8>, Vec<u8>)> = patterns
+        .iter()
+        .map(|(from, to)| (hex2byte(from.as_bytes()), hex2byte(to.as_bytes())))
+        .collect();
+    let pairs: Vec<(&[u8], &[u8])> = bytes
+        .iter()
+        .map(|(from, to)| (from.as_slice(), to.as_slice()))
+        .collect();
 
-        let v = map.patch(pattern.as_slice(), patch.as_slice());
-        for off in &v {
-            eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
-        }
-        !v.is_empty()
+    let v = buf.patch_all(&pairs);
+    for &(i, off) in &v {
+        let (from, to) = &patterns[i];
+        eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
+    }
+    !v.is_empty()
+}
+
+pub fn hexpatch(argc: i32, argv: *const *const c_char) -> bool {
+    let res: LoggedResult<bool> = try {
+        let (mut file, patterns) = hexpatch_args(argc, argv)?;
+        let mut map = MappedFile::open_rw(Utf8CStr::from_string(&mut file))?;
+        hexpatch_buf(map.as_mut(), &patterns)
+    };
+    res.unwrap_or(false)
+}
+
+// magiskboot batch patches files it keeps in memory, the file argument only names it
+pub fn hexpatch_mem(buf: &mut [u8], argc: i32, argv: *const *const c_char) -> bool {
+    let res: LoggedResult<bool> = try {
+        let (_, patterns) = hexpatch_args(argc, argv)?;
+        hexpatch_buf(buf, &patterns)
     };
     res.unwrap_or(false)
 }
@@ -1,7 +1,13 @@
 use std::{
-    fs::File,
-    io::{BufReader, Read, Seek, SeekFrom, Write},
-    os::fd::{AsRawFd, FromRawFd},
+    cmp::min,
+    fs::{self, File},
+    io::{BufReader, BufWriter, Cursor, Read, Seek},
+    os::{
+        fd::{AsFd, FromRawFd},
+        unix::fs::FileExt,
+    },
+    sync::atomic::{AtomicUsize, Ordering},
+    thread,
 };
 
 use byteorder::{BigEndian, ReadBytesExt};
@@ -9,10 +15,14 @@ use quick_protobuf::{BytesReader, MessageRead};
 
 use crate::{
     ffi,
-    proto::update_metadata::{DeltaArchiveManifest, mod_InstallOperation::Type},
+    proto::update_metadata::{
+        DeltaArchiveManifest, Extent, InstallOperation, PartitionUpdate, mod_InstallOperation::Type,
+    },
+    sparse::write_sparse_image,
 };
 use base::{
-    LoggedError, LoggedResult, ReadSeekExt, ResultExt, Utf8CStr, WriteExt, error, ffi::Utf8CStrRef,
+    LoggedError, LoggedResult, MappedFile, ReadSeekExt, ResultExt, Utf8CStr, error,
+    ffi::Utf8CStrRef,
 };
 
 macro_rules! bad_payload {
@@ -27,18 +37,131 @@ macro_rules! bad_payload {
 }
 
 const PAYLOAD_MAGIC: &str = "CrAU";
+const PAYLOAD_ENTRY: &str = "payload.bin";
 
-fn do_extract_boot_from_payload(
-    in_path: &Utf8CStr,
-    partition_name: Option<&Utf8CStr>,
-    out_path: Option<&Utf8CStr>,
-) -> LoggedResult<()> {
-    let mut reader = BufReader::new(if in_path == "-" {
-        unsafe { File::from_raw_fd(0) }
-    } else {
-        File::open(in_path).log_with_msg(|w| write!(w, "Cannot open '{}'", in_path))?
-    });
+const ZIP_LOCAL_MAGIC: u32 = 0x04034b50;
+const ZIP_CENTRAL_MAGIC: u32 = 0x02014b50;
+const ZIP_EOCD_MAGIC: u32 = 0x06054b50;
+const ZIP64_EOCD_MAGIC: u32 = 0x06064b50;
+const ZIP64_LOCATOR_MAGIC: u32 = 0x07064b50;
+const ZIP64_EXTRA_ID: u16 = 0x0001;
+const ZIP_STORED: u16 = 0;
+
+fn le16(buf: &[u8], off: usize) -> LoggedResult<u16> {
+    let b = buf
+        .get(off..)
+        .and_then(|b| b.get(..2))
+        .ok_or_else(|| bad_payload!("truncated zip"))?;
+    Ok(u16::from_le_bytes([b[0], b[1]]))
+}
+
+fn le32(buf: &[u8], off: usize) -> LoggedResult<u32> {
+    let b = buf
+        .get(off..)
+        .and_then(|b| b.get(..4))
+        .ok_or_else(|| bad_payload!("truncated zip"))?;
+    Ok(u32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+}
+
+fn le64(buf: &[u8], off: usize) -> LoggedResult<u64> {
+    Ok(le32(buf, off)? as u64 | (le32(buf, off + 4)? as u64) << 32)
+}
+
+// Offsets and sizes read from the zip are untrusted and may not fit in usize on 32-bit targets
+fn zip_usize(val: u64) -> LoggedResult<usize> {
+    usize::try_from(val).map_err(|_| bad_payload!("truncated zip"))
+}
+
+// Locate a stored (uncompressed) entry through the zip central directory,
+// so only the pages actually used by the extraction are ever read
+fn find_zip_entry<'a>(zip: &'a [u8], name: &str) -> LoggedResult<&'a [u8]> {
+    // The end of central directory record is followed by a comment of at most 64K
+    const EOCD_LEN: usize = 22;
+    let min = zip.len().saturating_sub(EOCD_LEN + u16::MAX as usize);
+    let eocd = (min..=zip.len().saturating_sub(EOCD_LEN))
+        .rev()
+        .find(|&off| zip.get(off..(off + 4)) == Some(&ZIP_EOCD_MAGIC.to_le_bytes()))
+        .ok_or_else(|| bad_payload!("zip central directory not found"))?;
+
+    let mut entries = le16(zip, eocd + 10)? as u64;
+    let mut cd_off = le32(zip, eocd + 16)? as u64;
+
+    // Archives larger than 4G, which OTA packages commonly are, use zip64 records
+    if eocd >= 20 && le32(zip, eocd - 20)? == ZIP64_LOCATOR_MAGIC {
+        let eocd64 = zip_usize(le64(zip, eocd - 20 + 8)?)?;
+        if le32(zip, eocd64)? != ZIP64_EOCD_MAGIC {
+            return Err(bad_payload!("invalid zip64 central directory"));
+        }
+        entries = le64(zip, eocd64 + 32)?;
+        cd_off = le64(zip, eocd64 + 48)?;
+    }
+
+    let mut off = zip_usize(cd_off)?;
+    for _ in 0..entries {
+        if le32(zip, off)? != ZIP_CENTRAL_MAGIC {
+            return Err(bad_payload!("invalid zip central directory"));
+        }
+        let method = le16(zip, off + 10)?;
+        let mut size = le32(zip, off + 20)? as u64;
+        let name_len = le16(zip, off + 28)? as usize;
+        let extra_len = le16(zip, off + 30)? as usize;
+        let comment_len = le16(zip, off + 32)? as usize;
+        let mut local_off = le32(zip, off + 42)? as u64;
+        let entry_name = zip
+            .get((off + 46)..(off + 46 + name_len))
+            .ok_or_else(|| bad_payload!("truncated zip"))?;
+
+        if entry_name == name.as_bytes() {
+            if method != ZIP_STORED {
+                return Err(bad_payload!("'{}' is compressed in the zip", name));
+            }
+
+            // Values saturated in the central directory are stored in the zip64 extra field
+            let uncompressed = le32(zip, off + 24)?;
+            let extra_start = off + 46 + name_len;
+            let mut extra = extra_start;
+            while extra + 4 <= extra_start + extra_len {
+                let id = le16(zip, extra)?;
+                let len = le16(zip, extra + 2)? as usize;
+                if id == ZIP64_EXTRA_ID {
+                    let mut field = extra + 4;
+                    if uncompressed == u32::MAX {
+                        field += 8;
+                    }
+                    if size == u32::MAX as u64 {
+                        size = le64(zip, field)?;
+                        field += 8;
+                    }
+                    if local_off == u32::MAX as u64 {
+                        local_off = le64(zip, field)?;
+                    }
+                    break;
+                }
+                extra += 4 + len;
+            }
+
+            let local = zip_usize(local_off)?;
+            if le32(zip, local)? != ZIP_LOCAL_MAGIC {
+                return Err(bad_payload!("invalid zip local header"));
+            }
+            let start =
+                local + 30 + le16(zip, local + 26)? as usize + le16(zip, local + 28)? as usize;
+            // The range is bounded by the mapping, get() rejects an end past its length
+            return start
+                .checked_add(zip_usize(size)?)
+                .and_then(|end| zip.get(start..end))
+                .ok_or_else(|| bad_payload!("truncated zip"));
+        }
+
+        off += 46 + name_len + extra_len + comment_len;
+    }
+
+    Err(bad_payload!("'{}' not found in the zip", name))
+}
 
+// Parse the payload header and manifest, and skip the manifest signature.
+// Returns the manifest and the offset of the data blobs in the payload.
+fn read_manifest<R: Read + Seek>(reader: &mut R) -> LoggedResult<(DeltaArchiveManifest, u64)> {
     let buf = &mut [0u8; 4];
     reader.read_exact(buf)?;
 
@@ -75,9 +198,232 @@ fn do_extract_boot_from_payload(
         ));
     }
 
-    let block_size = manifest.get_block_size() as u64;
+    // Skip the manifest signature
+    reader.skip(manifest_sig_len as usize)?;
+
+    let data_start = 24 + manifest_len as u64 + manifest_sig_len as u64;
+    Ok((manifest, data_start))
+}
+
+// Returns the offset and length of the operation's data blob, relative to the data blobs
+fn data_range(op: &InstallOperation) -> LoggedResult<(u64, usize)> {
+    if op.type_pb == Type::ZERO {
+        return Ok((op.data_offset.unwrap_or(0), 0));
+    }
+    let data_len = op
+        .data_length
+        .ok_or_else(|| bad_payload!("data length not found"))? as usize;
+    let data_offset = op
+        .data_offset
+        .ok_or_else(|| bad_payload!("data offset not found"))?;
+    Ok((data_offset, data_len))
+}
+
+fn extent_range(ext: &Extent, block_size: u64) -> LoggedResult<(u64, u64)> {
+    let start = ext
+        .start_block
+        .ok_or_else(|| bad_payload!("start block not found"))?
+        .checked_mul(block_size)
+        .ok_or_else(|| bad_payload!("extent out of range"))?;
+    let len = ext
+        .num_blocks
+        .ok_or_else(|| bad_payload!("num blocks not found"))?
+        .checked_mul(block_size)
+        .ok_or_else(|| bad_payload!("extent out of range"))?;
+    Ok((start, len))
+}
+
+fn write_extents(
+    out: &File,
+    op: &InstallOperation,
+    mut data: &[u8],
+    block_size: u64,
+) -> LoggedResult<()> {
+    let last = op
+        .dst_extents
+        .len()
+        .checked_sub(1)
+        .ok_or_else(|| bad_payload!("dst extents not found"))?;
+    for (i, ext) in op.dst_extents.iter().enumerate() {
+        let (offset, len) = extent_range(ext, block_size)?;
+        // The last extent takes whatever is left over
+        let len = if i == last {
+            data.len()
+        } else {
+            min(len as usize, data.len())
+        };
+        out.write_all_at(&data[..len], offset)?;
+        data = &data[len..];
+    }
+    Ok(())
+}
 
-    let partition = match partition_name {
+struct Output {
+    file: File,
+    // Regular files start out as one big hole, so zero regions never have to be written
+    sparse: bool,
+    // Where the last ZERO operation ends, writing it would have extended the file up to here
+    zero_end: u64,
+}
+
+impl Output {
+    fn create(path: &str, zero_end: u64) -> LoggedResult<Output> {
+        let file = File::create(path).log_with_msg(|w| write!(w, "Cannot write to '{}'", path))?;
+        // Block devices may contain old data, and are written as is
+        let sparse = file.metadata().is_ok_and(|m| m.is_file());
+        Ok(Output {
+            file,
+            sparse,
+            zero_end,
+        })
+    }
+
+    // Only called once every operation is applied, as it may not race with any writes
+    fn finish(&self) -> LoggedResult<()> {
+        if self.sparse && self.file.metadata()?.len() < self.zero_end {
+            self.file.set_len(self.zero_end)?;
+        }
+        Ok(())
+    }
+}
+
+fn zero_end(partition: &PartitionUpdate, block_size: u64) -> u64 {
+    partition
+        .operations
+        .iter()
+        .filter(|op| op.type_pb == Type::ZERO)
+        .flat_map(|op| op.dst_extents.iter())
+        .map(|ext| {
+            ext.start_block
+                .unwrap_or(0)
+                .saturating_add(ext.num_blocks.unwrap_or(0))
+                .saturating_mul(block_size)
+        })
+        .max()
+        .unwrap_or(0)
+}
+
+// Operations only ever touch their own dst extents, so they can be applied in any order
+fn apply_operation(
+    out: &Output,
+    op: &InstallOperation,
+    data: &[u8],
+    block_size: u64,
+) -> LoggedResult<()> {
+    let out_file = &out.file;
+    match op.type_pb {
+        Type::REPLACE => write_extents(out_file, op, data, block_size)?,
+        Type::ZERO if out.sparse => {}
+        Type::ZERO => {
+            let zeros = [0u8; 4096];
+            for ext in op.dst_extents.iter() {
+                let (mut offset, mut len) = extent_range(ext, block_size)?;
+                while len > 0 {
+                    let l = min(len, zeros.len() as u64);
+                    out_file.write_all_at(&zeros[..l as usize], offset)?;
+                    offset += l;
+                    len -= l;
+                }
+            }
+        }
+        Type::REPLACE_BZ | Type::REPLACE_XZ => {
+            let mut decompressed = Vec::new();
+            if !ffi::decompress(data, &mut decompressed) {
+                return Err(bad_payload!("decompression failed"));
+            }
+            write_extents(out_file, op, &decompressed, block_size)?;
+        }
+        _ => return Err(bad_payload!("unsupported operation type")),
+    };
+    Ok(())
+}
+
+type Job<'a> = (&'a Output, &'a InstallOperation);
+
+// Decode operations from the mapped payload concurrently
+fn extract_mapped(
+    payload: &[u8],
+    data_start: u64,
+    jobs: &[Job],
+    block_size: u64,
+) -> LoggedResult<()> {
+    let next = AtomicUsize::new(0);
+    let workers = thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(jobs.len());
+
+    let worker = || -> LoggedResult<()> {
+        let result: LoggedResult<()> = try {
+            loop {
+                let Some(&(out, op)) = jobs.get(next.fetch_add(1, Ordering::Relaxed)) else {
+                    break;
+                };
+                let (offset, len) = data_range(op)?;
+                // Offsets come from the payload, get() keeps the range within the mapping
+                let data = data_start
+                    .checked_add(offset)
+                    .and_then(|start| usize::try_from(start).ok())
+                    .and_then(|start| Some(start..start.checked_add(len)?))
+                    .and_then(|range| payload.get(range))
+                    .ok_or_else(|| bad_payload!("data out of range"))?;
+                apply_operation(out, op, data, block_size)?;
+            }
+        };
+        if result.is_err() {
+            // Stop the other workers from picking up new operations
+            next.store(jobs.len(), Ordering::Relaxed);
+        }
+        result
+    };
+
+    thread::scope(|s| {
+        let handles: Vec<_> = (0..workers).map(|_| s.spawn(worker)).collect();
+        handles
+            .into_iter()
+            .map(|h| h.join().unwrap_or_else(|_| Err(LoggedError::default())))
+            .collect::<LoggedResult<()>>()
+    })
+}
+
+// Apply operations in data offset order so we will only ever need to seek forward
+// This makes it possible to support non-seekable input file descriptors
+fn extract_stream<R: Read + Seek>(
+    reader: &mut R,
+    jobs: &[Job],
+    block_size: u64,
+) -> LoggedResult<()> {
+    let mut buf = Vec::new();
+    let mut curr_data_offset: u64 = 0;
+
+    for &(out, op) in jobs {
+        let (offset, len) = data_range(op)?;
+        if len > 0 {
+            // Skip to the next offset and read data
+            let skip = offset
+                .checked_sub(curr_data_offset)
+                .ok_or_else(|| bad_payload!("overlapping data blobs"))?;
+            buf.resize(len, 0u8);
+            reader.skip(skip as usize)?;
+            reader.read_exact(&mut buf)?;
+            curr_data_offset = offset
+                .checked_add(len as u64)
+                .ok_or_else(|| bad_payload!("data out of range"))?;
+        }
+        apply_operation(out, op, &buf[..len], block_size)?;
+    }
+    Ok(())
+}
+
+// Create the output files and pass all their operations sorted by data offset to `extract`
+fn extract_partitions<F: FnOnce(&[Job]) -> LoggedResult<()>>(
+    manifest: &DeltaArchiveManifest,
+    partition_name: Option<&Utf8CStr>,
+    out_path: Option<&Utf8CStr>,
+    sparse_image: bool,
+    extract: F,
+) -> LoggedResult<()> {
+    let block_size = manifest.get_block_size() as u64;
+    let partitions = match partition_name {
         None => {
             let boot = manifest
                 .partitions
@@ -90,99 +436,124 @@ fn do_extract_boot_from_payload(
                     .iter()
                     .find(|p| p.partition_name == "boot"),
             };
-            boot.ok_or_else(|| bad_payload!("boot partition not found"))?
+            vec![boot.ok_or_else(|| bad_payload!("boot partition not found"))?]
         }
-        Some(name) => manifest
-            .partitions
-            .iter()
-            .find(|p| p.partition_name.as_str() == name)
-            .ok_or_else(|| bad_payload!("partition '{}' not found", name))?,
-    };
-
-    let out_str: String;
-    let out_path = match out_path {
-        None => {
-            out_str = format!("{}.img", partition.partition_name);
-            out_str.as_str()
-        }
-        Some(s) => s,
+        // Several partitions can be extracted at once with a comma separated list
+        Some(names) => names
+            .split(',')
+            .map(|name| {
+                manifest
+                    .partitions
+                    .iter()
+                    .find(|p| p.partition_name.as_str() == name)
+                    .ok_or_else(|| bad_payload!("partition '{}' not found", name))
+            })
+            .collect::<LoggedResult<Vec<_>>>()?,
     };
 
-    let mut out_file =
-        File::create(out_path).log_with_msg(|w| write!(w, "Cannot write to '{}'", out_path))?;
+    let mut paths = Vec::with_capacity(partitions.len());
+    let mut outputs = Vec::with_capacity(partitions.len());
+    for partition in partitions.iter() {
+        let out_path = match out_path {
+            None => format!("{}.img", partition.partition_name),
+            // With multiple partitions, the output path is a directory
+            Some(dir) if partitions.len() > 1 => {
+                format!("{}/{}.img", dir, partition.partition_name)
+            }
+            Some(s) => s.to_string(),
+        };
+        // Sparse images are converted from a raw image once it is complete
+        let raw_path = if sparse_image {
+            format!("{}.raw", out_path)
+        } else {
+            out_path.clone()
+        };
+        outputs.push(Output::create(&raw_path, zero_end(partition, block_size))?);
+        paths.push((out_path, raw_path));
+    }
 
-    // Skip the manifest signature
-    reader.skip(manifest_sig_len as usize)?;
+    let mut jobs: Vec<Job> = Vec::new();
+    for (partition, out) in partitions.iter().zip(outputs.iter()) {
+        jobs.extend(partition.operations.iter().map(|op| (out, op)));
+    }
+    jobs.sort_by_key(|(_, op)| op.data_offset.unwrap_or(0));
 
-    // Sort the install operations with data_offset so we will only ever need to seek forward
-    // This makes it possible to support non-seekable input file descriptors
-    let mut operations = partition.operations.clone();
-    operations.sort_by_key(|e| e.data_offset.unwrap_or(0));
-    let mut curr_data_offset: u64 = 0;
+    extract(&jobs)?;
 
-    for operation in operations.iter() {
-        let data_len = operation
-            .data_length
-            .ok_or_else(|| bad_payload!("data length not found"))? as usize;
-
-        let data_offset = operation
-            .data_offset
-            .ok_or_else(|| bad_payload!("data offset not found"))?;
-
-        let data_type = operation.type_pb;
-
-        buf.resize(data_len, 0u8);
-        let data = &mut buf[..data_len];
-
-        // Skip to the next offset and read data
-        let skip = data_offset - curr_data_offset;
-        reader.skip(skip as usize)?;
-        reader.read_exact(data)?;
-        curr_data_offset = data_offset + data_len as u64;
-
-        let out_offset = operation
-            .dst_extents
-            .first()
-            .ok_or_else(|| bad_payload!("dst extents not found"))?
-            .start_block
-            .ok_or_else(|| bad_payload!("start block not found"))?
-            * block_size;
-
-        match data_type {
-            Type::REPLACE => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                out_file.write_all(data)?;
-            }
-            Type::ZERO => {
-                for ext in operation.dst_extents.iter() {
-                    let out_seek = ext
-                        .start_block
-                        .ok_or_else(|| bad_payload!("start block not found"))?
-                        * block_size;
-                    let num_blocks = ext
-                        .num_blocks
-                        .ok_or_else(|| bad_payload!("num blocks not found"))?;
-                    out_file.seek(SeekFrom::Start(out_seek))?;
-                    out_file.write_zeros(num_blocks as usize)?;
-                }
-            }
-            Type::REPLACE_BZ | Type::REPLACE_XZ => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                if !ffi::decompress(data, out_file.as_raw_fd()) {
-                    return Err(bad_payload!("decompression failed"));
-                }
-            }
-            _ => return Err(bad_payload!("unsupported operation type")),
-        };
+    for (out, (out_path, raw_path)) in outputs.iter().zip(paths.iter()) {
+        out.finish()?;
+        if sparse_image {
+            let result = write_sparse_output(out, block_size, out_path);
+            fs::remove_file(raw_path).ok();
+            result?;
+        }
     }
+    Ok(())
+}
 
+fn write_sparse_output(raw: &Output, block_size: u64, path: &str) -> LoggedResult<()> {
+    if block_size == 0 || block_size > u32::MAX as u64 {
+        return Err(bad_payload!("invalid block size: {}", block_size));
+    }
+    let out = File::create(path).log_with_msg(|w| write!(w, "Cannot write to '{}'", path))?;
+    let mut out = BufWriter::new(out);
+    let len = usize::try_from(raw.file.metadata()?.len())?;
+    if len == 0 {
+        write_sparse_image(&[], block_size as usize, &mut out)?;
+    } else {
+        let map = MappedFile::create(raw.file.as_fd(), len, false)?;
+        write_sparse_image(map.as_ref(), block_size as usize, &mut out)?;
+    }
     Ok(())
 }
 
+fn do_extract_boot_from_payload(
+    in_path: &Utf8CStr,
+    partition_name: Option<&Utf8CStr>,
+    out_path: Option<&Utf8CStr>,
+    sparse_image: bool,
+) -> LoggedResult<()> {
+    let file = if in_path == "-" {
+        unsafe { File::from_raw_fd(0) }
+    } else {
+        File::open(in_path).log_with_msg(|w| write!(w, "Cannot open '{}'", in_path))?
+    };
+
+    // Regular files are mapped and decoded in parallel. Pipes, FIFOs, and payloads
+    // too large for the address space of 32-bit ABIs are streamed instead.
+    let map = file
+        .metadata()
+        .ok()
+        .filter(|attr| attr.is_file())
+        .and_then(|attr| usize::try_from(attr.len()).ok())
+        .and_then(|sz| MappedFile::create(file.as_fd(), sz, false).ok());
+
+    if let Some(map) = map {
+        let mut payload = map.as_ref();
+        // OTA packages store payload.bin uncompressed, use it in place
+        if payload.starts_with(&ZIP_LOCAL_MAGIC.to_le_bytes()) {
+            payload = find_zip_entry(payload, PAYLOAD_ENTRY)?;
+        }
+        let (manifest, data_start) = read_manifest(&mut Cursor::new(payload))?;
+        let block_size = manifest.get_block_size() as u64;
+        extract_partitions(&manifest, partition_name, out_path, sparse_image, |jobs| {
+            extract_mapped(payload, data_start, jobs, block_size)
+        })
+    } else {
+        let mut reader = BufReader::new(file);
+        let (manifest, _) = read_manifest(&mut reader)?;
+        let block_size = manifest.get_block_size() as u64;
+        extract_partitions(&manifest, partition_name, out_path, sparse_image, |jobs| {
+            extract_stream(&mut reader, jobs, block_size)
+        })
+    }
+}
+
 pub fn extract_boot_from_payload(
     in_path: Utf8CStrRef,
     partition: Utf8CStrRef,
     out_path: Utf8CStrRef,
+    sparse_image: bool,
 ) -> bool {
     let res: LoggedResult<()> = try {
         let partition = if partition.is_empty() {
@@ -195,7 +566,7 @@ pub fn extract_boot_from_payload(
         } else {
             Some(out_path)
         };
-        do_extract_boot_from_payload(in_path, partition, out_path)?
+        do_extract_boot_from_payload(in_path, partition, out_path, sparse_image)?
     };
     res.log_with_msg(|w| w.write_str("Failed to extract from payload"))
         .is_ok()
@@ -306,7 +306,9 @@ pub fn sign_boot_image(
     name: *const c_char,
     cert: *const c_char,
     key: *const c_char,
+    sha256: &mut [u8],
 ) -> Vec<u8> {
+    let mut sha256_done = sha256.is_empty();
     let res: LoggedResult<Vec<u8>> = try {
         // Process arguments
         let name = unsafe { Utf8CStr::from_ptr(name) }?;
@@ -331,6 +333,11 @@ pub fn sign_boot_image(
             length: payload.len() as u64,
         };
         signer.update(payload);
+        if !sha256_done && signer.digest.output_size() == sha256.len() {
+            // The payload SHA-256 is also requested, take it from the signer's state
+            signer.digest.box_clone().finalize_into_reset(sha256).ok();
+            sha256_done = true;
+        }
         signer.update(attr.to_der()?.as_slice());
         let sig = signer.sign()?;
 
@@ -345,5 +352,8 @@ pub fn sign_boot_image(
         };
         sig.to_der()?
     };
+    if !sha256_done {
+        sha256_hash(payload, sha256);
+    }
     res.unwrap_or_default()
 }
@@ -0,0 +1,70 @@
+use std::io::{self, Write};
+
+use byteorder::{LittleEndian, WriteBytesExt};
+
+// Android sparse image format, as flashed by fastboot and read by simg2img
+const SPARSE_HEADER_MAGIC: u32 = 0xed26ff3a;
+const SPARSE_HEADER_LEN: u16 = 28;
+const CHUNK_HEADER_LEN: u16 = 12;
+const CHUNK_TYPE_RAW: u16 = 0xcac1;
+const CHUNK_TYPE_FILL: u16 = 0xcac2;
+
+// Keep the total size of a raw chunk well within its u32 field
+const MAX_RAW_CHUNK: usize = 64 * 1024 * 1024;
+
+fn is_zero(block: &[u8]) -> bool {
+    // SAFETY: u128 has no invalid bit patterns
+    let (head, body, tail) = unsafe { block.align_to::<u128>() };
+    head.iter().all(|&b| b == 0) && body.iter().all(|&w| w == 0) && tail.iter().all(|&b| b == 0)
+}
+
+fn write_chunk_header<W: Write>(out: &mut W, kind: u16, blocks: u32, len: usize) -> io::Result<()> {
+    out.write_u16::<LittleEndian>(kind)?;
+    out.write_u16::<LittleEndian>(0)?;
+    out.write_u32::<LittleEndian>(blocks)?;
+    out.write_u32::<LittleEndian>((CHUNK_HEADER_LEN as usize + len) as u32)
+}
+
+// Runs of zero blocks are stored as fill chunks, everything else as raw chunks.
+// A partial last block is padded with zeros, like img2simg does.
+pub fn write_sparse_image<W: Write>(raw: &[u8], block_size: usize, out: &mut W) -> io::Result<()> {
+    let max_raw_blocks = (MAX_RAW_CHUNK / block_size).max(1) as u32;
+
+    // (is data, first block, number of blocks)
+    let mut chunks: Vec<(bool, usize, u32)> = Vec::new();
+    for (i, block) in raw.chunks(block_size).enumerate() {
+        let data = !is_zero(block);
+        match chunks.last_mut() {
+            Some((d, _, n)) if *d == data && (!data || *n < max_raw_blocks) => *n += 1,
+            _ => chunks.push((data, i, 1)),
+        }
+    }
+
+    out.write_u32::<LittleEndian>(SPARSE_HEADER_MAGIC)?;
+    out.write_u16::<LittleEndian>(1)?;
+    out.write_u16::<LittleEndian>(0)?;
+    out.write_u16::<LittleEndian>(SPARSE_HEADER_LEN)?;
+    out.write_u16::<LittleEndian>(CHUNK_HEADER_LEN)?;
+    out.write_u32::<LittleEndian>(block_size as u32)?;
+    out.write_u32::<LittleEndian>(raw.len().div_ceil(block_size) as u32)?;
+    out.write_u32::<LittleEndian>(chunks.len() as u32)?;
+    // No image checksum
+    out.write_u32::<LittleEndian>(0)?;
+
+    for (data, start, blocks) in chunks {
+        if data {
+            let len = blocks as usize * block_size;
+            let begin = start * block_size;
+            let bytes = &raw[begin..raw.len().min(begin + len)];
+            write_chunk_header(out, CHUNK_TYPE_RAW, blocks, len)?;
+            out.write_all(bytes)?;
+            if bytes.len() < len {
+                out.write_all(&vec![0; len - bytes.len()])?;
+            }
+        } else {
+            write_chunk_header(out, CHUNK_TYPE_FILL, blocks, 4)?;
+            out.write_u32::<LittleEndian>(0)?;
+        }
+    }
+    out.flush()
+}
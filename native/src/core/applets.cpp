@@ -21,6 +21,7 @@ constexpr Applet applets[] = {
 
 constexpr Applet private_applets[] = {
     { "zygisk", zygisk_main },
+    { "su_server", su_server_main },
 };
 
 int main(int argc, char *argv[]) {
@@ -1,3 +1,4 @@
+#include <climits>
 #include <csignal>
 #include <libgen.h>
 #include <sys/un.h>
@@ -15,7 +16,7 @@ using namespace std;
 // Forward declarations for missing functions
 void setup_logfile();
 void android_logging();
-void restorecon();
+void restorecon(bool boot);
 bool setfilecon(const char *path, const char *con);
 rust::String find_preinit_device();
 
@@ -36,6 +37,16 @@ enum {
     POLL_CTRL_RM,
 };
 
+// Sent with a single write, which is atomic as it is smaller than PIPE_BUF,
+// so requests from several threads never interleave in the pipe
+struct poll_ctrl_msg {
+    int code;
+    pollfd pfd;
+    poll_callback callback;
+    bool auto_close;
+};
+static_assert(sizeof(poll_ctrl_msg) <= PIPE_BUF);
+
 void register_poll(const pollfd *pfd, poll_callback callback) {
     if (gettid() == getpid()) {
         // On main thread, directly modify
@@ -43,9 +54,8 @@ void register_poll(const pollfd *pfd, poll_callback callback) {
         poll_fds->emplace_back(*pfd);
     } else {
         // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_NEW);
-        xwrite(poll_ctrl, pfd, sizeof(*pfd));
-        xwrite(poll_ctrl, &callback, sizeof(callback));
+        poll_ctrl_msg msg{ .code = POLL_CTRL_NEW, .pfd = *pfd, .callback = callback };
+        xwrite(poll_ctrl, &msg, sizeof(msg));
     }
 }
 
@@ -69,9 +79,8 @@ void unregister_poll(int fd, bool auto_close) {
         }
     } else {
         // Send it to poll_ctrl
-        write_int(poll_ctrl, POLL_CTRL_RM);
-        write_int(poll_ctrl, fd);
-        write_int(poll_ctrl, auto_close);
+        poll_ctrl_msg msg{ .code = POLL_CTRL_RM, .pfd = { .fd = fd }, .auto_close = auto_close };
+        xwrite(poll_ctrl, &msg, sizeof(msg));
     }
 }
 
@@ -88,22 +97,16 @@ void clear_poll() {
 }
 
 static void poll_ctrl_handler(pollfd *pfd) {
-    int code = read_int(pfd->fd);
-    switch (code) {
-    case POLL_CTRL_NEW: {
-        pollfd new_fd{};
-        poll_callback cb;
-        xxread(pfd->fd, &new_fd, sizeof(new_fd));
-        xxread(pfd->fd, &cb, sizeof(cb));
-        register_poll(&new_fd, cb);
+    poll_ctrl_msg msg{};
+    if (xxread(pfd->fd, &msg, sizeof(msg)) != sizeof(msg))
+        return;
+    switch (msg.code) {
+    case POLL_CTRL_NEW:
+        register_poll(&msg.pfd, msg.callback);
         break;
-    }
-    case POLL_CTRL_RM: {
-        int fd = read_int(pfd->fd);
-        bool auto_close = read_int(pfd->fd);
-        unregister_poll(fd, auto_close);
+    case POLL_CTRL_RM:
+        unregister_poll(msg.pfd.fd, msg.auto_close);
         break;
-    }
     default:
         __builtin_unreachable();
     }
@@ -165,10 +168,38 @@ string read_string(int fd) {
     return str;
 }
 
+// Send all fields of a message with as few syscalls as possible
+bool write_iov(int fd, iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            PLOGE("writev");
+            return false;
+        }
+        // Skip over what has been written
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
 void write_string(int fd, string_view str) {
     if (fd < 0) return;
-    write_int(fd, str.size());
-    xwrite(fd, str.data(), str.size());
+    int len = str.size();
+    iovec iov[] = {
+        { &len, sizeof(len) },
+        { const_cast<char *>(str.data()), str.size() },
+    };
+    write_iov(fd, iov, 2);
 }
 
 // Forward declaration for MagiskD
@@ -182,11 +213,23 @@ namespace rust {
         void reboot();
         void zygisk_handler(int client);
         void boot_stage_handler(int client, int code);
+        void reap_su_session(int pidfd);
         int sdk_int();
     };
     MagiskD& get_magiskd_instance();
 }
 
+static void reap_su_session(pollfd *pfd) {
+    rust::get_magiskd_instance().reap_su_session(pfd->fd);
+    unregister_poll(pfd->fd, true);
+}
+
+void register_su_session(int pidfd) {
+    // pidfd becomes readable when the root process exits
+    pollfd pfd = { pidfd, POLLIN, 0 };
+    register_poll(&pfd, reap_su_session);
+}
+
 static void handle_request_async(int client, int code, const sock_cred &cred) {
     auto &daemon = rust::get_magiskd_instance();
     switch (code) {
@@ -240,6 +283,11 @@ static void handle_request_sync(int client, int code) {
     case +RequestCode::START_DAEMON:
         setup_logfile();
         break;
+    case +RequestCode::TRACE: {
+        auto json = dump_trace();
+        write_string(client, string_view(json.data(), json.size()));
+        break;
+    }
     case +RequestCode::STOP_DAEMON: {
         // Unmount all overlays
         denylist_handler(-1, nullptr);
@@ -310,6 +358,7 @@ static void handle_request(pollfd *pfd) {
     case +RequestCode::SQLITE_CMD:
     case +RequestCode::DENYLIST:
     case +RequestCode::STOP_DAEMON:
+    case +RequestCode::TRACE:
         if (!is_root) {
             write_int(client, +RespondCode::ROOT_REQUIRED);
             return;
@@ -484,7 +533,7 @@ bool setup_magisk_env() {
     xmkdir(MODULEROOT, 0755);
     xmkdir(SECURE_DIR "/post-fs-data.d", 0755);
     xmkdir(SECURE_DIR "/service.d", 0755);
-    restorecon();
+    restorecon(true);
 
     if (access(DATABIN "/busybox", X_OK))
         return false;
@@ -9,12 +9,13 @@ use crate::logging::{magisk_logging, setup_logfile, start_log_daemon};
 use crate::mount::{clean_mounts, setup_module_mount, setup_preinit_dir};
 use crate::package::ManagerInfo;
 use crate::selinux::restore_tmpcon;
-use crate::su::SuInfo;
+use crate::su::{SuInfoCache, SuSession};
+use crate::trace::setup_trace;
+use crate::trace_span;
 use crate::{get_prop, set_prop};
 use base::libc::{O_APPEND, O_CLOEXEC, O_RDONLY, O_WRONLY};
-use base::{
-    AtomicArc, BufReadExt, FsPathBuilder, ResultExt, Utf8CStr, Utf8CStrBuf, cstr, error, info, libc,
-};
+use base::{BufReadExt, FsPathBuilder, ResultExt, Utf8CStr, Utf8CStrBuf, cstr, error, info, libc};
+use std::collections::BTreeMap;
 use std::fmt::Write as FmtWrite;
 use std::io::{BufReader, Write};
 use std::os::unix::net::UnixStream;
@@ -70,7 +71,9 @@ pub struct MagiskD {
     pub zygiskd_sockets: Mutex<(Option<UnixStream>, Option<UnixStream>)>,
     pub zygisk_enabled: AtomicBool,
     pub zygote_start_count: AtomicU32,
-    pub cached_su_info: AtomicArc<SuInfo>,
+    pub su_info_cache: Mutex<SuInfoCache>,
+    pub su_generation: AtomicU32,
+    pub su_sessions: Mutex<BTreeMap<i32, SuSession>>,
     sdk_int: i32,
     pub is_emulator: bool,
     is_recovery: bool,
@@ -98,17 +101,32 @@ impl MagiskD {
     }
 
     pub fn handle_modules(&self) -> Vec<ModuleInfo> {
+        trace_span!("handle_modules");
         let zygisk = self.zygisk_enabled();
-        crate::ffi::prepare_modules();
-        let initial_modules = crate::ffi::collect_modules(zygisk, false);
-        crate::ffi::exec_module_scripts(cstr!("post-fs-data"), &initial_modules);
-        // Recollect modules (module scripts could remove itself)
-        let modules = crate::ffi::collect_modules(zygisk, true);
-        crate::ffi::load_modules(zygisk, &modules);
+        let initial_modules = {
+            trace_span!("collect_modules");
+            crate::ffi::prepare_modules();
+            crate::ffi::collect_modules(zygisk, false)
+        };
+        {
+            trace_span!("post-fs-data module scripts");
+            crate::ffi::exec_module_scripts(cstr!("post-fs-data"), &initial_modules);
+        }
+        // Recollect modules (module scripts could remove itself),
+        // only modules whose directory changed are checked again
+        let modules = {
+            trace_span!("recollect_modules");
+            crate::ffi::collect_modules(zygisk, true)
+        };
+        {
+            trace_span!("load_modules");
+            crate::ffi::load_modules(zygisk, &modules);
+        }
         modules
     }
 
     fn post_fs_data(&self) -> bool {
+        trace_span!("post-fs-data");
         setup_logfile();
         info!("** post-fs-data mode running");
 
@@ -125,9 +143,16 @@ impl MagiskD {
             }
         }
 
-        self.prune_su_access();
+        {
+            trace_span!("prune_su_access");
+            self.prune_su_access();
+        }
 
-        if !setup_magisk_env() {
+        let env_ok = {
+            trace_span!("setup_magisk_env");
+            setup_magisk_env()
+        };
+        if !env_ok {
             error!("* Magisk environment incomplete, abort");
             return true;
         }
@@ -150,17 +175,32 @@ impl MagiskD {
             return true;
         }
 
-        exec_common_scripts(cstr!("post-fs-data"));
+        {
+            trace_span!("post-fs-data scripts");
+            exec_common_scripts(cstr!("post-fs-data"));
+        }
         self.zygisk_enabled.store(
             self.get_db_setting(DbEntryKey::ZygiskConfig) != 0,
             Ordering::Release,
         );
-    initialize_denylist();
-    init_nethunter_mode();
-    init_solist_hiding();
-    init_seccomp_hiding();
-    init_ptrace_hiding();
-        setup_module_mount();
+        {
+            trace_span!("initialize_denylist");
+            initialize_denylist();
+        }
+        {
+            trace_span!("init_nethunter_mode");
+            init_nethunter_mode();
+        }
+        {
+            trace_span!("init_hiding");
+            init_solist_hiding();
+            init_seccomp_hiding();
+            init_ptrace_hiding();
+        }
+        {
+            trace_span!("setup_module_mount");
+            setup_module_mount();
+        }
         let modules = self.handle_modules();
         self.module_list.set(modules).ok();
         clean_mounts();
@@ -169,16 +209,22 @@ impl MagiskD {
     }
 
     fn late_start(&self) {
+        trace_span!("late_start");
         setup_logfile();
         info!("** late_start service mode running");
 
-        exec_common_scripts(cstr!("service"));
+        {
+            trace_span!("service scripts");
+            exec_common_scripts(cstr!("service"));
+        }
         if let Some(module_list) = self.module_list.get() {
+            trace_span!("service module scripts");
             exec_module_scripts(cstr!("service"), module_list);
         }
     }
 
     fn boot_complete(&self) {
+        trace_span!("boot_complete");
         setup_logfile();
         info!("** boot-complete triggered");
 
@@ -192,7 +238,10 @@ impl MagiskD {
         }
 
         setup_preinit_dir();
-        self.ensure_manager();
+        {
+            trace_span!("ensure_manager");
+            self.ensure_manager();
+        }
         self.zygisk_reset(true)
     }
 
@@ -254,6 +303,7 @@ pub fn daemon_entry() {
     start_log_daemon();
     magisk_logging();
     info!("Magisk {} daemon started", MAGISK_FULL_VER);
+    setup_trace();
 
     let is_emulator = get_prop(cstr!("ro.kernel.qemu"), false) == "1"
         || get_prop(cstr!("ro.boot.qemu"), false) == "1"
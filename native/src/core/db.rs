@@ -190,7 +190,23 @@ unsafe extern "C" fn read_db_row<T: SqlTable>(
     }
 }
 
+// Anything other than a single SELECT may modify the database
+fn is_read_only(sql: &str) -> bool {
+    let sql = sql.trim();
+    let sql = sql.strip_suffix(';').unwrap_or(sql);
+    let select = sql
+        .get(..6)
+        .is_some_and(|s| s.eq_ignore_ascii_case("select"));
+    select && !sql.contains(';')
+}
+
 impl MagiskD {
+    fn db_written(&self, sql: &str) {
+        if !is_read_only(sql) {
+            self.invalidate_su_info();
+        }
+    }
+
     fn with_db<F: FnOnce(*mut sqlite3) -> i32>(&self, f: F) -> i32 {
         let mut db = self.sql_connection.lock().unwrap();
         if db.is_none() {
@@ -217,7 +233,7 @@ impl MagiskD {
             bind_callback = Some(bind_arguments);
             bind_cookie = (&mut db_args) as *mut DbArgs as *mut c_void;
         }
-        self.with_db(|db| unsafe {
+        let code = self.with_db(|db| unsafe {
             sql_exec_impl(
                 db,
                 sql,
@@ -226,7 +242,9 @@ impl MagiskD {
                 exec_callback,
                 exec_cookie,
             )
-        })
+        });
+        self.db_written(sql);
+        code
     }
 
     pub fn db_exec_with_rows<T: SqlTable>(&self, sql: &str, args: &[DbArg], out: &mut T) -> i32 {
@@ -350,7 +368,8 @@ unsafe extern "C" fn sql_exec_for_cxx(
     exec_cookie: *mut c_void,
 ) -> i32 {
     unsafe {
-        MAGISKD.get().unwrap_unchecked().with_db(|db| {
+        let daemon = MAGISKD.get().unwrap_unchecked();
+        let code = daemon.with_db(|db| {
             sql_exec_impl(
                 db,
                 sql,
@@ -359,6 +378,8 @@ unsafe extern "C" fn sql_exec_for_cxx(
                 exec_callback,
                 exec_cookie,
             )
-        })
+        });
+        daemon.db_written(sql);
+        code
     }
 }
@@ -2,6 +2,7 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <poll.h>
 #include <string>
@@ -65,6 +66,7 @@ void write_any(int fd, T val) {
 }
 
 bool get_client_cred(int fd, sock_cred *cred);
+bool write_iov(int fd, iovec *iov, int iovcnt);
 static inline int read_int(int fd) { return read_any<int>(fd); }
 static inline void write_int(int fd, int val) { write_any(fd, val); }
 std::string read_string(int fd);
@@ -73,8 +75,13 @@ void write_string(int fd, std::string_view str);
 
 template<typename T>
 void write_vector(int fd, const std::vector<T> &vec) {
-    write_int(fd, vec.size());
-    xwrite(fd, vec.data(), vec.size() * sizeof(T));
+    if (fd < 0) return;
+    int size = vec.size();
+    iovec iov[] = {
+        { &size, sizeof(size) },
+        { const_cast<T *>(vec.data()), vec.size() * sizeof(T) },
+    };
+    write_iov(fd, iov, 2);
 }
 
 template<typename T>
@@ -89,10 +96,13 @@ using poll_callback = void(*)(pollfd*);
 void register_poll(const pollfd *pfd, poll_callback callback);
 void unregister_poll(int fd, bool auto_close);
 void clear_poll();
+void register_su_session(int pidfd);
 
 // Thread pool
 void init_thread_pool();
 void exec_task(std::function<void()> &&task);
+// Run fn(i) for every i in [0, n) with at most `jobs` threads, and wait for all to finish
+void exec_parallel(int n, int jobs, const std::function<void(int)> &fn);
 
 // Daemon handlers
 void denylist_handler(int client, const sock_cred *cred);
@@ -107,6 +117,7 @@ void uninstall_pkg(rust::Utf8CStr pkg);
 void exec_common_scripts(rust::Utf8CStr stage);
 void exec_module_scripts(rust::Utf8CStr stage, const rust::Vec<ModuleInfo> &module_list);
 void exec_script(const char *script);
+void print_boot_timings();
 void clear_pkg(const char *pkg, int user_id);
 [[noreturn]] void install_module(const char *file);
 
@@ -130,12 +141,15 @@ void init_nethunter_mode();
 void prepare_modules();
 rust::Vec<ModuleInfo> collect_modules(bool zygisk_enabled, bool open_zygisk);
 void load_modules(bool zygisk_enabled, const rust::Vec<ModuleInfo> &module_list);
+// Debug builds only
+int test_module_scan(const char *root, bool full, const std::vector<std::string> &disable);
 void load_modules_su();
 int get_manager_for_cxx(int user_id, rust::String &pkg, bool install);
 rust::Vec<rust::String> parse_mount_info_rs(const rust::String &pid);
 void setup_logfile();
 void android_logging();
-void restorecon();
+void restorecon(bool boot);
+rust::String dump_trace();
 bool setfilecon(const char *path, const char *con);
 rust::String find_preinit_device();
 
@@ -8,7 +8,7 @@
 #![allow(clippy::missing_safety_doc)]
 
 use crate::ffi::SuRequest;
-use crate::socket::Encodable;
+use crate::socket::IpcWrite;
 use base::{Utf8CStr, libc};
 use cxx::{ExternType, type_id};
 use derive::Decodable;
@@ -28,6 +28,7 @@ mod resetprop;
 mod selinux;
 mod socket;
 mod su;
+mod trace;
 mod zygisk;
 
 #[allow(clippy::needless_lifetimes)]
@@ -39,6 +40,7 @@ mod ffi {
         CHECK_VERSION,
         CHECK_VERSION_CODE,
         STOP_DAEMON,
+        TRACE,
 
         _SYNC_BARRIER_,
 
@@ -110,6 +112,7 @@ mod ffi {
         target_pid: i32,
         login: bool,
         keep_env: bool,
+        server: bool,
         shell: String,
         command: String,
         context: String,
@@ -192,12 +195,15 @@ mod ffi {
         fn app_notify(req: &SuAppRequest, policy: SuPolicy);
         fn app_log(req: &SuAppRequest, policy: SuPolicy, notify: bool);
         fn exec_root_shell(client: i32, pid: i32, req: &mut SuRequest, mode: MntNsMode);
+        fn register_su_session(pidfd: i32);
         fn get_manager_for_cxx(user: i32, pkg: &mut String, install: bool) -> i32;
         fn load_modules_su();
         fn parse_mount_info_rs(pid: &str) -> Vec<String>;
         fn setup_logfile();
         fn android_logging();
-        fn restorecon();
+        fn restorecon(boot: bool);
+        fn test_restorecon(root: &str, manifest: &str) -> i32;
+        fn dump_trace() -> String;
         fn setfilecon(path: &str, con: &str) -> bool;
         fn find_preinit_device() -> String;
     }
@@ -234,7 +240,7 @@ impl SuRequest {
     unsafe fn write_to_fd(&self, fd: i32) {
         unsafe {
             let mut w = ManuallyDrop::new(File::from_raw_fd(fd));
-            self.encode(w.deref_mut()).ok();
+            w.deref_mut().send_encodable(self).ok();
         }
     }
 }
@@ -282,9 +288,16 @@ pub fn android_logging() {
     // This is a placeholder implementation
 }
 
-pub fn restorecon() {
-    // Restore SELinux context
-    // This is a placeholder implementation
+pub fn restorecon(boot: bool) {
+    selinux::restorecon(boot);
+}
+
+pub fn test_restorecon(root: &str, manifest: &str) -> i32 {
+    selinux::test_restorecon(root, manifest)
+}
+
+pub fn dump_trace() -> String {
+    trace::dump_trace()
 }
 
 pub fn setfilecon(_path: &str, _con: &str) -> bool {
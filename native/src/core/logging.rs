@@ -6,10 +6,10 @@ use base::libc::{
     localtime_r, pthread_sigmask, sigaddset, sigset_t, sigtimedwait, time_t, timespec, tm,
 };
 use base::{
-    FsPathBuilder, LOGGER, LogLevel, Logger, ReadExt, Utf8CStr, Utf8CStrBuf, WriteExt,
+    FsPathBuilder, LOGGER, LogLevel, Logger, Utf8CStr, Utf8CStrBuf, WriteExt,
     const_format::concatcp, cstr, libc, raw_cstr,
 };
-use bytemuck::{Pod, Zeroable, bytes_of, write_zeroes};
+use bytemuck::{Pod, Zeroable, bytes_of};
 use num_derive::{FromPrimitive, ToPrimitive};
 use num_traits::FromPrimitive;
 use std::cmp::min;
@@ -22,7 +22,7 @@ use std::os::fd::{FromRawFd, RawFd};
 use std::ptr::null_mut;
 use std::sync::atomic::{AtomicI32, Ordering};
 use std::sync::{Arc, Mutex};
-use std::time::{SystemTime, UNIX_EPOCH};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
 use std::{fs, io};
 
 #[allow(dead_code, non_camel_case_types)]
@@ -261,54 +261,71 @@ impl Write for LogFile {
     }
 }
 
-extern "C" fn logfile_writer(arg: *mut c_void) -> *mut c_void {
-    fn writer_loop(pipefd: RawFd) -> io::Result<()> {
-        let mut pipe = unsafe { File::from_raw_fd(pipefd) };
-        let mut logfile: LogFile = Buffer(Vec::new());
-
-        let mut meta = LogMeta::zeroed();
-        let mut msg_buf = [0u8; MAX_MSG_LEN];
-        let mut aux = cstr::buf::new::<64>();
+// Drain the log pipe with reads of this size
+const PIPE_READ_SIZE: usize = 64 * 1024;
+// Flush formatted logs once this much is pending
+const FLUSH_SIZE: usize = 32 * 1024;
+// Flush pending logs once the pipe stays idle for this long
+const FLUSH_IDLE_MS: u64 = 200;
+// Never hold formatted logs longer than this
+const FLUSH_MAX_DELAY_MS: u64 = 1000;
+// Rotate the log file once it grows past this size
+const LOGFILE_MAX_SIZE: u64 = 4 * 1024 * 1024;
+
+const META_LEN: usize = size_of::<LogMeta>();
+
+struct LogWriter {
+    file: LogFile,
+    file_size: u64,
+    out: Vec<u8>,
+    pending_since: Option<Instant>,
+    urgent: bool,
+    // "%m-%d %T" only changes once per second, so format it once per second
+    ts_sec: u64,
+    ts: cstr::Utf8CStrBufArr<32>,
+}
 
-        loop {
-            // Read request
-            write_zeroes(&mut meta);
-            pipe.read_pod(&mut meta)?;
-
-            if meta.prio < 0 {
-                if let Buffer(ref mut buf) = logfile {
-                    fs::rename(LOGFILE, concatcp!(LOGFILE, ".bak")).ok();
-                    let mut out = File::create(LOGFILE)?;
-                    out.write_all(buf.as_slice())?;
-                    logfile = Actual(out);
-                }
-                continue;
-            }
+impl LogWriter {
+    fn new() -> LogWriter {
+        LogWriter {
+            file: Buffer(Vec::new()),
+            file_size: 0,
+            out: Vec::with_capacity(FLUSH_SIZE + PIPE_BUF),
+            pending_since: None,
+            urgent: false,
+            ts_sec: u64::MAX,
+            ts: cstr::buf::new::<32>(),
+        }
+    }
 
-            if meta.len < 0 || meta.len > MAX_MSG_LEN as i32 {
-                continue;
-            }
+    fn open_logfile(&mut self) -> io::Result<()> {
+        if let Buffer(ref mut buf) = self.file {
+            buf.extend_from_slice(&self.out);
+            self.out.clear();
+            self.pending_since = None;
+            fs::rename(LOGFILE, concatcp!(LOGFILE, ".bak")).ok();
+            let mut out = File::create(LOGFILE)?;
+            out.write_all(buf.as_slice())?;
+            self.file_size = buf.len() as u64;
+            self.file = Actual(out);
+        }
+        Ok(())
+    }
 
-            // Read the rest of the message
-            let msg = &mut msg_buf[..(meta.len as usize)];
-            pipe.read_exact(msg)?;
-
-            // Start building the log string
-            aux.clear();
-            let prio =
-                ALogPriority::from_i32(meta.prio).unwrap_or(ALogPriority::ANDROID_LOG_UNKNOWN);
-            let prio = match prio {
-                ALogPriority::ANDROID_LOG_VERBOSE => 'V',
-                ALogPriority::ANDROID_LOG_DEBUG => 'D',
-                ALogPriority::ANDROID_LOG_INFO => 'I',
-                ALogPriority::ANDROID_LOG_WARN => 'W',
-                ALogPriority::ANDROID_LOG_ERROR => 'E',
-                // Unsupported values, skip
-                _ => continue,
-            };
-
-            let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap();
+    fn append(&mut self, meta: &LogMeta, msg: &[u8]) {
+        let prio = ALogPriority::from_i32(meta.prio).unwrap_or(ALogPriority::ANDROID_LOG_UNKNOWN);
+        let prio = match prio {
+            ALogPriority::ANDROID_LOG_VERBOSE => 'V',
+            ALogPriority::ANDROID_LOG_DEBUG => 'D',
+            ALogPriority::ANDROID_LOG_INFO => 'I',
+            ALogPriority::ANDROID_LOG_WARN => 'W',
+            ALogPriority::ANDROID_LOG_ERROR => 'E',
+            // Unsupported values, skip
+            _ => return,
+        };
 
+        let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap();
+        if now.as_secs() != self.ts_sec {
             // Note: the obvious better implementation is to use the rust chrono crate, however
             // the crate cannot fetch the proper local timezone without pulling in a bunch of
             // timezone handling code. To reduce binary size, fallback to use localtime_r in libc.
@@ -316,29 +333,134 @@ extern "C" fn logfile_writer(arg: *mut c_void) -> *mut c_void {
                 let secs: time_t = now.as_secs() as time_t;
                 let mut tm: tm = std::mem::zeroed();
                 if localtime_r(&secs, &mut tm).is_null() {
+                    return;
+                }
+                let len =
+                    strftime(self.ts.as_mut_ptr(), self.ts.capacity(), raw_cstr!("%m-%d %T"), &tm);
+                self.ts.set_len(len);
+            }
+            self.ts_sec = now.as_secs();
+        }
+
+        self.out.extend_from_slice(self.ts.as_bytes());
+        write!(
+            self.out,
+            ".{:03} {:5} {:5} {} : ",
+            now.subsec_millis(),
+            meta.pid,
+            meta.tid,
+            prio
+        )
+        .ok();
+        self.out.extend_from_slice(msg);
+
+        if self.pending_since.is_none() {
+            self.pending_since = Some(Instant::now());
+        }
+        // Make sure errors hit the disk even if the daemon goes down right after
+        if prio == 'E' {
+            self.urgent = true;
+        }
+    }
+
+    // How long to wait for more logs before flushing, None if nothing is pending
+    fn flush_timeout(&self) -> Option<i32> {
+        let since = self.pending_since?;
+        let max = Duration::from_millis(FLUSH_MAX_DELAY_MS).saturating_sub(since.elapsed());
+        Some(min(max, Duration::from_millis(FLUSH_IDLE_MS)).as_millis() as i32)
+    }
+
+    fn should_flush(&self) -> bool {
+        self.urgent
+            || self.out.len() >= FLUSH_SIZE
+            || self
+                .pending_since
+                .is_some_and(|t| t.elapsed() >= Duration::from_millis(FLUSH_MAX_DELAY_MS))
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.pending_since = None;
+        self.urgent = false;
+        if self.out.is_empty() {
+            return Ok(());
+        }
+        let result = self.file.write_all(&self.out);
+        let len = self.out.len() as u64;
+        self.out.clear();
+        result?;
+        if let Actual(_) = self.file {
+            self.file_size += len;
+            if self.file_size >= LOGFILE_MAX_SIZE {
+                fs::rename(LOGFILE, concatcp!(LOGFILE, ".bak")).ok();
+                self.file = Actual(File::create(LOGFILE)?);
+                self.file_size = 0;
+            }
+        }
+        Ok(())
+    }
+}
+
+extern "C" fn logfile_writer(arg: *mut c_void) -> *mut c_void {
+    fn writer_loop(pipefd: RawFd, writer: &mut LogWriter) -> io::Result<()> {
+        let mut pipe = unsafe { File::from_raw_fd(pipefd) };
+        let mut buf = vec![0u8; PIPE_READ_SIZE];
+        let mut filled = 0;
+
+        loop {
+            if let Some(timeout) = writer.flush_timeout() {
+                let mut pfd = libc::pollfd {
+                    fd: pipefd,
+                    events: libc::POLLIN,
+                    revents: 0,
+                };
+                if unsafe { libc::poll(&mut pfd, 1, timeout) } == 0 {
+                    writer.flush()?;
+                    continue;
+                }
+            }
+
+            // Drain everything available in the pipe at once
+            let len = pipe.read(&mut buf[filled..])?;
+            if len == 0 {
+                return Err(io::ErrorKind::UnexpectedEof.into());
+            }
+            filled += len;
+
+            let mut pos = 0;
+            while filled - pos >= META_LEN {
+                let meta: LogMeta = bytemuck::pod_read_unaligned(&buf[pos..(pos + META_LEN)]);
+
+                if meta.prio < 0 {
+                    pos += META_LEN;
+                    writer.open_logfile()?;
                     continue;
                 }
-                let len = strftime(aux.as_mut_ptr(), aux.capacity(), raw_cstr!("%m-%d %T"), &tm);
-                aux.set_len(len);
-                aux.write_fmt(format_args!(
-                    ".{:03} {:5} {:5} {} : ",
-                    now.subsec_millis(),
-                    meta.pid,
-                    meta.tid,
-                    prio
-                ))
-                .ok();
+
+                if meta.len < 0 || meta.len > MAX_MSG_LEN as i32 {
+                    pos += META_LEN;
+                    continue;
+                }
+
+                // Wait for the rest of the message
+                let end = pos + META_LEN + meta.len as usize;
+                if end > filled {
+                    break;
+                }
+                writer.append(&meta, &buf[(pos + META_LEN)..end]);
+                pos = end;
             }
+            buf.copy_within(pos..filled, 0);
+            filled -= pos;
 
-            let io1 = IoSlice::new(aux.as_bytes());
-            let io2 = IoSlice::new(msg);
-            // We don't need to care the written len because we are writing less than PIPE_BUF
-            // It's guaranteed to always write the whole thing atomically
-            let _ = logfile.write_vectored(&[io1, io2])?;
+            if writer.should_flush() {
+                writer.flush()?;
+            }
         }
     }
 
-    writer_loop(arg as RawFd).ok();
+    let mut writer = LogWriter::new();
+    writer_loop(arg as RawFd, &mut writer).ok();
+    writer.flush().ok();
     // If any error occurs, shut down the logd pipe
     *MAGISK_LOGD_FD.lock().unwrap() = None;
     null_mut()
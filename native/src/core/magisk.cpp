@@ -22,6 +22,8 @@ Options:
    --list                    list all available applets
    --remove-modules [-n]     remove all modules, reboot if -n is not provided
    --install-module ZIP      install a module zip file
+   --boot-timings            print start time, duration and exit code of boot scripts
+   --trace                   print boot stage timeline as Chrome trace JSON
 
 Advanced Options (Internal APIs):
    --daemon                  manually start magisk daemon
@@ -73,7 +75,7 @@ int magisk_main(int argc, char *argv[]) {
         unlock_blocks();
         return 0;
     } else if (argv[1] == "--restorecon"sv) {
-        restorecon();
+        restorecon(false);
         return 0;
     } else if (argc >= 4 && argv[1] == "--clone-attr"sv) {
         clone_attr(argv[2], argv[3]);
@@ -106,11 +108,15 @@ int magisk_main(int argc, char *argv[]) {
     } else if (argc >= 3 && argv[1] == "--sqlite"sv) {
         int fd = connect_daemon(+RequestCode::SQLITE_CMD);
         write_string(fd, argv[2]);
+        // Rows are streamed back to back, read them through a buffer
+        auto fp = make_file(fdopen(fd, "re"));
         string res;
-        for (;;) {
-            read_string(fd, res);
-            if (res.empty())
+        for (int len;;) {
+            if (fread(&len, sizeof(len), 1, fp.get()) != 1 || len <= 0)
                 return 0;
+            res.resize(len);
+            if (fread(res.data(), 1, len, fp.get()) != (size_t) len)
+                return 1;
             printf("%s\n", res.data());
         }
     } else if (argv[1] == "--remove-modules"sv) {
@@ -132,6 +138,19 @@ int magisk_main(int argc, char *argv[]) {
             return 0;
         }
         return 1;
+    } else if (argv[1] == "--boot-timings"sv) {
+        print_boot_timings();
+        return 0;
+    } else if (argv[1] == "--trace"sv) {
+        int fd = connect_daemon(+RequestCode::TRACE);
+        string json = read_string(fd);
+        close(fd);
+        if (json.empty()) {
+            fprintf(stderr, "Tracing is disabled, create " TRACE_FLAG " and reboot\n");
+            return 1;
+        }
+        printf("%s\n", json.data());
+        return 0;
     } else if (argc >= 3 && argv[1] == "--install-module"sv) {
         install_module(argv[2]);
     } else if (argv[1] == "--preinit-device"sv) {
@@ -142,6 +161,20 @@ int magisk_main(int argc, char *argv[]) {
         }
         return 1;
     }
+#if MAGISK_DEBUG
+    /* Run the module scans of post-fs-data on a module tree other than MODULEROOT */
+    else if (argc >= 3 && argv[1] == "--test-module-scan"sv) {
+        bool full = argv[2] == "--full"sv;
+        int idx = full ? 3 : 2;
+        if (idx >= argc)
+            usage();
+        return test_module_scan(argv[idx], full, vector<string>(argv + idx + 1, argv + argc));
+    }
+    /* The boot restorecon walk on any tree, with a user xattr in place of the label */
+    else if (argc >= 4 && argv[1] == "--test-restorecon"sv) {
+        return test_restorecon(argv[2], argv[3]);
+    }
+#endif
 #if 0
     /* Entry point for testing stuffs */
     else if (argv[1] == "--test"sv) {
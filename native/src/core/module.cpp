@@ -8,10 +8,12 @@
 #include <utility>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <base.hpp>
 #include <consts.hpp>
 #include <core.hpp>
+#include <flags.h>
 
 #include "node.hpp"
 
@@ -19,6 +21,8 @@ using namespace std;
 
 #define VLOGD(tag, from, to) LOGD("%-8s: %s <- %s\n", tag, to, from)
 
+#define MODULE_SCAN_JOBS 4
+
 static int bind_mount(const char *reason, const char *from, const char *to) {
     int ret = xmount(from, to, nullptr, MS_BIND | MS_REC, nullptr);
     if (ret == 0)
@@ -57,12 +61,11 @@ bool dir_node::prepare() {
         // - Target does not exist
         // - Source or target is a symlink (since we cannot bind mount symlink) or whiteout
         bool cannot_mnt;
-        if (struct stat st{}; lstat(it->second->node_path().data(), &st) != 0) {
+        if (auto state = it->second->probe_target(); state == TARGET_MISSING) {
             // if it's a whiteout, we don't care if the target doesn't exist
             cannot_mnt = !it->second->is_wht();
         } else {
-            it->second->set_exist(true);
-            cannot_mnt = it->second->is_lnk() || S_ISLNK(st.st_mode) || it->second->is_wht();
+            cannot_mnt = it->second->is_lnk() || state == TARGET_LNK || it->second->is_wht();
         }
 
         if (cannot_mnt) {
@@ -90,6 +93,78 @@ bool dir_node::prepare() {
     return upgrade_to_tmpfs;
 }
 
+uint8_t node_entry::probe_target() {
+    if (target_state() == TARGET_UNKNOWN) {
+        if (struct stat st{}; lstat(node_path().data(), &st) != 0) {
+            set_target_state(TARGET_MISSING);
+        } else {
+            set_exist(true);
+            set_target_state(S_ISLNK(st.st_mode) ? TARGET_LNK : TARGET_FOUND);
+        }
+    }
+    return target_state();
+}
+
+void dir_node::probe_targets() {
+    // Resolve all node paths up front, as the path cache is not thread safe
+    vector<node_entry *> nodes;
+    function<void(dir_node *)> collect = [&](dir_node *dir) {
+        for (auto &pair : dir->children) {
+            pair.second->node_path();
+            nodes.push_back(pair.second);
+            if (auto dn = dyn_cast<dir_node>(pair.second))
+                collect(dn);
+        }
+    };
+    collect(this);
+
+    // These are independent lstat calls dominated by I/O latency
+    exec_parallel(nodes.size(), MODULE_SCAN_JOBS, [&](int i) { nodes[i]->probe_target(); });
+}
+
+void dir_node::dump(string &out, const string &path) {
+    for (auto &[_, node] : children) {
+        auto p = path + '/' + node->_name;
+        char buf[64];
+        ssprintf(buf, sizeof(buf), " type=%d file=%d exist=%d",
+                 node->_node_type, node->file_type(), node->exist());
+        out += p;
+        out += buf;
+        if (auto mn = dyn_cast<module_node>(node)) {
+            out += " module=";
+            out += mn->module;
+        }
+        if (auto dn = dyn_cast<dir_node>(node)) {
+            out += dn->replace() ? " replace\n" : "\n";
+            dn->dump(out, p);
+        } else {
+            out += '\n';
+        }
+    }
+}
+
+void dir_node::merge(dir_node *other) {
+    if (other->replace())
+        set_replace(true);
+
+    for (auto it = other->children.begin(); it != other->children.end();) {
+        node_entry *node = it->second;
+        it = other->children.erase(it);
+        if (auto dn = dyn_cast<inter_node>(node)) {
+            if (auto ex = children.find(dn->name()); ex != children.end()) {
+                // Directories are only merged into existing directories
+                if (auto in = dyn_cast<inter_node>(ex->second))
+                    in->merge(dn);
+                delete dn;
+                continue;
+            }
+        }
+        // Files from earlier modules take precedence
+        if (!insert(node))
+            delete node;
+    }
+}
+
 void dir_node::collect_module_files(std::string_view module, int dfd) {
     auto dir = xopen_dir(xopenat(dfd, name().data(), O_RDONLY | O_CLOEXEC));
     if (!dir)
@@ -284,14 +359,61 @@ static void inject_zygisk_libs(root_node *system) {
     }
 }
 
-void load_modules(bool zygisk_enabled, const rust::Vec<ModuleInfo> &module_list) {
-    node_entry::module_mnt =  get_magisk_tmp() + "/"s MODULEMNT "/";
-
+// Build the prepared node tree of all modules, or null if there is nothing to mount.
+// Modules are collected concurrently into their own trees then merged in module order,
+// unless parallel is false, in which case the tree is built with a serial walk.
+static unique_ptr<root_node> build_mount_plan(
+        const vector<pair<const ModuleInfo *, int>> &mount_list, bool zygisk_enabled, bool parallel) {
     auto root = make_unique<root_node>("");
     auto system = new root_node("system");
     root->insert(system);
 
+    if (parallel) {
+        vector<unique_ptr<root_node>> module_trees(mount_list.size());
+        exec_parallel(mount_list.size(), MODULE_SCAN_JOBS, [&](int i) {
+            auto &[m, fd] = mount_list[i];
+            module_trees[i] = make_unique<root_node>("system");
+            module_trees[i]->collect_module_files({ m->name.begin(), m->name.end() }, fd);
+        });
+        for (auto &tree : module_trees)
+            system->merge(tree.get());
+    } else {
+        for (auto &[m, fd] : mount_list)
+            system->collect_module_files({ m->name.begin(), m->name.end() }, fd);
+    }
+
+    if (get_magisk_tmp() != "/sbin"sv || !str_contains(getenv("PATH") ?: "", "/sbin")) {
+        // Need to inject our binaries into /system/bin
+        inject_magisk_bins(system);
+    }
+
+    if (zygisk_enabled)
+        inject_zygisk_libs(system);
+
+    if (system->is_empty())
+        return nullptr;
+
+    // Handle special read-only partitions
+    for (const char *part : { "/vendor", "/product", "/system_ext" }) {
+        struct stat st{};
+        if (lstat(part, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (auto old = system->extract(part + 1)) {
+                auto new_node = new root_node(old);
+                root->insert(new_node);
+            }
+        }
+    }
+    if (parallel)
+        root->probe_targets();
+    root->prepare();
+    return root;
+}
+
+void load_modules(bool zygisk_enabled, const rust::Vec<ModuleInfo> &module_list) {
+    node_entry::module_mnt =  get_magisk_tmp() + "/"s MODULEMNT "/";
+
     char buf[4096];
+    vector<pair<const ModuleInfo *, int>> mount_list;
     LOGI("* Loading modules\n");
     for (const auto &m : module_list) {
         char *b = buf + ssprintf(buf, sizeof(buf), "%s/" MODULEMNT "/%.*s/",
@@ -317,13 +439,7 @@ void load_modules(bool zygisk_enabled, const rust::Vec<ModuleInfo> &module_list)
 
         LOGI("%.*s: loading mount files\n", (int) m.name.size(), m.name.data());
         b[-1] = '\0';
-        int fd = xopen(buf, O_RDONLY | O_CLOEXEC);
-        system->collect_module_files({ m.name.begin(), m.name.end() }, fd);
-        close(fd);
-    }
-    if (get_magisk_tmp() != "/sbin"sv || !str_contains(getenv("PATH") ?: "", "/sbin")) {
-        // Need to inject our binaries into /system/bin
-        inject_magisk_bins(system);
+        mount_list.emplace_back(&m, xopen(buf, O_RDONLY | O_CLOEXEC));
     }
 
     if (zygisk_enabled) {
@@ -339,23 +455,25 @@ void load_modules(bool zygisk_enabled, const rust::Vec<ModuleInfo> &module_list)
         if (get_prop("ro.maple.enable") == "1") {
             set_prop("ro.maple.enable", "0");
         }
-        inject_zygisk_libs(system);
     }
 
-    if (!system->is_empty()) {
-        // Handle special read-only partitions
-        for (const char *part : { "/vendor", "/product", "/system_ext" }) {
-            struct stat st{};
-            if (lstat(part, &st) == 0 && S_ISDIR(st.st_mode)) {
-                if (auto old = system->extract(part + 1)) {
-                    auto new_node = new root_node(old);
-                    root->insert(new_node);
-                }
-            }
-        }
-        root->prepare();
-        root->mount();
+    auto root = build_mount_plan(mount_list, zygisk_enabled, true);
+#if MAGISK_DEBUG
+    // The parallel plan has to be identical to the one built by a plain serial walk
+    auto serial = build_mount_plan(mount_list, zygisk_enabled, false);
+    string plan, serial_plan;
+    if (root) root->dump(plan);
+    if (serial) serial->dump(serial_plan);
+    if (plan != serial_plan) {
+        LOGE("* Parallel mount plan differs from serial plan\n");
+        LOGD("parallel:\n%s", plan.data());
+        LOGD("serial:\n%s", serial_plan.data());
     }
+#endif
+    for (auto &[_, fd] : mount_list)
+        close(fd);
+    if (root)
+        root->mount();
 }
 
 /************************
@@ -404,60 +522,154 @@ static void foreach_module(Func fn) {
     }
 }
 
-rust::Vec<ModuleInfo> collect_modules(bool zygisk_enabled, bool open_zygisk) {
-    rust::Vec<ModuleInfo> modules;
-    foreach_module([&](int dfd, dirent *entry, int modfd) {
-        if (faccessat(modfd, "remove", F_OK, 0) == 0) {
-            LOGI("%s: remove\n", entry->d_name);
-            auto uninstaller = MODULEROOT + "/"s + entry->d_name + "/uninstall.sh";
-            if (access(uninstaller.data(), F_OK) == 0)
-                exec_script(uninstaller.data());
-            frm_rf(xdup(modfd));
-            unlinkat(dfd, entry->d_name, AT_REMOVEDIR);
-            return;
+enum class module_state { removed, skipped, enabled };
+
+static bool same_time(const timespec &a, const timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool before(const timespec &a, const timespec &b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Result of checking a module directory, valid as long as the directory is unchanged
+struct module_scan {
+    dev_t dev;
+    ino_t ino;
+    timespec mtime;
+    timespec ctime;
+    // Start of the scan that checked the directory
+    timespec scanned;
+    bool zygisk;
+    bool enabled;
+
+    bool matches(const struct stat &st, bool zygisk_enabled) const {
+        // Same as racily clean git index entries: a change within the timestamp granularity
+        // of the scan would not be visible in mtime or ctime, so only trust older timestamps
+        return dev == st.st_dev && ino == st.st_ino && zygisk == zygisk_enabled &&
+               same_time(mtime, st.st_mtim) && same_time(ctime, st.st_ctim) &&
+               before(mtime, scanned) && before(ctime, scanned);
+    }
+};
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, module_scan, less<>> module_scans;
+
+static module_state check_module(const char *root, int dfd, const char *name, int modfd,
+                                 bool zygisk_enabled) {
+    if (faccessat(modfd, "remove", F_OK, 0) == 0) {
+        LOGI("%s: remove\n", name);
+        auto uninstaller = root + "/"s + name + "/uninstall.sh";
+        if (access(uninstaller.data(), F_OK) == 0)
+            exec_script(uninstaller.data());
+        frm_rf(xdup(modfd));
+        unlinkat(dfd, name, AT_REMOVEDIR);
+        return module_state::removed;
+    }
+    unlinkat(modfd, "update", 0);
+    if (faccessat(modfd, "disable", F_OK, 0) == 0)
+        return module_state::skipped;
+
+    if (zygisk_enabled) {
+        // Riru and its modules are not compatible with zygisk
+        if (name == "riru-core"sv || faccessat(modfd, "riru", F_OK, 0) == 0) {
+            LOGI("%s: ignore\n", name);
+            return module_state::skipped;
         }
-        unlinkat(modfd, "update", 0);
-        if (faccessat(modfd, "disable", F_OK, 0) == 0)
-            return;
+    } else {
+        // Ignore zygisk modules when zygisk is not enabled
+        if (faccessat(modfd, "zygisk", F_OK, 0) == 0) {
+            LOGI("%s: ignore\n", name);
+            return module_state::skipped;
+        }
+    }
+    return module_state::enabled;
+}
 
-        ModuleInfo info{{}, -1, -1};
-        if (zygisk_enabled) {
-            // Riru and its modules are not compatible with zygisk
-            if (entry->d_name == "riru-core"sv || faccessat(modfd, "riru", F_OK, 0) == 0) {
-                LOGI("%s: ignore\n", entry->d_name);
-                return;
-            }
-            if (open_zygisk) {
+static void open_zygisk_libs(int modfd, ModuleInfo &info) {
 #if defined(__arm__)
-                info.z32 = openat(modfd, "zygisk/armeabi-v7a.so", O_RDONLY | O_CLOEXEC);
-                info.z64 = -1;
+    info.z32 = openat(modfd, "zygisk/armeabi-v7a.so", O_RDONLY | O_CLOEXEC);
+    info.z64 = -1;
 #elif defined(__aarch64__)
-                info.z32 = openat(modfd, "zygisk/armeabi-v7a.so", O_RDONLY | O_CLOEXEC);
-                info.z64 = openat(modfd, "zygisk/arm64-v8a.so", O_RDONLY | O_CLOEXEC);
+    info.z32 = openat(modfd, "zygisk/armeabi-v7a.so", O_RDONLY | O_CLOEXEC);
+    info.z64 = openat(modfd, "zygisk/arm64-v8a.so", O_RDONLY | O_CLOEXEC);
 #elif defined(__i386__)
-                info.z32 = openat(modfd, "zygisk/x86.so", O_RDONLY | O_CLOEXEC);
-                info.z64 = -1;
+    info.z32 = openat(modfd, "zygisk/x86.so", O_RDONLY | O_CLOEXEC);
+    info.z64 = -1;
 #elif defined(__x86_64__)
-                info.z32 = openat(modfd, "zygisk/x86.so", O_RDONLY | O_CLOEXEC);
-                info.z64 = openat(modfd, "zygisk/x86_64.so", O_RDONLY | O_CLOEXEC);
+    info.z32 = openat(modfd, "zygisk/x86.so", O_RDONLY | O_CLOEXEC);
+    info.z64 = openat(modfd, "zygisk/x86_64.so", O_RDONLY | O_CLOEXEC);
 #elif defined(__riscv)
-                info.z32 = -1;
-                info.z64 = openat(modfd, "zygisk/riscv64.so", O_RDONLY | O_CLOEXEC);
+    info.z32 = -1;
+    info.z64 = openat(modfd, "zygisk/riscv64.so", O_RDONLY | O_CLOEXEC);
 #else
 #error Unsupported ABI
 #endif
-                unlinkat(modfd, "zygisk/unloaded", 0);
-            }
+    unlinkat(modfd, "zygisk/unloaded", 0);
+}
+
+static rust::Vec<ModuleInfo> collect_modules(const char *root, bool zygisk_enabled, bool open_zygisk) {
+    rust::Vec<ModuleInfo> modules;
+    auto dir = open_dir(root);
+    if (!dir)
+        return modules;
+
+    // Modules are only checked again if their directory changed since the previous scan,
+    // which is usually none of them when recollecting after post-fs-data scripts
+    mutex_guard g(scan_lock);
+    map<string, module_scan, less<>> scans;
+    // File timestamps come from the coarse clock, a finer start time could be ahead of them
+    timespec start{};
+    clock_gettime(CLOCK_REALTIME_COARSE, &start);
+    int dfd = dirfd(dir.get());
+    for (dirent *entry; (entry = xreaddir(dir.get()));) {
+        if (entry->d_type != DT_DIR || entry->d_name == ".core"sv)
+            continue;
+        struct stat st{};
+        if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        int modfd = -1;
+        module_scan scan{};
+        if (auto it = module_scans.find(entry->d_name);
+                it != module_scans.end() && it->second.matches(st, zygisk_enabled)) {
+            scan = it->second;
         } else {
-            // Ignore zygisk modules when zygisk is not enabled
-            if (faccessat(modfd, "zygisk", F_OK, 0) == 0) {
-                LOGI("%s: ignore\n", entry->d_name);
-                return;
+            modfd = xopenat(dfd, entry->d_name, O_RDONLY | O_CLOEXEC);
+            auto state = check_module(root, dfd, entry->d_name, modfd, zygisk_enabled);
+            if (state == module_state::removed) {
+                close(modfd);
+                continue;
             }
+            // The checks above may have modified the directory
+            fstat(modfd, &st);
+            scan = {
+                .dev = st.st_dev,
+                .ino = st.st_ino,
+                .mtime = st.st_mtim,
+                .ctime = st.st_ctim,
+                .scanned = start,
+                .zygisk = zygisk_enabled,
+                .enabled = state == module_state::enabled,
+            };
         }
-        info.name = entry->d_name;
-        modules.push_back(std::move(info));
-    });
+        scans.emplace(entry->d_name, scan);
+
+        if (scan.enabled) {
+            ModuleInfo info{{}, -1, -1};
+            if (zygisk_enabled && open_zygisk) {
+                if (modfd < 0)
+                    modfd = xopenat(dfd, entry->d_name, O_RDONLY | O_CLOEXEC);
+                open_zygisk_libs(modfd, info);
+            }
+            info.name = entry->d_name;
+            modules.push_back(std::move(info));
+        }
+        if (modfd >= 0)
+            close(modfd);
+    }
+    module_scans = std::move(scans);
+
     if (zygisk_enabled) {
         bool use_memfd = true;
         auto convert_to_memfd = [&](int fd) -> int {
@@ -484,11 +696,79 @@ rust::Vec<ModuleInfo> collect_modules(bool zygisk_enabled, bool open_zygisk) {
     return modules;
 }
 
+rust::Vec<ModuleInfo> collect_modules(bool zygisk_enabled, bool open_zygisk) {
+    return collect_modules(MODULEROOT, zygisk_enabled, open_zygisk);
+}
+
+#if MAGISK_DEBUG
+static int count_memfds() {
+    int count = 0;
+    char path[PATH_MAX];
+    auto dir = open_dir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    for (dirent *entry; (entry = xreaddir(dir.get()));) {
+        ssize_t len = readlinkat(dirfd(dir.get()), entry->d_name, path, sizeof(path) - 1);
+        if (len > 0) {
+            path[len] = '\0';
+            if (str_starts(path, "/memfd:jit-cache"))
+                ++count;
+        }
+    }
+    return count;
+}
+
+// magisk --test-module-scan: run the two scans of handle_modules on the module tree in root,
+// disabling the modules in disable between them like post-fs-data scripts would.
+// With full, the second scan checks every module again like before scan results were kept.
+// Run it under strace -c to count the syscalls of each variant.
+int test_module_scan(const char *root, bool full, const vector<string> &disable) {
+    auto elapsed = [](timespec &begin) {
+        timespec end{};
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+        begin = end;
+        return ms;
+    };
+    auto close_all = [](rust::Vec<ModuleInfo> &list) {
+        for (auto &m : list) {
+            if (m.z32 >= 0) close(m.z32);
+            if (m.z64 >= 0) close(m.z64);
+        }
+    };
+
+    timespec t{};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    module_scans.clear();
+    auto initial = collect_modules(root, true, false);
+    double scan_ms = elapsed(t);
+
+    for (auto &name : disable) {
+        auto flag = root + "/"s + name + "/disable";
+        close(xopen(flag.data(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    if (full)
+        module_scans.clear();
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    auto list = collect_modules(root, true, true);
+    double rescan_ms = elapsed(t);
+    int memfds = count_memfds();
+    close_all(list);
+
+    printf("{\"modules\":%zu,\"enabled\":%zu,\"full\":%s,\"scan_ms\":%.3f,"
+           "\"rescan_ms\":%.3f,\"memfds\":%d}\n",
+           initial.size(), list.size(), full ? "true" : "false", scan_ms, rescan_ms, memfds);
+    // Disabled modules have to be dropped even though their earlier result was kept
+    return list.size() + disable.size() == initial.size() ? 0 : 1;
+}
+#endif
+
 rust::Vec<ModuleInfo> MagiskD::handle_modules() const noexcept {
     bool zygisk = zygisk_enabled();
     prepare_modules();
     exec_module_scripts("post-fs-data", collect_modules(zygisk, false));
-    // Recollect modules (module scripts could remove itself)
+    // Recollect modules (module scripts could remove itself),
+    // only modules whose directory changed are checked again
     auto list = collect_modules(zygisk, true);
     load_modules(zygisk, list);
     return list;
@@ -70,6 +70,15 @@ protected:
     bool exist() const { return static_cast<bool>(_file_type & (1 << 7)); }
     void set_exist(bool b) { if (b) _file_type |= (1 << 7); else _file_type &= ~(1 << 7); }
 
+    // Use bit 4-5 of _file_type to cache the lstat result of the target
+    enum : uint8_t { TARGET_UNKNOWN, TARGET_MISSING, TARGET_FOUND, TARGET_LNK };
+    uint8_t target_state() const { return static_cast<uint8_t>((_file_type >> 4) & 3); }
+    void set_target_state(uint8_t s) { _file_type = (_file_type & ~(3 << 4)) | (s << 4); }
+
+    // lstat the target on the real filesystem only once.
+    // node_path() has to be resolved before calling this concurrently.
+    uint8_t probe_target();
+
 private:
     friend class dir_node;
 
@@ -107,10 +116,19 @@ public:
     // Traverse through module directories to generate a tree of module files
     void collect_module_files(std::string_view module, int dfd);
 
+    // Merge a tree collected from another module, as if it was collected into this tree
+    void merge(dir_node *other);
+
+    // Probe all targets in the tree on the real filesystem in parallel ahead of prepare
+    void probe_targets();
+
     // Traverse through the real filesystem and prepare the tree for magic mount.
     // Return true to indicate that this node needs to be upgraded to tmpfs_node.
     bool prepare();
 
+    // Serialize the tree as a sorted list of nodes, one per line, to compare mount plans
+    void dump(string &out, const string &path = "");
+
     // Default directory mount logic
     void mount() override {
         for (auto &pair : children)
@@ -288,6 +306,8 @@ public:
 
     void mount() override;
 private:
+    friend class dir_node;
+
     std::string_view module;
 };
 
@@ -20,7 +20,7 @@ use std::time::Duration;
 const EOCD_MAGIC: u32 = 0x06054B50;
 const APK_SIGNING_BLOCK_MAGIC: [u8; 16] = *b"APK Sig Block 42";
 const SIGNATURE_SCHEME_V2_MAGIC: u32 = 0x7109871A;
-const PACKAGES_XML: &str = "/data/system/packages.xml";
+pub(crate) const PACKAGES_XML: &str = "/data/system/packages.xml";
 
 macro_rules! bad_apk {
     ($msg:literal) => {
@@ -203,13 +203,13 @@ impl Default for ManagerInfo {
 }
 
 #[derive(Default)]
-struct TrackedFile {
+pub(crate) struct TrackedFile {
     path: Utf8CString,
     timestamp: Duration,
 }
 
 impl TrackedFile {
-    fn new(path: Utf8CString) -> TrackedFile {
+    pub(crate) fn new(path: Utf8CString) -> TrackedFile {
         let attr = match path.get_attr() {
             Ok(attr) => attr,
             Err(_) => return TrackedFile::default(),
@@ -218,7 +218,7 @@ impl TrackedFile {
         TrackedFile { path, timestamp }
     }
 
-    fn is_same(&self) -> bool {
+    pub(crate) fn is_same(&self) -> bool {
         if self.path.is_empty() {
             return false;
         }
@@ -380,6 +380,9 @@ impl ManagerInfo {
             };
         }
 
+        // The manager may have changed, su info built against the old one is stale
+        daemon.invalidate_su_info();
+
         if !db_pkg.is_empty() {
             match self.check_stub(user, &db_pkg) {
                 Status::Installed => {
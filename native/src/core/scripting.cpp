@@ -1,5 +1,6 @@
 #include <string>
 #include <vector>
+#include <climits>
 #include <sys/wait.h>
 
 #include <consts.hpp>
@@ -39,39 +40,166 @@ void exec_script(const char *script) {
 
 static timespec pfs_timeout;
 
-#define PFS_SETUP() \
-if (pfs) { \
-    if (int pid = xfork()) { \
-        if (pid < 0) \
-            return; \
-        /* In parent process, simply wait for child to finish */ \
-        waitpid(pid, nullptr, 0); \
-        return; \
-    } \
-    timer_pid = xfork(); \
-    if (timer_pid == 0) { \
-        /* In timer process, count down */ \
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pfs_timeout, nullptr); \
-        exit(0); \
-    } \
+static bool operator>(const timespec &a, const timespec &b) {
+    if (a.tv_sec != b.tv_sec)
+        return a.tv_sec > b.tv_sec;
+    return a.tv_nsec > b.tv_nsec;
+}
+
+struct boot_script {
+    string name;
+    string path;
+    // Indices of scripts in the same batch that have to finish before this one starts
+    vector<int> after;
+    int pid = -1;
+    bool done = false;
+};
+
+static long boot_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
-#define PFS_WAIT() \
-if (pfs) { \
-    /* If we ran out of time, don't block */ \
-    if (timer_pid < 0) \
-        continue; \
-    if (int pid = waitpid(-1, nullptr, 0); pid == timer_pid) { \
-        LOGW("* post-fs-data scripts blocking phase timeout\n"); \
-        timer_pid = -1; \
-    } \
+static void record_timing(int fd, const char *stage, const boot_script &s,
+                          const char *event, int status = 0) {
+    if (fd < 0)
+        return;
+    char buf[4096];
+    // A single O_APPEND write keeps records from concurrent runners intact
+    int len = ssprintf(buf, sizeof(buf), "%s\t%s\t%s\t%ld\t%d\n",
+                       stage, s.name.data(), event, boot_ms(), status);
+    write(fd, buf, len);
+}
+
+static int script_jobs() {
+    int jobs = -1;
+    file_readline(true, SCRIPT_JOBS_FILE, [&](string_view line) -> bool {
+        jobs = parse_int(line);
+        return false;
+    });
+    return jobs > 0 ? jobs : SCRIPT_DEF_JOBS;
 }
 
-#define PFS_DONE() \
-if (pfs) { \
-    if (timer_pid > 0) \
-        kill(timer_pid, SIGKILL); \
-    exit(0); \
+static void run_scripts(const char *stage, vector<boot_script> &scripts, bool pfs, bool module) {
+    if (scripts.empty())
+        return;
+
+    // Run everything in a supervisor process so the daemon itself never reaps scripts.
+    // post-fs-data blocks until the supervisor finishes or the phase times out,
+    // every other stage detaches it and moves on. In those stages the supervisor
+    // only waits for scripts others are ordered after, and exits once every script
+    // is started, leaving the rest to init like fork_dont_care would.
+    int timer_pid = -1;
+    if (pfs) {
+        if (int pid = xfork()) {
+            if (pid < 0)
+                return;
+            /* In parent process, simply wait for child to finish */
+            waitpid(pid, nullptr, 0);
+            return;
+        }
+        timer_pid = xfork();
+        if (timer_pid == 0) {
+            /* In timer process, count down */
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pfs_timeout, nullptr);
+            exit(0);
+        }
+    } else if (fork_dont_care()) {
+        return;
+    }
+
+    // Service scripts commonly never exit, so only post-fs-data is throttled
+    int jobs = pfs ? script_jobs() : INT_MAX;
+    char path[4096];
+    ssprintf(path, sizeof(path), "%s/" SCRIPT_TIMINGS, get_magisk_tmp());
+    owned_fd timings = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    // Timings of general scripts are recorded under e.g. post-fs-data.d
+    string tag = module ? stage : stage + ".d"s;
+    int running = 0;
+    size_t left = scripts.size();
+    size_t pending = scripts.size();
+
+    auto start = [&](boot_script &s) {
+        if (module)
+            LOGI("%s: exec [%s.sh]\n", s.name.data(), stage);
+        else
+            LOGI("%s: exec [%s]\n", tag.data(), s.name.data());
+        --pending;
+        exec_t exec {
+            .pre_exec = set_script_env,
+            .fork = xfork
+        };
+        record_timing(timings, tag.data(), s, "start");
+        s.pid = exec_command(exec, BBEXEC_CMD, s.path.data());
+        if (s.pid < 0) {
+            s.done = true;
+            --left;
+            record_timing(timings, tag.data(), s, "end", 127);
+        } else {
+            ++running;
+        }
+    };
+    auto ready = [&](const boot_script &s) {
+        if (s.pid >= 0 || s.done)
+            return false;
+        for (int i : s.after) {
+            if (!scripts[i].done)
+                return false;
+        }
+        return true;
+    };
+
+    while (left) {
+        for (auto &s : scripts) {
+            if (running >= jobs)
+                break;
+            if (ready(s))
+                start(s);
+        }
+        if (!pfs && pending == 0)
+            break;
+        if (running == 0) {
+            // Ordering hints form a cycle, break it in list order
+            for (auto &s : scripts) {
+                if (s.pid < 0 && !s.done) {
+                    start(s);
+                    break;
+                }
+            }
+            continue;
+        }
+
+        int status;
+        int pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            break;
+        if (pid == timer_pid) {
+            LOGW("* post-fs-data scripts blocking phase timeout\n");
+            timer_pid = -1;
+            // If we ran out of time, launch whatever is left and stop blocking
+            for (auto &s : scripts) {
+                if (s.pid < 0 && !s.done)
+                    start(s);
+            }
+            break;
+        }
+        for (auto &s : scripts) {
+            if (s.pid == pid && !s.done) {
+                s.done = true;
+                --running;
+                --left;
+                int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                record_timing(timings, tag.data(), s, "end", code);
+                break;
+            }
+        }
+    }
+
+    if (timer_pid > 0)
+        kill(timer_pid, SIGKILL);
+    exit(0);
 }
 
 void exec_common_scripts(rust::Utf8CStr stage) {
@@ -82,38 +210,25 @@ void exec_common_scripts(rust::Utf8CStr stage) {
     if (!dir) return;
 
     bool pfs = stage == "post-fs-data"sv;
-    int timer_pid = -1;
     if (pfs) {
         // Setup timer
         clock_gettime(CLOCK_MONOTONIC, &pfs_timeout);
         pfs_timeout.tv_sec += POST_FS_DATA_SCRIPT_MAX_TIME;
     }
-    PFS_SETUP()
 
+    vector<boot_script> scripts;
     *(name++) = '/';
     int dfd = dirfd(dir.get());
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
         if (entry->d_type == DT_REG) {
             if (faccessat(dfd, entry->d_name, X_OK, 0) != 0)
                 continue;
-            LOGI("%s.d: exec [%s]\n", stage.c_str(), entry->d_name);
             strcpy(name, entry->d_name);
-            exec_t exec {
-                .pre_exec = set_script_env,
-                .fork = pfs ? xfork : fork_dont_care
-            };
-            exec_command(exec, BBEXEC_CMD, path);
-            PFS_WAIT()
+            scripts.push_back({ .name = entry->d_name, .path = path });
         }
     }
 
-    PFS_DONE()
-}
-
-static bool operator>(const timespec &a, const timespec &b) {
-    if (a.tv_sec != b.tv_sec)
-        return a.tv_sec > b.tv_sec;
-    return a.tv_nsec > b.tv_nsec;
+    run_scripts(stage.c_str(), scripts, pfs, false);
 }
 
 void exec_module_scripts(rust::Utf8CStr stage, const rust::Vec<ModuleInfo> &module_list) {
@@ -129,24 +244,80 @@ void exec_module_scripts(rust::Utf8CStr stage, const rust::Vec<ModuleInfo> &modu
         if (now > pfs_timeout)
             pfs = false;
     }
-    int timer_pid = -1;
-    PFS_SETUP()
 
+    vector<boot_script> scripts;
+    vector<string> hints;
     char path[4096];
     for (auto &m : module_list) {
         sprintf(path, MODULEROOT "/%.*s/%s.sh", (int) m.name.size(), m.name.data(), stage.c_str());
         if (access(path, F_OK) == -1)
             continue;
-        LOGI("%.*s: exec [%s.sh]\n", (int) m.name.size(), m.name.data(), stage.c_str());
-        exec_t exec {
-            .pre_exec = set_script_env,
-            .fork = pfs ? xfork : fork_dont_care
-        };
-        exec_command(exec, BBEXEC_CMD, path);
-        PFS_WAIT()
+        scripts.push_back({ .name = string(m.name.data(), m.name.size()), .path = path });
+        // Optional ordering hint: ids of modules whose script of the same stage must finish first
+        sprintf(path, MODULEROOT "/%.*s/" SCRIPT_AFTER_FILE, (int) m.name.size(), m.name.data());
+        hints.emplace_back();
+        file_readline(true, path, [&](string_view line) -> bool {
+            hints.back() += line;
+            hints.back() += ' ';
+            return true;
+        });
+    }
+    for (size_t i = 0; i < scripts.size(); ++i) {
+        for (auto &dep : split(hints[i], " \t")) {
+            for (size_t j = 0; j < scripts.size(); ++j) {
+                if (j != i && scripts[j].name == dep) {
+                    scripts[i].after.push_back(j);
+                    break;
+                }
+            }
+        }
     }
 
-    PFS_DONE()
+    run_scripts(stage.c_str(), scripts, pfs, true);
+}
+
+void print_boot_timings() {
+    struct timing {
+        string stage;
+        string name;
+        long start;
+        long end = -1;
+        int status = 0;
+    };
+    vector<timing> list;
+
+    char path[4096];
+    ssprintf(path, sizeof(path), "%s/" SCRIPT_TIMINGS, get_magisk_tmp());
+    file_readline(path, [&](string_view line) -> bool {
+        auto f = split(line, "\t");
+        if (f.size() != 5)
+            return true;
+        long ms = strtol(f[3].data(), nullptr, 10);
+        if (f[2] == "start") {
+            list.push_back({ .stage = f[0], .name = f[1], .start = ms });
+            return true;
+        }
+        // Match the latest start of the same script
+        for (auto it = list.rbegin(); it != list.rend(); ++it) {
+            if (it->end < 0 && it->stage == f[0] && it->name == f[1]) {
+                it->end = ms;
+                it->status = parse_int(f[4]);
+                break;
+            }
+        }
+        return true;
+    });
+
+    printf("%-16s %-32s %10s %10s %6s\n", "STAGE", "SCRIPT", "START(ms)", "TIME(ms)", "EXIT");
+    for (auto &t : list) {
+        if (t.end < 0) {
+            printf("%-16s %-32s %10ld %10s %6s\n",
+                   t.stage.data(), t.name.data(), t.start, "-", "-");
+        } else {
+            printf("%-16s %-32s %10ld %10ld %6d\n",
+                   t.stage.data(), t.name.data(), t.start, t.end - t.start, t.status);
+        }
+    }
 }
 
 constexpr char install_script[] = R"EOF(
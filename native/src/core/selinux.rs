@@ -1,38 +1,214 @@
-use crate::consts::{DATABIN, LOG_PIPE, MAGISK_LOG_CON, MODULEROOT, SECURE_DIR};
+use crate::consts::{
+    DATABIN, LOG_PIPE, MAGISK_LOG_CON, MAGISK_VER_CODE, MODULEROOT, RESTORECON_MANIFEST, SECURE_DIR,
+};
 use crate::ffi::get_magisk_tmp;
-use base::libc::{O_CLOEXEC, O_WRONLY};
-use base::{Directory, FsPathBuilder, LoggedResult, ResultExt, Utf8CStr, Utf8CStrBuf, cstr, libc};
-use std::io::Write;
+use base::libc::{O_CLOEXEC, O_RDONLY, O_TRUNC, O_WRONLY};
+use base::{
+    BufReadExt, Directory, FsPathBuilder, LoggedResult, ResultExt, Utf8CStr, Utf8CStrBuf, cstr,
+    debug, libc,
+};
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::hash::{DefaultHasher, Hasher};
+use std::io::{BufReader, Read, Write};
+use std::mem;
+use std::os::fd::AsRawFd;
 
 const UNLABEL_CON: &Utf8CStr = cstr!("u:object_r:unlabeled:s0");
 const SYSTEM_CON: &Utf8CStr = cstr!("u:object_r:system_file:s0");
 const ADB_CON: &Utf8CStr = cstr!("u:object_r:adb_data_file:s0");
 const ROOT_CON: &Utf8CStr = cstr!("u:object_r:rootfs:s0");
 
-fn restore_syscon_from_unlabeled(
+// Inode and timestamps of a file or directory after it was relabeled.
+// Setting a label or an owner updates the ctime, so a relabel done after
+// the manifest was written is noticed even if it left the mtime alone.
+#[derive(Clone, Copy, PartialEq, Eq)]
+struct FileStamp {
+    ino: u64,
+    mtime: (i64, i64),
+    ctime: (i64, i64),
+}
+
+impl FileStamp {
+    fn get(path: &Utf8CStr) -> Option<FileStamp> {
+        let mut st: libc::stat = unsafe { mem::zeroed() };
+        if unsafe { libc::lstat(path.as_ptr(), &mut st) } != 0 {
+            return None;
+        }
+        Some(FileStamp {
+            ino: st.st_ino as u64,
+            mtime: (st.st_mtime as i64, st.st_mtime_nsec as i64),
+            ctime: (st.st_ctime as i64, st.st_ctime_nsec as i64),
+        })
+    }
+
+    fn parse(s: &str) -> Option<(FileStamp, &str)> {
+        let mut it = s.splitn(6, ' ');
+        let mut next = || it.next()?.parse::<i64>().ok();
+        let stamp = FileStamp {
+            ino: next()? as u64,
+            mtime: (next()?, next()?),
+            ctime: (next()?, next()?),
+        };
+        Some((stamp, it.next()?))
+    }
+
+    // A change made within the same timestamp tick as the manifest was written
+    // would not be visible, so like racily clean git index entries, only stamps
+    // older than the manifest itself are trusted
+    fn before(&self, time: (i64, i64)) -> bool {
+        self.mtime < time && self.ctime < time
+    }
+}
+
+fn now() -> (i64, i64) {
+    let mut ts: libc::timespec = unsafe { mem::zeroed() };
+    // Inode timestamps come from the coarse clock
+    unsafe { libc::clock_gettime(libc::CLOCK_REALTIME_COARSE, &mut ts) };
+    (ts.tv_sec as i64, ts.tv_nsec as i64)
+}
+
+// During boot, files and directories that are unchanged since the previous run are not
+// relabeled again. Directories are still read to find new entries. The whole manifest is
+// discarded when either Magisk or the loaded policy changes.
+struct RestoreconManifest {
+    key: String,
+    stamps: HashMap<String, FileStamp>,
+    // When the loaded stamps were written
+    written: (i64, i64),
+    output: String,
+    checked: usize,
+    skipped: usize,
+}
+
+impl RestoreconManifest {
+    fn policy_key() -> String {
+        // Any change to rules or types changes the policy contents, but not always its size
+        let mut hasher = DefaultHasher::new();
+        if let Ok(mut file) = cstr!("/sys/fs/selinux/policy").open(O_RDONLY | O_CLOEXEC) {
+            let mut policy = Vec::new();
+            if file.read_to_end(&mut policy).is_ok() {
+                hasher.write(&policy);
+            }
+        }
+        format!("{} {:016x}", MAGISK_VER_CODE, hasher.finish())
+    }
+
+    fn load(path: &Utf8CStr, key: String, use_stamps: bool) -> RestoreconManifest {
+        let mut stamps = HashMap::new();
+        let mut written = (0, 0);
+        if use_stamps && let Ok(file) = path.open(O_RDONLY | O_CLOEXEC) {
+            let mut valid = None;
+            BufReader::new(file).foreach_lines(|line| {
+                let line = line.trim_end_matches('\n');
+                if valid.is_none() {
+                    valid = Some(line == key);
+                } else if written == (0, 0) {
+                    let mut it = line.split(' ').map(|n| n.parse::<i64>().unwrap_or(0));
+                    written = (it.next().unwrap_or(0), it.next().unwrap_or(0));
+                } else if let Some((stamp, path)) = FileStamp::parse(line) {
+                    stamps.insert(path.to_string(), stamp);
+                }
+                valid == Some(true)
+            });
+            if valid != Some(true) {
+                stamps.clear();
+            }
+        }
+        RestoreconManifest {
+            key,
+            stamps,
+            written,
+            output: String::new(),
+            checked: 0,
+            skipped: 0,
+        }
+    }
+
+    fn unchanged(&self, path: &Utf8CStr) -> bool {
+        self.stamps
+            .get(path.as_str())
+            .is_some_and(|s| s.before(self.written) && Some(*s) == FileStamp::get(path))
+    }
+
+    fn record(&mut self, path: &Utf8CStr) {
+        if path.as_str().contains('\n') {
+            return;
+        }
+        if let Some(s) = FileStamp::get(path) {
+            writeln!(
+                self.output,
+                "{} {} {} {} {} {}",
+                s.ino, s.mtime.0, s.mtime.1, s.ctime.0, s.ctime.1, path
+            )
+            .ok();
+        }
+    }
+
+    fn save(&self, path: &Utf8CStr) {
+        debug!(
+            "restorecon: {} entries checked, {} skipped [{}]",
+            self.checked, self.skipped, self.key
+        );
+        let result: LoggedResult<()> = try {
+            let mut file = path.create(O_WRONLY | O_TRUNC | O_CLOEXEC, 0o600)?;
+            let (sec, nsec) = now();
+            write!(file, "{}\n{} {}\n", self.key, sec, nsec)?;
+            file.write_all(self.output.as_bytes())?;
+        };
+        result.ok();
+    }
+}
+
+fn restore_entry(
     path: &mut dyn Utf8CStrBuf,
-    con: &mut dyn Utf8CStrBuf,
+    manifest: &mut RestoreconManifest,
+    fix: &mut dyn FnMut(&mut dyn Utf8CStrBuf) -> LoggedResult<()>,
 ) -> LoggedResult<()> {
-    let dir_path_len = path.len();
-    if path.get_secontext(con).log().is_ok() && con.as_str() == UNLABEL_CON {
-        path.set_secontext(SYSTEM_CON)?;
+    if manifest.unchanged(path) {
+        manifest.skipped += 1;
+    } else {
+        manifest.checked += 1;
+        fix(path)?;
     }
+    manifest.record(path);
+    Ok(())
+}
+
+fn restore_tree(
+    path: &mut dyn Utf8CStrBuf,
+    manifest: &mut RestoreconManifest,
+    fix: &mut dyn FnMut(&mut dyn Utf8CStrBuf) -> LoggedResult<()>,
+) -> LoggedResult<()> {
+    let dir_path_len = path.len();
+    restore_entry(path, manifest, fix)?;
     let mut dir = Directory::open(path)?;
     while let Some(ref e) = dir.read()? {
         path.truncate(dir_path_len);
         path.append_path(e.name());
         if e.is_dir() {
-            restore_syscon_from_unlabeled(path, con)?;
-        } else if (e.is_file() || e.is_symlink())
-            && path.get_secontext(con).log().is_ok()
-            && con.as_str() == UNLABEL_CON
-        {
-            path.set_secontext(SYSTEM_CON)?;
+            restore_tree(path, manifest, fix)?;
+        } else if e.is_file() || e.is_symlink() {
+            restore_entry(path, manifest, fix)?;
         }
     }
+    path.truncate(dir_path_len);
     Ok(())
 }
 
+fn restore_syscon_from_unlabeled(
+    path: &mut dyn Utf8CStrBuf,
+    con: &mut dyn Utf8CStrBuf,
+    manifest: &mut RestoreconManifest,
+) -> LoggedResult<()> {
+    restore_tree(path, manifest, &mut |path| {
+        if path.get_secontext(con).log().is_ok() && con.as_str() == UNLABEL_CON {
+            path.set_secontext(SYSTEM_CON)?;
+        }
+        Ok(())
+    })
+}
+
 fn restore_syscon(path: &mut dyn Utf8CStrBuf) -> LoggedResult<()> {
     let dir_path_len = path.len();
     path.set_secontext(SYSTEM_CON)?;
@@ -51,7 +227,7 @@ fn restore_syscon(path: &mut dyn Utf8CStrBuf) -> LoggedResult<()> {
     Ok(())
 }
 
-pub(crate) fn restorecon() {
+pub(crate) fn restorecon(boot: bool) {
     if let Ok(mut file) = cstr!("/sys/fs/selinux/context")
         .open(O_WRONLY | O_CLOEXEC)
         .log()
@@ -61,15 +237,63 @@ pub(crate) fn restorecon() {
         }
     }
 
+    // Outside of boot every file is checked again and the manifest is rewritten
+    let manifest_path = cstr!(RESTORECON_MANIFEST);
+    let mut manifest =
+        RestoreconManifest::load(manifest_path, RestoreconManifest::policy_key(), boot);
     let mut path = cstr::buf::default();
     let mut con = cstr::buf::new::<1024>();
     path.push_str(MODULEROOT);
     path.set_secontext(SYSTEM_CON).log_ok();
-    restore_syscon_from_unlabeled(&mut path, &mut con).log_ok();
+    restore_syscon_from_unlabeled(&mut path, &mut con, &mut manifest).log_ok();
 
     path.clear();
     path.push_str(DATABIN);
+    // Only a few binaries, always relabel and chown all of them
     restore_syscon(&mut path).log_ok();
+    manifest.save(manifest_path);
+}
+
+// magisk --test-restorecon: the boot walk over any tree, with the user.magisk.test
+// xattr in place of the SELinux label, so that it runs on a tmpfs without a policy
+pub(crate) fn test_restorecon(root: &str, manifest_path: &str) -> i32 {
+    const XATTR: &Utf8CStr = cstr!("user.magisk.test");
+    let mut manifest_buf = cstr::buf::default();
+    manifest_buf.push_str(manifest_path);
+    let mut manifest = RestoreconManifest::load(&manifest_buf, "test".to_string(), true);
+    let mut fixed = 0;
+    let mut path = cstr::buf::default();
+    path.push_str(root);
+    let result = restore_tree(&mut path, &mut manifest, &mut |path| {
+        let mut val = [0u8; 32];
+        let sz = unsafe {
+            libc::lgetxattr(
+                path.as_ptr(),
+                XATTR.as_ptr(),
+                val.as_mut_ptr().cast(),
+                val.len(),
+            )
+        };
+        if sz > 0 && &val[..sz as usize] == b"unlabeled" {
+            unsafe {
+                libc::lsetxattr(
+                    path.as_ptr(),
+                    XATTR.as_ptr(),
+                    b"system".as_ptr().cast(),
+                    6,
+                    0,
+                )
+            };
+            fixed += 1;
+        }
+        Ok(())
+    });
+    manifest.save(&manifest_buf);
+    println!(
+        "{{\"checked\":{},\"skipped\":{},\"fixed\":{}}}",
+        manifest.checked, manifest.skipped, fixed
+    );
+    if result.is_ok() { 0 } else { 1 }
 }
 
 pub(crate) fn restore_tmpcon() -> LoggedResult<()> {
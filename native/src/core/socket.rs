@@ -63,6 +63,29 @@ impl Decodable for bool {
     }
 }
 
+macro_rules! impl_tuple_encodable {
+    ($($t:ident $i:tt),*) => {
+        impl<$($t: Encodable),*> Encodable for ($($t,)*) {
+            fn encoded_len(&self) -> usize {
+                0 $(+ self.$i.encoded_len())*
+            }
+
+            fn encode(&self, w: &mut impl Write) -> io::Result<()> {
+                $(self.$i.encode(w)?;)*
+                Ok(())
+            }
+        }
+        impl<$($t: Decodable),*> Decodable for ($($t,)*) {
+            fn decode(r: &mut impl Read) -> io::Result<Self> {
+                Ok(($($t::decode(r)?,)*))
+            }
+        }
+    };
+}
+
+impl_tuple_encodable! { A 0, B 1 }
+impl_tuple_encodable! { A 0, B 1, C 2 }
+
 impl<T: Decodable> Encodable for Vec<T> {
     fn encoded_len(&self) -> usize {
         size_of::<i32>() + size_of::<T>() * self.len()
@@ -128,6 +151,7 @@ impl<T: Read> IpcRead for T {
 
 pub trait IpcWrite {
     fn write_encodable<E: Encodable + ?Sized>(&mut self, val: &E) -> io::Result<()>;
+    fn send_encodable<E: Encodable + ?Sized>(&mut self, val: &E) -> io::Result<()>;
 }
 
 impl<T: Write> IpcWrite for T {
@@ -135,15 +159,58 @@ impl<T: Write> IpcWrite for T {
     fn write_encodable<E: Encodable + ?Sized>(&mut self, val: &E) -> io::Result<()> {
         val.encode(self)
     }
+
+    // Encode the whole message first so it goes out with a single write
+    fn send_encodable<E: Encodable + ?Sized>(&mut self, val: &E) -> io::Result<()> {
+        let mut buf = Vec::with_capacity(val.encoded_len());
+        val.encode(&mut buf)?;
+        self.write_all(&buf)
+    }
+}
+
+// Reads from peeked data, remembering whether the message ran past it
+struct PeekReader<'a> {
+    data: &'a [u8],
+    short: bool,
+}
+
+impl Read for PeekReader<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if self.data.is_empty() && !buf.is_empty() {
+            self.short = true;
+        }
+        self.data.read(buf)
+    }
 }
 
 pub trait UnixSocketExt {
+    fn recv_decodable<E: Decodable>(&mut self) -> io::Result<E>;
     fn send_fds(&mut self, fd: &[RawFd]) -> io::Result<()>;
     fn recv_fd(&mut self) -> io::Result<Option<OwnedFd>>;
     fn recv_fds(&mut self) -> io::Result<Vec<OwnedFd>>;
 }
 
 impl UnixSocketExt for UnixStream {
+    fn recv_decodable<E: Decodable>(&mut self) -> io::Result<E> {
+        // A message sent with a single write is usually queued as a whole,
+        // decode it from peeked data and consume it with one more read.
+        let mut buf = [0u8; 4096];
+        let len = self.peek(&mut buf)?;
+        let mut r = PeekReader {
+            data: &buf[..len],
+            short: false,
+        };
+        if let Ok(val) = E::decode(&mut r)
+            && !r.short
+        {
+            let consumed = len - r.data.len();
+            self.read_exact(&mut buf[..consumed])?;
+            return Ok(val);
+        }
+        // Partially queued or too large, read field by field
+        E::decode(self)
+    }
+
     fn send_fds(&mut self, fds: &[RawFd]) -> io::Result<()> {
         match fds.len() {
             0 => self.write_pod(&0)?,
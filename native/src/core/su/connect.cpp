@@ -1,5 +1,9 @@
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <deque>
 
 #include <base.hpp>
 #include <consts.hpp>
@@ -19,8 +23,14 @@ using namespace std;
 // 0x18800020 = FLAG_ACTIVITY_NEW_TASK|FLAG_ACTIVITY_MULTIPLE_TASK|
 //              FLAG_ACTIVITY_EXCLUDE_FROM_RECENTS|FLAG_INCLUDE_STOPPED_PACKAGES
 
+// Log and notify events are flushed to the manager in batches
+#define EVENT_BATCH_MAX  16
+#define EVENT_QUEUE_MAX  256
+// Time to wait for more events to arrive before flushing
+#define EVENT_DELAY_MS   100
+
 class Extra {
-    const char *key;
+    string key;
     enum {
         INT,
         BOOL,
@@ -35,10 +45,10 @@ class Extra {
     };
     string str;
 public:
-    Extra(const char *k, int v): key(k), type(INT), int_val(v) {}
-    Extra(const char *k, bool v): key(k), type(BOOL), bool_val(v) {}
-    Extra(const char *k, const char *v): key(k), type(STRING), str_val(v) {}
-    Extra(const char *k, const vector<uint32_t> *v): key(k), type(INTLIST), intlist_val(v) {}
+    Extra(string k, int v): key(std::move(k)), type(INT), int_val(v) {}
+    Extra(string k, bool v): key(std::move(k)), type(BOOL), bool_val(v) {}
+    Extra(string k, const char *v): key(std::move(k)), type(STRING), str_val(v) {}
+    Extra(string k, const vector<uint32_t> *v): key(std::move(k)), type(INTLIST), intlist_val(v) {}
 
     void add_intent(vector<const char *> &vec) {
         const char *val;
@@ -66,7 +76,7 @@ public:
             val = str.data();
             break;
         }
-        vec.push_back(key);
+        vec.push_back(key.data());
         vec.push_back(val);
     }
 
@@ -120,34 +130,40 @@ static bool check_no_error(int fd) {
     return true;
 }
 
-static void exec_cmd(const char *action, vector<Extra> &data,
-                     const SuAppRequest &info, bool provider = true) {
+// Call a method of the manager's content provider, return the output of the call
+static int call_provider(const char *action, vector<Extra> &data,
+                         string_view mgr_pkg, int user_id) {
     char target[128];
     char user[4];
-    ssprintf(user, sizeof(user), "%d", to_user_id(info.eval_uid));
+    ssprintf(user, sizeof(user), "%d", user_id);
+    ssprintf(target, sizeof(target), "content://%.*s.provider",
+             (int) mgr_pkg.size(), mgr_pkg.data());
+    vector<const char *> args{ CALL_PROVIDER };
+    for (auto &e : data) {
+        e.add_bind(args);
+    }
+    args.push_back(nullptr);
+    exec_t exec {
+        .err = true,
+        .fd = -1,
+        .pre_exec = [] { setenv("CLASSPATH", "/system/framework/content.jar", 1); },
+        .argv = args.data()
+    };
+    exec_command_sync(exec);
+    return exec.fd;
+}
 
+static void exec_cmd(const char *action, vector<Extra> &data,
+                     string_view mgr_pkg, int user_id, bool provider = true) {
     // First try content provider call method
-    if (provider) {
-        ssprintf(target, sizeof(target), "content://%.*s.provider",
-                 (int) info.mgr_pkg.size(), info.mgr_pkg.data());
-        vector<const char *> args{ CALL_PROVIDER };
-        for (auto &e : data) {
-            e.add_bind(args);
-        }
-        args.push_back(nullptr);
-        exec_t exec {
-            .err = true,
-            .fd = -1,
-            .pre_exec = [] { setenv("CLASSPATH", "/system/framework/content.jar", 1); },
-            .argv = args.data()
-        };
-        exec_command_sync(exec);
-        if (check_no_error(exec.fd))
-            return;
-    }
+    if (provider && check_no_error(call_provider(action, data, mgr_pkg, user_id)))
+        return;
 
     // Then try start activity with package name
-    ssprintf(target, sizeof(target), "%.*s", (int) info.mgr_pkg.size(), info.mgr_pkg.data());
+    char target[128];
+    char user[4];
+    ssprintf(user, sizeof(user), "%d", user_id);
+    ssprintf(target, sizeof(target), "%.*s", (int) mgr_pkg.size(), mgr_pkg.data());
     vector<const char *> args{ START_ACTIVITY };
     for (auto &e : data) {
         e.add_intent(args);
@@ -162,41 +178,201 @@ static void exec_cmd(const char *action, vector<Extra> &data,
     exec_command(exec);
 }
 
-void app_log(const SuAppRequest &info, SuPolicy policy, bool notify) {
-    if (fork_dont_care() == 0) {
-        string context = (string) info.request.context;
-        string command = info.request.command.empty()
-            ? (string) info.request.shell
-            : (string) info.request.command;
+struct su_event {
+    const char *action;
+    string mgr_pkg;
+    int user_id;
 
-        vector<Extra> extras;
-        extras.reserve(9);
-        extras.emplace_back("from.uid", info.uid);
-        extras.emplace_back("to.uid", info.request.target_uid);
-        extras.emplace_back("pid", info.pid);
-        extras.emplace_back("policy", +policy);
-        extras.emplace_back("target", info.request.target_pid);
-        extras.emplace_back("context", context.data());
-        extras.emplace_back("gids", &info.request.gids);
-        extras.emplace_back("command", command.data());
-        extras.emplace_back("notify", notify);
-
-        exec_cmd("log", extras, info);
-        exit(0);
+    int from_uid;
+    int to_uid;
+    int pid;
+    int policy;
+    int target;
+    string context;
+    string command;
+    vector<uint32_t> gids;
+    bool notify;
+
+    su_event(const char *action, const SuAppRequest &info, SuPolicy policy) :
+    action(action), mgr_pkg(info.mgr_pkg.data(), info.mgr_pkg.size()),
+    user_id(to_user_id(info.eval_uid)), from_uid(info.uid), to_uid(info.request.target_uid),
+    pid(info.pid), policy(+policy), target(info.request.target_pid), notify(false) {}
+
+    void add_extras(vector<Extra> &extras, const string &prefix) const {
+        extras.emplace_back(prefix + "from.uid", from_uid);
+        extras.emplace_back(prefix + "pid", pid);
+        extras.emplace_back(prefix + "policy", policy);
+        if (action == "log"sv) {
+            extras.emplace_back(prefix + "to.uid", to_uid);
+            extras.emplace_back(prefix + "target", target);
+            extras.emplace_back(prefix + "context", context.data());
+            // A comma separated list, the string SuCallbackHandler reads into SuLog.gids
+            extras.emplace_back(prefix + "gids", &gids);
+            extras.emplace_back(prefix + "command", command.data());
+            extras.emplace_back(prefix + "notify", notify);
+        }
     }
+};
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER_MONOTONIC_NP;
+
+// The following variables should be guarded by event_lock
+static deque<su_event> event_queue;
+static bool dispatcher_running = false;
+
+static atomic<size_t> events_queued;
+static atomic<size_t> events_dropped;
+static atomic<size_t> events_flushed;
+
+// Only a manager that understands the batch method acknowledges it in the returned bundle
+static bool check_batch_ack(int fd) {
+    char buf[1024];
+    bool ack = false;
+    auto out = xopen_file(fd, "r");
+    while (fgets(buf, sizeof(buf), out.get())) {
+        if (strstr(buf, "batch=true"))
+            ack = true;
+    }
+    return ack;
 }
 
-void app_notify(const SuAppRequest &info, SuPolicy policy) {
-    if (fork_dont_care() == 0) {
+static void flush_event(const su_event &event) {
+    vector<Extra> extras;
+    event.add_extras(extras, "");
+    exec_cmd(event.action, extras, event.mgr_pkg, event.user_id);
+}
+
+// Managers that did not acknowledge a batch, guarded by the single dispatcher thread.
+// Flush workers report them back as newline terminated package names through batch_pipe.
+static vector<string> no_batch_pkgs;
+static string no_batch_buf;
+static int batch_pipe[2] = { -1, -1 };
+
+static void read_no_batch_pkgs() {
+    char buf[PIPE_BUF];
+    for (ssize_t len; (len = read(batch_pipe[0], buf, sizeof(buf))) > 0;) {
+        no_batch_buf.append(buf, len);
+    }
+    for (size_t end; (end = no_batch_buf.find('\n')) != string::npos;) {
+        auto pkg = no_batch_buf.substr(0, end);
+        no_batch_buf.erase(0, end + 1);
+        if (std::find(no_batch_pkgs.begin(), no_batch_pkgs.end(), pkg) == no_batch_pkgs.end()) {
+            LOGD("su_event: batch not acknowledged by [%s]\n", pkg.data());
+            no_batch_pkgs.push_back(std::move(pkg));
+        }
+    }
+}
+
+static void flush_events(const su_event *events, int count) {
+    const string &pkg = events->mgr_pkg;
+    read_no_batch_pkgs();
+    bool batch = count > 1 &&
+            std::find(no_batch_pkgs.begin(), no_batch_pkgs.end(), pkg) == no_batch_pkgs.end();
+
+    // Calling the manager takes a while, do it in a detached worker
+    // so the daemon neither waits for nor reaps the app_process children
+    if (fork_dont_care() != 0)
+        return;
+
+    if (batch) {
         vector<Extra> extras;
-        extras.reserve(3);
-        extras.emplace_back("from.uid", info.uid);
-        extras.emplace_back("pid", info.pid);
-        extras.emplace_back("policy", +policy);
+        extras.reserve(count * 10 + 1);
+        extras.emplace_back("count", count);
+        for (int i = 0; i < count; ++i) {
+            string prefix = to_string(i) + ".";
+            extras.emplace_back(prefix + "action", events[i].action);
+            events[i].add_extras(extras, prefix);
+        }
+        if (check_batch_ack(call_provider("batch", extras, pkg, events->user_id)))
+            exit(0);
+        // Older managers silently ignore unknown methods, resend everything one by one
+        string msg = pkg + '\n';
+        write(batch_pipe[1], msg.data(), msg.size());
+    }
+    for (int i = 0; i < count; ++i) {
+        flush_event(events[i]);
+    }
+    exit(0);
+}
+
+static void *event_dispatcher(void *) {
+    // Block all signals
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, nullptr);
 
-        exec_cmd("notify", extras, info);
-        exit(0);
+    if (batch_pipe[0] < 0)
+        xpipe2(batch_pipe, O_CLOEXEC | O_NONBLOCK);
+
+    vector<su_event> batch;
+    for (;;) {
+        {
+            mutex_guard g(event_lock);
+            if (event_queue.empty()) {
+                dispatcher_running = false;
+                return nullptr;
+            }
+            // Give a burst of su requests the chance to land in the same batch
+            if (event_queue.size() < EVENT_BATCH_MAX) {
+                timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ts.tv_nsec += EVENT_DELAY_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&event_cond, &event_lock, &ts);
+            }
+            // A batch goes through a single provider, so only group events for the same manager
+            auto &head = event_queue.front();
+            string pkg = head.mgr_pkg;
+            int user_id = head.user_id;
+            while (!event_queue.empty() && batch.size() < EVENT_BATCH_MAX &&
+                   event_queue.front().mgr_pkg == pkg && event_queue.front().user_id == user_id) {
+                batch.push_back(std::move(event_queue.front()));
+                event_queue.pop_front();
+            }
+        }
+        // New events keep queueing up while the batch is being handed off
+        flush_events(batch.data(), batch.size());
+        events_flushed += batch.size();
+        LOGD("su_event: queued=[%zu] dropped=[%zu] flushed=[%zu]\n",
+             events_queued.load(), events_dropped.load(), events_flushed.load());
+        batch.clear();
+    }
+}
+
+static void queue_event(su_event &&event) {
+    mutex_guard g(event_lock);
+    if (event_queue.size() >= EVENT_QUEUE_MAX) {
+        // The manager cannot keep up, drop the event instead of piling up processes
+        if (events_dropped++ == 0)
+            LOGW("su_event: queue full, dropping events\n");
+        return;
     }
+    event_queue.push_back(std::move(event));
+    ++events_queued;
+    if (dispatcher_running) {
+        pthread_cond_signal(&event_cond);
+    } else if (new_daemon_thread(event_dispatcher) == 0) {
+        dispatcher_running = true;
+    }
+}
+
+void app_log(const SuAppRequest &info, SuPolicy policy, bool notify) {
+    su_event event("log", info, policy);
+    event.context = (string) info.request.context;
+    event.command = info.request.command.empty()
+        ? (string) info.request.shell
+        : (string) info.request.command;
+    event.gids.assign(info.request.gids.begin(), info.request.gids.end());
+    event.notify = notify;
+    queue_event(std::move(event));
+}
+
+void app_notify(const SuAppRequest &info, SuPolicy policy) {
+    queue_event(su_event("notify", info, policy));
 }
 
 int app_request(const SuAppRequest &info) {
@@ -213,7 +389,7 @@ int app_request(const SuAppRequest &info) {
     extras.emplace_back("fifo", fifo);
     extras.emplace_back("uid", info.eval_uid);
     extras.emplace_back("pid", info.pid);
-    exec_cmd("request", extras, info, false);
+    exec_cmd("request", extras, info.mgr_pkg, to_user_id(info.eval_uid), false);
 
     // Wait for data input for at most 70 seconds
     // Open with O_RDWR to prevent FIFO open block
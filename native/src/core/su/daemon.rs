@@ -3,18 +3,33 @@ use crate::daemon::{AID_ROOT, AID_SHELL, MagiskD, to_app_id, to_user_id};
 use crate::db::{DbSettings, MultiuserMode, RootAccess};
 use crate::ffi::{
     DbEntryKey, SuAppRequest, SuPolicy, SuRequest, app_log, app_notify, app_request, exec_root_shell, is_deny_target,
+    register_su_session,
 };
-use crate::socket::IpcRead;
+use crate::package::{PACKAGES_XML, TrackedFile};
+use crate::socket::{IpcRead, UnixSocketExt};
 use crate::su::db::RootSettings;
 use base::{LoggedResult, ResultExt, WriteExt, debug, error, exit_on_error, libc, warn};
+use std::collections::HashMap;
 use std::fs::File;
 use std::os::fd::{FromRawFd, IntoRawFd};
 use std::os::unix::net::UnixStream;
+use std::sync::atomic::Ordering;
 use std::sync::{Arc, Mutex};
-use std::time::{Duration, Instant};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
 
 const DEFAULT_SHELL: &str = "/system/bin/sh";
 
+fn wait_child(pid: i32) -> i32 {
+    let mut status = 0;
+    unsafe {
+        if libc::waitpid(pid, &mut status, 0) > 0 {
+            libc::WEXITSTATUS(status)
+        } else {
+            -1
+        }
+    }
+}
+
 impl Default for SuRequest {
     fn default() -> Self {
         SuRequest {
@@ -22,6 +37,7 @@ impl Default for SuRequest {
             target_pid: -1,
             login: false,
             keep_env: false,
+            server: false,
             shell: DEFAULT_SHELL.to_string(),
             command: "".to_string(),
             context: "".to_string(),
@@ -30,8 +46,11 @@ impl Default for SuRequest {
     }
 }
 
+// Stays valid until the cache generation changes, or its timed policy expires
 pub struct SuInfo {
     uid: i32,
+    generation: u32,
+    sulist: bool,
     eval_uid: i32,
     cfg: DbSettings,
     mgr_pkg: String,
@@ -42,12 +61,31 @@ pub struct SuInfo {
 struct AccessInfo {
     settings: RootSettings,
     timestamp: Instant,
+    // The policy came from a prompt and may not be stored in the database
+    prompted: bool,
+}
+
+// Per uid su info of the current generation. Database writes and manager changes
+// bump the generation; installing, updating or removing any package rewrites
+// packages.xml, which is checked before every lookup.
+#[derive(Default)]
+pub struct SuInfoCache {
+    packages: TrackedFile,
+    infos: HashMap<i32, Arc<SuInfo>>,
+}
+
+// A running root process, the client gets its exit code once the pidfd is readable
+pub struct SuSession {
+    pid: i32,
+    client: UnixStream,
 }
 
 impl Default for SuInfo {
     fn default() -> Self {
         SuInfo {
             uid: -1,
+            generation: 0,
+            sulist: false,
             eval_uid: -1,
             cfg: Default::default(),
             mgr_pkg: Default::default(),
@@ -62,6 +100,7 @@ impl Default for AccessInfo {
         AccessInfo {
             settings: Default::default(),
             timestamp: Instant::now(),
+            prompted: false,
         }
     }
 }
@@ -72,6 +111,7 @@ impl SuInfo {
             policy: SuPolicy::Allow,
             log: false,
             notify: false,
+            until: 0,
         };
         SuInfo {
             uid,
@@ -85,6 +125,7 @@ impl SuInfo {
             policy: SuPolicy::Deny,
             log: false,
             notify: false,
+            until: 0,
         };
         SuInfo {
             uid,
@@ -92,6 +133,25 @@ impl SuInfo {
             ..Default::default()
         }
     }
+
+    fn is_valid(&self, generation: u32) -> bool {
+        if self.generation != generation {
+            return false;
+        }
+        let access = self.access.lock().unwrap();
+        // Timed policies expire without any database write
+        if access.settings.until > 0 {
+            let now = SystemTime::now()
+                .duration_since(UNIX_EPOCH)
+                .map(|d| d.as_secs() as i64)
+                .unwrap_or(i64::MAX);
+            if now >= access.settings.until {
+                return false;
+            }
+        }
+        // Only reuse a prompt decision for a short time, as "once" is never saved
+        !access.prompted || access.is_fresh()
+    }
 }
 
 impl AccessInfo {
@@ -99,6 +159,7 @@ impl AccessInfo {
         AccessInfo {
             settings,
             timestamp: Instant::now(),
+            prompted: false,
         }
     }
 
@@ -121,7 +182,7 @@ impl MagiskD {
 
         let mut client = unsafe { UnixStream::from_raw_fd(client) };
 
-        let mut req = match client.read_decodable::<SuRequest>().log() {
+        let mut req = match client.recv_decodable::<SuRequest>().log() {
             Ok(req) => req,
             Err(_) => {
                 warn!("su: remote process probably died, abort");
@@ -133,8 +194,7 @@ impl MagiskD {
         let info = self.get_su_info(cred.uid as i32);
         
         // Check SuList mode: only allow if app is in the allow list
-        let sulist_enabled = self.get_db_setting(DbEntryKey::SulistConfig) != 0;
-        if sulist_enabled {
+        if info.sulist {
             // Get process name for checking
             let process_name = format!("/proc/{}/cmdline", cred.pid);
             let cmdline = match std::fs::read_to_string(&process_name) {
@@ -172,6 +232,7 @@ impl MagiskD {
             let mut access = info.access.lock().unwrap();
 
             if access.settings.policy == SuPolicy::Query {
+                access.prompted = true;
                 let fd = app_request(&app_req);
                 if fd < 0 {
                     access.settings.policy = SuPolicy::Deny;
@@ -224,44 +285,85 @@ impl MagiskD {
             return;
         }
 
-        // Wait result
+        // Hand the child over to the poll loop, so no worker thread is
+        // pinned for the whole lifetime of the root session
+        let pidfd = unsafe { libc::syscall(libc::SYS_pidfd_open, child, 0) } as i32;
+        if pidfd >= 0 {
+            debug!("su: monitoring child pid=[{}]", child);
+            let session = SuSession { pid: child, client };
+            self.su_sessions.lock().unwrap().insert(pidfd, session);
+            register_su_session(pidfd);
+            return;
+        }
+
+        // pidfd_open is only available since Linux 5.3, wait in place
         debug!("su: waiting child pid=[{}]", child);
-        let mut status = 0;
-        let code = unsafe {
-            if libc::waitpid(child, &mut status, 0) > 0 {
-                libc::WEXITSTATUS(status)
-            } else {
-                -1
-            }
-        };
+        let code = wait_child(child);
         debug!("su: return code=[{}]", code);
         client.write_pod(&code).ok();
     }
 
+    // Called from the poll loop, the pidfd is closed by the caller
+    pub fn reap_su_session(&self, pidfd: i32) {
+        let Some(mut session) = self.su_sessions.lock().unwrap().remove(&pidfd) else {
+            return;
+        };
+        let code = wait_child(session.pid);
+        debug!("su: child pid=[{}] return code=[{}]", session.pid, code);
+        session.client.write_pod(&code).ok();
+    }
+
+    // Cached su info is only valid for the generation it was built in
+    fn su_generation(&self) -> u32 {
+        self.su_generation.load(Ordering::Acquire)
+    }
+
+    pub fn invalidate_su_info(&self) {
+        self.su_generation.fetch_add(1, Ordering::Release);
+    }
+
     fn get_su_info(&self, uid: i32) -> Arc<SuInfo> {
-        if uid == AID_ROOT {
-            return Arc::new(SuInfo::allow(AID_ROOT));
-        }
+        let generation = {
+            let mut cache = self.su_info_cache.lock().unwrap();
+            if !cache.packages.is_same() {
+                cache.packages = TrackedFile::new(PACKAGES_XML.into());
+                self.invalidate_su_info();
+            }
+            // Read the generation first, any change after this point invalidates the new entry
+            let generation = self.su_generation();
+            if let Some(info) = cache.infos.get(&uid)
+                && info.is_valid(generation)
+            {
+                return info.clone();
+            }
+            generation
+        };
 
-        let cached = self.cached_su_info.load();
-        if cached.uid == uid && cached.access.lock().unwrap().is_fresh() {
-            return cached;
-        }
+        // Build without holding the lock, it may query the database and the manager
+        let mut info = if uid == AID_ROOT {
+            SuInfo::allow(AID_ROOT)
+        } else {
+            self.build_su_info(uid)
+        };
+        info.generation = generation;
+        info.sulist = self.get_db_setting(DbEntryKey::SulistConfig) != 0;
+        let info = Arc::new(info);
 
-        let info = self.build_su_info(uid);
-        self.cached_su_info.store(info.clone());
+        let mut cache = self.su_info_cache.lock().unwrap();
+        cache.infos.retain(|_, i| i.generation == generation);
+        cache.infos.insert(uid, info.clone());
         info
     }
 
-    fn build_su_info(&self, uid: i32) -> Arc<SuInfo> {
-        let result: LoggedResult<Arc<SuInfo>> = try {
+    fn build_su_info(&self, uid: i32) -> SuInfo {
+        let result: LoggedResult<SuInfo> = try {
             let cfg = self.get_db_settings()?;
 
             // Check multiuser settings
             let eval_uid = match cfg.multiuser_mode {
                 MultiuserMode::OwnerOnly => {
                     if to_user_id(uid) != 0 {
-                        return Arc::new(SuInfo::deny(uid));
+                        return SuInfo::deny(uid);
                     }
                     uid
                 }
@@ -273,18 +375,18 @@ impl MagiskD {
             match cfg.root_access {
                 RootAccess::Disabled => {
                     warn!("Root access is disabled!");
-                    return Arc::new(SuInfo::deny(uid));
+                    return SuInfo::deny(uid);
                 }
                 RootAccess::AdbOnly => {
                     if uid != AID_SHELL {
                         warn!("Root access limited to ADB only!");
-                        return Arc::new(SuInfo::deny(uid));
+                        return SuInfo::deny(uid);
                     }
                 }
                 RootAccess::AppsOnly => {
                     if uid == AID_SHELL {
                         warn!("Root access is disabled for ADB!");
-                        return Arc::new(SuInfo::deny(uid));
+                        return SuInfo::deny(uid);
                     }
                 }
                 _ => {}
@@ -303,25 +405,26 @@ impl MagiskD {
 
             // If it's the manager, allow it silently
             if to_app_id(uid) == to_app_id(mgr_uid) {
-                return Arc::new(SuInfo::allow(uid));
+                return SuInfo::allow(uid);
             }
 
             // If still not determined, check if manager exists
             if access.policy == SuPolicy::Query && mgr_uid < 0 {
-                return Arc::new(SuInfo::deny(uid));
+                return SuInfo::deny(uid);
             }
 
             // Finally, the SuInfo
-            Arc::new(SuInfo {
+            SuInfo {
                 uid,
                 eval_uid,
                 cfg,
                 mgr_pkg,
                 mgr_uid,
                 access: Mutex::new(AccessInfo::new(access)),
-            })
+                ..Default::default()
+            }
         };
 
-        result.unwrap_or(Arc::new(SuInfo::deny(uid)))
+        result.unwrap_or(SuInfo::deny(uid))
     }
 }
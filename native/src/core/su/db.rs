@@ -18,6 +18,7 @@ pub struct RootSettings {
     pub policy: SuPolicy,
     pub log: bool,
     pub notify: bool,
+    pub until: i64,
 }
 
 impl SqlTable for RootSettings {
@@ -28,6 +29,7 @@ impl SqlTable for RootSettings {
                 "policy" => self.policy.repr = val,
                 "logging" => self.log = val != 0,
                 "notification" => self.notify = val != 0,
+                "until" => self.until = val as i64,
                 _ => {}
             }
         }
@@ -45,7 +47,7 @@ impl SqlTable for UidList {
 impl MagiskD {
     pub fn get_root_settings(&self, uid: i32, settings: &mut RootSettings) -> SqliteResult<()> {
         self.db_exec_with_rows(
-            "SELECT policy, logging, notification FROM policies \
+            "SELECT policy, logging, notification, until FROM policies \
              WHERE uid=? AND (until=0 OR until>strftime('%s', 'now'))",
             &[Integer(uid as i64)],
             settings,
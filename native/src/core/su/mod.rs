@@ -2,6 +2,6 @@ mod daemon;
 mod db;
 mod pts;
 
-pub use daemon::SuInfo;
+pub use daemon::{SuInfoCache, SuSession};
 // Note: These functions are available but not currently used
 // pub use pts::{get_pty_num, pump_tty, restore_stdin};
@@ -12,6 +12,8 @@
 #include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 #include <algorithm>
 
@@ -54,7 +56,14 @@ int quit_signals[] = { SIGALRM, SIGABRT, SIGHUP, SIGPIPE, SIGQUIT, SIGTERM, SIGI
     "  -v, --version                 Display version number and exit\n"
     "  -V                            Display version code and exit\n"
     "  -mm, -M,\n"
-    "  --mount-master                Force run in the global mount namespace\n\n");
+    "  --mount-master                Force run in the global mount namespace\n"
+    "  --server                      Serve framed commands from stdin, see below\n\n"
+    "Server mode runs many commands over a single authorized session.\n"
+    "Requests are [id][len][command] and are answered in order with\n"
+    "[id][exit code][len][stdout][len][stderr]. Integers are native 32-bit.\n"
+    "Requests can be pipelined, read replies while sending to avoid stalls.\n"
+    "An exit code of -1 means the command could not be started.\n"
+    "Server mode cannot be combined with --context.\n\n");
     exit(status);
 }
 
@@ -105,6 +114,7 @@ int su_client_main(int argc, char *argv[]) {
             { "group",                  required_argument,  nullptr, 'g' },
             { "supp-group",             required_argument,  nullptr, 'G' },
             { "interactive",            no_argument,        nullptr, 'i' },
+            { "server",                 no_argument,        nullptr, 'S' },
             { nullptr, 0, nullptr, 0 },
     };
 
@@ -139,6 +149,9 @@ int su_client_main(int argc, char *argv[]) {
             case 'i':
                 interactive = true;
                 break;
+            case 'S':
+                req.server = true;
+                break;
             case 'l':
                 req.login = true;
                 break;
@@ -193,6 +206,12 @@ int su_client_main(int argc, char *argv[]) {
         }
     }
 
+    if (req.server && !req.context.empty()) {
+        // The context would apply to the server itself, not to the commands it runs
+        fprintf(stderr, "Can't use --server and -Z at the same time\n");
+        usage(EXIT_FAILURE);
+    }
+
     if (optind < argc && strcmp(argv[optind], "-") == 0) {
         req.login = true;
         optind++;
@@ -224,7 +243,7 @@ int su_client_main(int argc, char *argv[]) {
     }
 
     // Determine which one of our streams are attached to a TTY
-    interactive |= req.command.empty();
+    interactive |= req.command.empty() && !req.server;
     int atty = 0;
     if (isatty(STDIN_FILENO) && interactive)  atty |= ATTY_IN;
     if (isatty(STDOUT_FILENO) && interactive) atty |= ATTY_OUT;
@@ -281,6 +300,130 @@ static void set_identity(int uid, const rust::Vec<gid_t> &groups) {
     }
 }
 
+static bool read_full(int fd, void *buf, size_t len) {
+    auto p = static_cast<char *>(buf);
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int run_command(const char *shell, const string &cmd, string &out, string &err) {
+    // Commands must never consume the following requests
+    int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (null < 0)
+        return -1;
+    int out_pipe[2];
+    int err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC)) {
+        close(null);
+        return -1;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC)) {
+        close(null);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return -1;
+    }
+    int pid = fork();
+    if (pid == 0) {
+        if (dup2(null, STDIN_FILENO) < 0 || dup2(out_pipe[1], STDOUT_FILENO) < 0 ||
+            dup2(err_pipe[1], STDERR_FILENO) < 0)
+            _exit(127);
+        execlp(shell, shell, "-c", cmd.data(), nullptr);
+        _exit(127);
+    }
+    close(null);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (pid < 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return -1;
+    }
+
+    pollfd pfds[] = { { out_pipe[0], POLLIN, 0 }, { err_pipe[0], POLLIN, 0 } };
+    string *outputs[] = { &out, &err };
+    char buf[4096];
+    for (int remain = 2; remain > 0;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+            ssize_t n = read(pfds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                outputs[i]->append(buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                --remain;
+            }
+        }
+    }
+    for (auto &pfd : pfds) {
+        if (pfd.fd >= 0)
+            close(pfd.fd);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// The session is authorized once, every command after that only costs a fork and exec
+static int serve_commands(const char *shell) {
+    string cmd, out, err, reply;
+    for (;;) {
+        int header[2];
+        if (!read_full(STDIN_FILENO, header, sizeof(header)))
+            return 0;
+        if (header[1] < 0) {
+            fprintf(stderr, "su: invalid command length %d\n", header[1]);
+            return 1;
+        }
+        cmd.resize(header[1]);
+        if (!read_full(STDIN_FILENO, cmd.data(), cmd.size()))
+            return 1;
+
+        out.clear();
+        err.clear();
+        int code = run_command(shell, cmd, out, err);
+
+        // Send the whole reply at once
+        int out_len = out.size();
+        int err_len = err.size();
+        reply.clear();
+        reply.append(reinterpret_cast<char *>(&header[0]), sizeof(int));
+        reply.append(reinterpret_cast<char *>(&code), sizeof(int));
+        reply.append(reinterpret_cast<char *>(&out_len), sizeof(int));
+        reply += out;
+        reply.append(reinterpret_cast<char *>(&err_len), sizeof(int));
+        reply += err;
+        if (xwrite(STDOUT_FILENO, reply.data(), reply.size()) < 0)
+            return 1;
+    }
+}
+
+// Private applet executed by the su daemon for server mode sessions
+int su_server_main(int argc, char *argv[]) {
+    if (argc < 2)
+        return 1;
+    // Applets start with umask 0, restore the one of the session
+    umask(022);
+    return serve_commands(argv[1]);
+}
+
 void exec_root_shell(int client, int pid, SuRequest &req, MntNsMode mode) {
     // Become session leader
     xsetsid();
@@ -408,11 +551,17 @@ void exec_root_shell(int client, int pid, SuRequest &req, MntNsMode mode) {
     sigset_t block_set;
     sigemptyset(&block_set);
     sigprocmask(SIG_SETMASK, &block_set, nullptr);
-    if (!req.context.empty()) {
+    // The context is never applied to su_server itself, the client rejects it in server mode
+    if (!req.context.empty() && !req.server) {
         auto f = xopen_file("/proc/self/attr/exec", "we");
         if (f) fprintf(f.get(), "%s", req.context.c_str());
     }
     set_identity(req.target_uid, req.gids);
+    if (req.server) {
+        // Serve the session from a fresh image instead of the forked daemon
+        execl("/proc/self/exe", "", "su_server", req.shell.c_str(), nullptr);
+        PLOGE("exec su_server");
+    }
     execvp(req.shell.c_str(), (char **) argv);
     fprintf(stderr, "Cannot execute %s: %s\n", req.shell.c_str(), strerror(errno));
     PLOGE("exec");
@@ -97,3 +97,34 @@ void exec_task(function<void()> &&task) {
     }
     pthread_cond_wait(&recv_task, &lock);
 }
+
+void exec_parallel(int n, int jobs, const function<void(int)> &fn) {
+    if (n <= 0)
+        return;
+    jobs = std::clamp(jobs, 1, n);
+
+    pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+    atomic<int> next = 0;
+    int running = jobs - 1;
+
+    auto worker = [&] {
+        for (int i; (i = next++) < n;)
+            fn(i);
+    };
+
+    // The calling thread is also one of the workers
+    for (int i = 1; i < jobs; ++i) {
+        exec_task([&] {
+            worker();
+            mutex_guard g(done_lock);
+            if (--running == 0)
+                pthread_cond_signal(&done);
+        });
+    }
+    worker();
+
+    mutex_guard g(done_lock);
+    while (running > 0)
+        pthread_cond_wait(&done, &done_lock);
+}
@@ -0,0 +1,141 @@
+use crate::consts::TRACE_FLAG;
+use base::{cstr, libc};
+use std::fmt::Write;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering, fence};
+
+// Boot stage timeline, recorded as complete events of the Chrome trace event format.
+// Spans are only recorded when TRACE_FLAG exists when the daemon starts,
+// otherwise creating a span costs a single branch.
+
+const TRACE_SLOTS: usize = 512;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static NEXT: AtomicUsize = AtomicUsize::new(0);
+static SLOTS: [Slot; TRACE_SLOTS] = [const { Slot::new() }; TRACE_SLOTS];
+
+// A slot is published by storing its sequence number last, readers
+// drop any slot whose sequence number changed while it was being copied.
+struct Slot {
+    seq: AtomicUsize,
+    name: AtomicUsize,
+    name_len: AtomicUsize,
+    start: AtomicU64,
+    dur: AtomicU64,
+    tid: AtomicU64,
+}
+
+impl Slot {
+    const fn new() -> Slot {
+        Slot {
+            seq: AtomicUsize::new(0),
+            name: AtomicUsize::new(0),
+            name_len: AtomicUsize::new(0),
+            start: AtomicU64::new(0),
+            dur: AtomicU64::new(0),
+            tid: AtomicU64::new(0),
+        }
+    }
+
+    fn write(&self, seq: usize, name: &'static str, start: u64, dur: u64, tid: u64) {
+        self.seq.store(0, Ordering::Relaxed);
+        fence(Ordering::Release);
+        self.name.store(name.as_ptr() as usize, Ordering::Relaxed);
+        self.name_len.store(name.len(), Ordering::Relaxed);
+        self.start.store(start, Ordering::Relaxed);
+        self.dur.store(dur, Ordering::Relaxed);
+        self.tid.store(tid, Ordering::Relaxed);
+        self.seq.store(seq, Ordering::Release);
+    }
+
+    fn read(&self) -> Option<(usize, &'static str, u64, u64, u64)> {
+        let seq = self.seq.load(Ordering::Acquire);
+        if seq == 0 {
+            return None;
+        }
+        let name = self.name.load(Ordering::Relaxed);
+        let name_len = self.name_len.load(Ordering::Relaxed);
+        let start = self.start.load(Ordering::Relaxed);
+        let dur = self.dur.load(Ordering::Relaxed);
+        let tid = self.tid.load(Ordering::Relaxed);
+        fence(Ordering::Acquire);
+        if self.seq.load(Ordering::Relaxed) != seq {
+            return None;
+        }
+        // SAFETY: name and name_len were copied from the same &'static str
+        let name = unsafe {
+            std::str::from_utf8_unchecked(std::slice::from_raw_parts(name as *const u8, name_len))
+        };
+        Some((seq, name, start, dur, tid))
+    }
+}
+
+fn now_us() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_BOOTTIME, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000 + ts.tv_nsec as u64 / 1000
+}
+
+pub struct Span {
+    name: &'static str,
+    start: u64,
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        let dur = now_us() - self.start;
+        let tid = unsafe { libc::gettid() } as u64;
+        let seq = NEXT.fetch_add(1, Ordering::Relaxed) + 1;
+        SLOTS[seq % TRACE_SLOTS].write(seq, self.name, self.start, dur, tid);
+    }
+}
+
+pub fn span(name: &'static str) -> Option<Span> {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return None;
+    }
+    Some(Span {
+        name,
+        start: now_us(),
+    })
+}
+
+// Record everything until the end of the current scope
+#[macro_export]
+macro_rules! trace_span {
+    ($name:literal) => {
+        let _span = $crate::trace::span($name);
+    };
+}
+
+pub fn setup_trace() {
+    if cstr!(TRACE_FLAG).exists() {
+        ENABLED.store(true, Ordering::Relaxed);
+    }
+}
+
+pub fn dump_trace() -> String {
+    if !ENABLED.load(Ordering::Relaxed) {
+        return String::new();
+    }
+    let mut events: Vec<_> = SLOTS.iter().filter_map(Slot::read).collect();
+    events.sort_unstable_by_key(|e| e.0);
+
+    let pid = unsafe { libc::getpid() };
+    let mut json = String::from("{\"traceEvents\":[");
+    for (i, (_, name, start, dur, tid)) in events.iter().enumerate() {
+        if i > 0 {
+            json.push(',');
+        }
+        write!(
+            json,
+            "{{\"name\":\"{}\",\"cat\":\"boot\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":{},\"tid\":{}}}",
+            name, start, dur, pid, tid
+        )
+        .ok();
+    }
+    json.push_str("],\"displayTimeUnit\":\"ms\"}");
+    json
+}
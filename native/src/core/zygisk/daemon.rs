@@ -154,9 +154,7 @@ impl MagiskD {
     }
 
     fn get_process_info(&self, mut client: UnixStream) -> LoggedResult<()> {
-        let uid: i32 = client.read_decodable()?;
-        let process: String = client.read_decodable()?;
-        let is_64_bit: bool = client.read_decodable()?;
+        let (uid, process, is_64_bit): (i32, String, bool) = client.recv_decodable()?;
         let mut flags: u32 = 0;
         update_deny_flags(uid, &process, &mut flags);
         if self.get_manager_uid(to_user_id(uid)) == uid {
@@ -210,13 +210,20 @@ bool ZygiskContext::plt_hook_commit() {
 
 int ZygiskContext::get_module_info(int uid, rust::Vec<int> &fds) {
     if (int fd = zygisk_request(+ZygiskRequest::GetInfo); fd >= 0) {
-        write_int(fd, uid);
-        write_string(fd, process);
 #ifdef __LP64__
-        write_any<bool>(fd, true);
+        bool is_64_bit = true;
 #else
-        write_any<bool>(fd, false);
+        bool is_64_bit = false;
 #endif
+        // Send the whole request at once, the daemon decodes it with a single read
+        int len = strlen(process);
+        iovec iov[] = {
+            { &uid, sizeof(uid) },
+            { &len, sizeof(len) },
+            { const_cast<char *>(process), (size_t) len },
+            { &is_64_bit, sizeof(is_64_bit) },
+        };
+        write_iov(fd, iov, 4);
         xxread(fd, &info_flags, sizeof(info_flags));
         if (zygisk_should_load_module(info_flags)) {
             fds = recv_fds(fd);
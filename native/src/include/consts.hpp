@@ -23,6 +23,7 @@
 #define MAIN_CONFIG   INTLROOT "/config"
 #define MAIN_SOCKET   DEVICEDIR "/socket"
 #define EARLYMNT      INTLROOT "/early-mount.d"
+#define SCRIPT_TIMINGS INTLROOT "/boot_timings"
 
 #define EARLYMNTNAME  "early-mount.d/v2"
 
@@ -31,6 +32,15 @@ constexpr const char *applet_names[] = { "su", "resetprop", nullptr };
 #define POST_FS_DATA_WAIT_TIME       40
 #define POST_FS_DATA_SCRIPT_MAX_TIME 35
 
+// Boot scripts
+// post-fs-data scripts run one at a time unless SCRIPT_JOBS_FILE opts into more
+#define SCRIPT_DEF_JOBS   1
+#define SCRIPT_JOBS_FILE  SECURE_DIR "/script_jobs"
+#define SCRIPT_AFTER_FILE "script_after"
+
+// Boot stage timeline
+#define TRACE_FLAG        SECURE_DIR "/boot_trace"
+
 // Unconstrained domain the daemon and root processes run in
 #define SEPOL_PROC_DOMAIN   "magisk"
 #define MAGISK_PROC_CON     "u:r:" SEPOL_PROC_DOMAIN ":s0"
@@ -46,5 +56,6 @@ extern int SDK_INT;
 // Multi-call entrypoints
 int magisk_main(int argc, char *argv[]);
 int su_client_main(int argc, char *argv[]);
+int su_server_main(int argc, char *argv[]);
 int resetprop_main(int argc, char *argv[]);
 int zygisk_main(int argc, char *argv[]);
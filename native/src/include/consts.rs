@@ -16,6 +16,8 @@ pub const LOGFILE: &str = "/cache/magisk.log";
 pub const SECURE_DIR: &str = "/data/adb";
 pub const MODULEROOT: &str = concatcp!(SECURE_DIR, "/modules");
 pub const DATABIN: &str = concatcp!(SECURE_DIR, "/magisk");
+pub const RESTORECON_MANIFEST: &str = concatcp!(SECURE_DIR, "/.restorecon");
+pub const TRACE_FLAG: &str = concatcp!(SECURE_DIR, "/boot_trace");
 
 // tmpfs paths
 const INTERNAL_DIR: &str = ".magisk";
@@ -7,6 +7,7 @@
 #include <base.hpp>
 #include <flags.h>
 #include <xz.h>
+#include <lz4frame.h>
 
 #include "init.hpp"
 
@@ -42,6 +43,33 @@ static bool unxz(out_stream &strm, rust::Slice<const uint8_t> bytes) {
     return true;
 }
 
+// LZ4 frames decode several times faster than xz at the cost of a larger ramdisk
+static bool unlz4(out_stream &strm, rust::Slice<const uint8_t> bytes) {
+    uint8_t out[65536];
+    LZ4F_dctx *ctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return false;
+    run_finally finally([&] { LZ4F_freeDecompressionContext(ctx); });
+    const uint8_t *in = bytes.data();
+    size_t remain = bytes.size();
+    size_t read, write, hint;
+    do {
+        read = remain;
+        write = sizeof(out);
+        hint = LZ4F_decompress(ctx, out, &write, in, &read, nullptr);
+        if (LZ4F_isError(hint))
+            return false;
+        strm.write(out, write);
+        in += read;
+        remain -= read;
+        // A hint of 0 means the frame is fully decoded and flushed
+    } while (remain != 0 || (hint != 0 && write != 0));
+    // Otherwise the input ended in the middle of a frame
+    return hint == 0;
+}
+
+using payload_decoder = bool (*)(out_stream &, rust::Slice<const uint8_t>);
+
 // When return true, run patch_fissiond
 static bool patch_rc_scripts(const char *src_path, const char *tmp_path, bool writable) {
     auto src_dir = xopen_dir(src_path);
@@ -232,37 +260,34 @@ static void recreate_sbin(const char *mirror, bool use_bind_mount) {
     }
 }
 
-static void extract_files(bool sbin) {
-    const char *magisk_xz = sbin ? "/sbin/magisk.xz" : "magisk.xz";
-    const char *stub_xz = sbin ? "/sbin/stub.xz" : "stub.xz";
-    const char *init_ld_xz = sbin ? "/sbin/init-ld.xz" : "init-ld.xz";
-
-    if (access(magisk_xz, F_OK) == 0) {
-        mmap_data magisk(magisk_xz);
-        unlink(magisk_xz);
-        int fd = xopen("magisk", O_WRONLY | O_CREAT, 0755);
-        fd_stream ch(fd);
-        unxz(ch, magisk);
-        close(fd);
-    }
-    if (access(stub_xz, F_OK) == 0) {
-        mmap_data stub(stub_xz);
-        unlink(stub_xz);
-        int fd = xopen("stub.apk", O_WRONLY | O_CREAT, 0);
-        fd_stream ch(fd);
-        unxz(ch, stub);
-        close(fd);
-    }
-    if (access(init_ld_xz, F_OK) == 0) {
-        mmap_data init_ld(init_ld_xz);
-        unlink(init_ld_xz);
-        int fd = xopen("init-ld", O_WRONLY | O_CREAT, 0);
+// Payloads are compressed with xz, or LZ4 if the boot image was patched with PAYLOADCOMP=lz4
+static void extract_payload(const char *name, const char *out, mode_t mode) {
+    static constexpr pair<const char *, payload_decoder> decoders[] = {
+        { ".lz4", unlz4 },
+        { ".xz", unxz },
+    };
+    char path[64];
+    for (auto &[ext, decode] : decoders) {
+        ssprintf(path, sizeof(path), "%s%s", name, ext);
+        if (access(path, F_OK) != 0)
+            continue;
+        mmap_data data(path);
+        unlink(path);
+        int fd = xopen(out, O_WRONLY | O_CREAT, mode);
         fd_stream ch(fd);
-        unxz(ch, init_ld);
+        if (!decode(ch, data))
+            LOGE("Failed to decompress %s\n", path);
         close(fd);
+        return;
     }
 }
 
+static void extract_files(bool sbin) {
+    extract_payload(sbin ? "/sbin/magisk" : "magisk", "magisk", 0755);
+    extract_payload(sbin ? "/sbin/stub" : "stub", "stub.apk", 0);
+    extract_payload(sbin ? "/sbin/init-ld" : "init-ld", "init-ld", 0);
+}
+
 void MagiskInit::patch_ro_root() noexcept {
     mount_list.emplace_back("/data");
     parse_config_file();
@@ -172,3 +172,11 @@ void SePolicy::dontauditxperm(StrVec src, StrVec tgt, StrVec cls, Xperms xperm)
         impl->add_xperm_rule(args..., AVTAB_XPERMS_DONTAUDIT);
     });
 }
+
+void SePolicy::begin_batch() noexcept {
+    impl->begin_batch();
+}
+
+void SePolicy::commit_batch() noexcept {
+    impl->commit_batch();
+}
@@ -0,0 +1,97 @@
+use crate::consts::MAGISK_VER_CODE;
+use crate::ffi::SePolicy;
+use base::{LoggedResult, Utf8CString, libc};
+use sha2::{Digest, Sha256};
+use std::fmt::Write as _;
+use std::fs;
+use std::io::Write;
+
+// Same layout as the .sha256 files shipped along with precompiled policies
+const SHALEN: usize = 64;
+
+// A fully patched binary policy saved next to a hex SHA-256 of everything that produced it
+pub struct PolicyCache {
+    policy: Utf8CString,
+    sha: Utf8CString,
+    key: String,
+}
+
+fn hash_file(h: &mut Sha256, file: &str) {
+    h.update(file.as_bytes());
+    h.update([0]);
+    // Read instead of mapping, selinuxfs nodes report a size of 0
+    match fs::read(file) {
+        Ok(data) => {
+            h.update((data.len() as u64).to_le_bytes());
+            h.update(&data);
+        }
+        Err(_) => h.update(u64::MAX.to_le_bytes()),
+    }
+}
+
+impl PolicyCache {
+    pub fn new(
+        file: &str,
+        inputs: &[String],
+        magisk: bool,
+        rule_files: &[String],
+        statements: &[String],
+    ) -> PolicyCache {
+        let mut h = Sha256::default();
+        h.update(MAGISK_VER_CODE.to_le_bytes());
+        h.update([magisk as u8]);
+        // The policy version changes the compiled output of split policies
+        hash_file(&mut h, "/sys/fs/selinux/policyvers");
+        for file in inputs {
+            hash_file(&mut h, file);
+        }
+        for file in rule_files {
+            hash_file(&mut h, file);
+        }
+        for statement in statements {
+            h.update(statement.as_bytes());
+            h.update([0]);
+        }
+
+        let mut key = String::with_capacity(SHALEN);
+        for b in h.finalize() {
+            write!(key, "{:02x}", b).ok();
+        }
+        PolicyCache {
+            policy: Utf8CString::from(file.to_owned()),
+            sha: Utf8CString::from(format!("{}.sha256", file)),
+            key,
+        }
+    }
+
+    pub fn load(&self) -> Option<SePolicy> {
+        if !self.policy.exists()
+            || !self.sha.exists()
+            || !SePolicy::check_sha256(&self.sha, &self.key)
+        {
+            return None;
+        }
+        let sepol = SePolicy::from_file(&self.policy);
+        if sepol._impl.is_null() {
+            None
+        } else {
+            Some(sepol)
+        }
+    }
+
+    pub fn store(&self, sepol: &SePolicy) {
+        // Invalidate first so a partially written policy is never trusted
+        self.sha.remove().ok();
+        if !sepol.to_file(&self.policy) {
+            return;
+        }
+        let result: LoggedResult<()> = try {
+            let mut f = self
+                .sha
+                .create(libc::O_WRONLY | libc::O_TRUNC | libc::O_CLOEXEC, 0o600)?;
+            f.write_all(self.key.as_bytes())?;
+            f.write_all(b"\n")?;
+        };
+        result.ok();
+    }
+}
@@ -1,12 +1,14 @@
+use crate::cache::PolicyCache;
 use crate::ffi::SePolicy;
 use crate::statement::format_statement_help;
 use argh::FromArgs;
 use base::{
-    EarlyExitExt, FmtAdaptor, LoggedResult, Utf8CStr, cmdline_logging, cstr, libc::umask, log_err,
-    map_args,
+    EarlyExitExt, FmtAdaptor, LoggedResult, Utf8CStr, cmdline_logging, cstr, info, libc::umask,
+    log_err, map_args,
 };
 use std::ffi::c_char;
 use std::io::stderr;
+use std::time::Instant;
 
 #[derive(FromArgs)]
 struct Cli {
@@ -25,12 +27,18 @@ struct Cli {
     #[argh(switch)]
     print_rules: bool,
 
+    #[argh(switch)]
+    stats: bool,
+
     #[argh(option)]
     load: Option<String>,
 
     #[argh(option)]
     save: Option<String>,
 
+    #[argh(option)]
+    cache: Option<String>,
+
     #[argh(option)]
     apply: Vec<String>,
 
@@ -57,6 +65,11 @@ Options:
                      line by line as policy statements
                      (multiple --apply are allowed)
    --print-rules     print all rules in the loaded sepolicy
+   --stats           print avtab node, slot and chain length
+                     statistics before and after patching
+   --cache FILE      reuse the patched sepolicy stored in FILE if
+                     the source policy and all rules are unchanged,
+                     otherwise store the patched sepolicy to FILE
 
 If neither --load, --load-split, nor --compile-split is specified,
 it will load from current live policies (/sys/fs/selinux/policy)
@@ -87,40 +100,80 @@ pub unsafe extern "C" fn main(
         }
         let mut cli = Cli::from_args(&[cmds[0]], &cmds[1..]).on_early_exit(|| print_usage(cmds[0]));
 
-        let mut sepol = match (&mut cli.load, cli.load_split, cli.compile_split) {
-            (Some(file), false, false) => SePolicy::from_file(Utf8CStr::from_string(file)),
-            (None, true, false) => SePolicy::from_split(),
-            (None, false, true) => SePolicy::compile_split(),
-            (None, false, false) => SePolicy::from_file(cstr!("/sys/fs/selinux/policy")),
-            _ => Err(log_err!("Multiple load source supplied"))?,
-        };
-        if sepol._impl.is_null() {
-            Err(log_err!("Cannot load policy"))?;
-        }
-
-        if cli.print_rules {
-            if cli.magisk
+        if cli.print_rules
+            && (cli.magisk
                 || !cli.apply.is_empty()
                 || !cli.polices.is_empty()
                 || cli.live
                 || cli.save.is_some()
-            {
-                Err(log_err!("Cannot print rules with other options"))?;
-            }
-            sepol.print_rules();
-            return 0;
+                || cli.cache.is_some())
+        {
+            Err(log_err!("Cannot print rules with other options"))?;
         }
 
-        if cli.magisk {
-            sepol.magisk_rules();
+        if cli.load.is_some() as u8 + cli.load_split as u8 + cli.compile_split as u8 > 1 {
+            Err(log_err!("Multiple load source supplied"))?;
         }
 
-        for file in &mut cli.apply {
-            sepol.load_rule_file(Utf8CStr::from_string(file));
-        }
+        let start = Instant::now();
+        let cache = cli.cache.as_ref().map(|file| {
+            // Key on the files the policy is actually going to be loaded from
+            let inputs = match (&cli.load, cli.load_split, cli.compile_split) {
+                (Some(file), false, false) => vec![file.clone()],
+                (None, true, false) => SePolicy::split_policy_files(),
+                (None, false, true) => SePolicy::split_cil_files(),
+                _ => vec!["/sys/fs/selinux/policy".to_string()],
+            };
+            PolicyCache::new(file, &inputs, cli.magisk, &cli.apply, &cli.polices)
+        });
+
+        let sepol = if let Some(sepol) = cache.as_ref().and_then(PolicyCache::load) {
+            info!("Policy cache hit, loaded in {:?}", start.elapsed());
+            sepol
+        } else {
+            let mut sepol = match (&mut cli.load, cli.load_split, cli.compile_split) {
+                (Some(file), false, false) => SePolicy::from_file(Utf8CStr::from_string(file)),
+                (None, true, false) => SePolicy::from_split(),
+                (None, false, true) => SePolicy::compile_split(),
+                (None, false, false) => SePolicy::from_file(cstr!("/sys/fs/selinux/policy")),
+                _ => Err(log_err!("Multiple load source supplied"))?,
+            };
+            if sepol._impl.is_null() {
+                Err(log_err!("Cannot load policy"))?;
+            }
+
+            if cli.stats {
+                println!("Before patching:");
+                sepol.print_stats();
+            }
+
+            if cli.print_rules {
+                sepol.print_rules();
+                return 0;
+            }
+
+            if cli.magisk {
+                sepol.magisk_rules();
+            }
+
+            for file in &mut cli.apply {
+                sepol.load_rule_file(Utf8CStr::from_string(file));
+            }
+
+            for statement in &cli.polices {
+                sepol.load_rules(statement);
+            }
+
+            if let Some(cache) = &cache {
+                cache.store(&sepol);
+                info!("Policy cache miss, patched in {:?}", start.elapsed());
+            }
+            sepol
+        };
 
-        for statement in &cli.polices {
-            sepol.load_rules(statement);
+        if cli.stats {
+            println!("After patching:");
+            sepol.print_stats();
         }
 
         if cli.live && !sepol.to_file(cstr!("/sys/fs/selinux/load")) {
@@ -9,6 +9,8 @@ use crate::ffi::SePolicy;
 #[path = "../include/consts.rs"]
 mod consts;
 
+#[cfg(feature = "main")]
+mod cache;
 #[cfg(feature = "main")]
 mod cli;
 mod rules;
@@ -68,8 +70,11 @@ pub mod ffi {
         fn genfscon(self: &mut SePolicy, s: &str, t: &str, c: &str);
         #[allow(dead_code)]
         fn strip_dontaudit(self: &mut SePolicy);
+        fn begin_batch(self: &mut SePolicy);
+        fn commit_batch(self: &mut SePolicy);
 
         fn print_rules(self: &SePolicy);
+        fn print_stats(self: &SePolicy);
         fn to_file(self: &SePolicy, file: Utf8CStrRef) -> bool;
 
         #[Self = SePolicy]
@@ -80,6 +85,12 @@ pub mod ffi {
         fn compile_split() -> SePolicy;
         #[Self = SePolicy]
         fn from_data(data: &[u8]) -> SePolicy;
+        #[Self = SePolicy]
+        fn split_cil_files() -> Vec<String>;
+        #[Self = SePolicy]
+        fn split_policy_files() -> Vec<String>;
+        #[Self = SePolicy]
+        fn check_sha256(file: Utf8CStrRef, sha: &str) -> bool;
     }
 
     extern "Rust" {
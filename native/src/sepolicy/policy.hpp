@@ -3,7 +3,10 @@
 // Internal APIs, do not use directly
 
 #include <map>
+#include <memory>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 #include <cxx.h>
 
 #include <sepol/policydb/policydb.h>
@@ -12,6 +15,19 @@ using Str = rust::Str;
 
 struct Xperm;
 
+// AV rules applied in a batch are merged here and only committed to the avtab once
+struct rule_batch {
+    int depth = 0;
+
+    // Wildcard expansion candidates, collected once per batch
+    std::vector<type_datum_t *> types;
+    std::vector<type_datum_t *> attrs;
+    std::vector<class_datum_t *> classes;
+
+    // Access vectors keyed by the packed avtab_key_t
+    std::unordered_map<uint64_t, uint32_t> av;
+};
+
 class sepol_impl {
     avtab_ptr_t find_avtab_node(avtab_key_t *key, avtab_extended_perms_t *xperms);
     avtab_ptr_t insert_avtab_node(avtab_key_t *key);
@@ -19,6 +35,8 @@ class sepol_impl {
     void print_type(FILE *fp, type_datum_t *type);
     void print_avtab(FILE *fp, avtab_ptr_t node);
     void print_filename_trans(FILE *fp, hashtab_ptr_t node);
+    void print_avtab_stats(FILE *fp);
+    void rehash_avtab();
 
     bool add_rule(Str s, Str t, Str c, Str p, int effect, bool invert);
     void add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, perm_datum_t *perm, int effect, bool invert);
@@ -32,8 +50,15 @@ class sepol_impl {
     void add_typeattribute(type_datum_t *type, type_datum_t *attr);
     bool add_typeattribute(Str type, Str attr);
 
+    void index_batch();
+    uint32_t &batch_av(avtab_key_t *key);
+    void begin_batch();
+    void commit_batch();
+
     policydb *db;
 
+    std::unique_ptr<rule_batch> batch;
+
     std::map<std::string_view, std::array<const char *, 32>> class_perm_names;
 
     friend struct SePolicy;
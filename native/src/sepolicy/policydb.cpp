@@ -12,25 +12,30 @@
 
 
 #define SHALEN 64
+static bool read_sha256(const char *file, char *id) {
+    if (int fd = xopen(file, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        xread(fd, id, SHALEN);
+        close(fd);
+        LOGD("%s=[%.*s]\n", file, SHALEN, id);
+        return true;
+    }
+    return false;
+}
+
 static bool cmp_sha256(const char *a, const char *b) {
     char id_a[SHALEN] = {0};
     char id_b[SHALEN] = {0};
-    if (int fd = xopen(a, O_RDONLY | O_CLOEXEC); fd >= 0) {
-        xread(fd, id_a, SHALEN);
-        close(fd);
-    } else {
+    if (!read_sha256(a, id_a) || !read_sha256(b, id_b))
         return false;
-    }
+    return memcmp(id_a, id_b, SHALEN) == 0;
+}
 
-    if (int fd = xopen(b, O_RDONLY | O_CLOEXEC); fd >= 0) {
-        xread(fd, id_b, SHALEN);
-        close(fd);
-    } else {
+bool SePolicy::check_sha256(::rust::Utf8CStr file, ::rust::Str sha) noexcept {
+    char id[SHALEN] = {0};
+    if (!read_sha256(file.c_str(), id))
         return false;
-    }
-    LOGD("%s=[%.*s]\n", a, SHALEN, id_a);
-    LOGD("%s=[%.*s]\n", b, SHALEN, id_b);
-    return memcmp(id_a, id_b, SHALEN) == 0;
+    LOGD("current=[%.*s]\n", (int) sha.size(), sha.data());
+    return sha.size() == SHALEN && memcmp(id, sha.data(), SHALEN) == 0;
 }
 
 static bool check_precompiled(const char *precompiled) {
@@ -117,95 +122,104 @@ SePolicy SePolicy::from_file(::rust::Utf8CStr file) noexcept {
     return {std::make_unique<sepol_impl>(db)};
 }
 
-SePolicy SePolicy::compile_split() noexcept {
+// Collect all cil files of the split policy in the order they should be loaded
+static rust::Vec<rust::String> collect_split_cil() {
     char path[128], plat_ver[10];
-    cil_db_t *db = nullptr;
-    sepol_policydb_t *pdb = nullptr;
-    FILE *f;
-    int policy_ver;
+    rust::Vec<rust::String> files;
     const char *cil_file;
-#if MAGISK_DEBUG
-    cil_set_log_level(CIL_INFO);
-#endif
-    cil_set_log_handler(+[](int lvl, const char *msg) {
-        if (lvl == CIL_ERR) {
-            LOGE("cil: %s", msg);
-        } else if (lvl == CIL_WARN) {
-            LOGW("cil: %s", msg);
-        } else if (lvl == CIL_INFO) {
-            LOGI("cil: %s", msg);
-        } else {
-            LOGD("cil: %s", msg);
-        }
-    });
-
-    cil_db_init(&db);
-    run_finally fin([db_ptr = &db]{ cil_db_destroy(db_ptr); });
-    cil_set_mls(db, 1);
-    cil_set_multiple_decls(db, 1);
-    cil_set_disable_neverallow(db, 1);
-    cil_set_target_platform(db, SEPOL_TARGET_SELINUX);
-    cil_set_attrs_expand_generated(db, 1);
 
-    f = xfopen(SELINUX_VERSION, "re");
-    fscanf(f, "%d", &policy_ver);
-    fclose(f);
-    cil_set_policy_version(db, policy_ver);
+    auto add = [&](const char *file) {
+        if (access(file, R_OK) == 0)
+            files.emplace_back(file);
+    };
 
     // Get mapping version
-    f = xfopen(VEND_POLICY_DIR "plat_sepolicy_vers.txt", "re");
+    FILE *f = xfopen(VEND_POLICY_DIR "plat_sepolicy_vers.txt", "re");
     fscanf(f, "%s", plat_ver);
     fclose(f);
 
     // plat
-    load_cil(db, SPLIT_PLAT_CIL);
+    files.emplace_back(SPLIT_PLAT_CIL);
 
     sprintf(path, PLAT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    load_cil(db, path);
+    files.emplace_back(path);
 
     sprintf(path, PLAT_POLICY_DIR "mapping/%s.compat.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
+    add(path);
 
     // system_ext
     sprintf(path, SYSEXT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
+    add(path);
 
     sprintf(path, SYSEXT_POLICY_DIR "mapping/%s.compat.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
+    add(path);
 
     cil_file = SYSEXT_POLICY_DIR "system_ext_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
 
     // product
     sprintf(path, PROD_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
+    add(path);
 
     cil_file = PROD_POLICY_DIR "product_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
 
     // vendor
     cil_file = VEND_POLICY_DIR "nonplat_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
 
     cil_file = VEND_POLICY_DIR "plat_pub_versioned.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
 
     cil_file = VEND_POLICY_DIR "vendor_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
 
     // odm
     cil_file = ODM_POLICY_DIR "odm_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add(cil_file);
+
+    return files;
+}
+
+rust::Vec<rust::String> SePolicy::split_cil_files() noexcept {
+    return collect_split_cil();
+}
+
+SePolicy SePolicy::compile_split() noexcept {
+    cil_db_t *db = nullptr;
+    sepol_policydb_t *pdb = nullptr;
+    FILE *f;
+    int policy_ver;
+#if MAGISK_DEBUG
+    cil_set_log_level(CIL_INFO);
+#endif
+    cil_set_log_handler(+[](int lvl, const char *msg) {
+        if (lvl == CIL_ERR) {
+            LOGE("cil: %s", msg);
+        } else if (lvl == CIL_WARN) {
+            LOGW("cil: %s", msg);
+        } else if (lvl == CIL_INFO) {
+            LOGI("cil: %s", msg);
+        } else {
+            LOGD("cil: %s", msg);
+        }
+    });
+
+    cil_db_init(&db);
+    run_finally fin([db_ptr = &db]{ cil_db_destroy(db_ptr); });
+    cil_set_mls(db, 1);
+    cil_set_multiple_decls(db, 1);
+    cil_set_disable_neverallow(db, 1);
+    cil_set_target_platform(db, SEPOL_TARGET_SELINUX);
+    cil_set_attrs_expand_generated(db, 1);
+
+    f = xfopen(SELINUX_VERSION, "re");
+    fscanf(f, "%d", &policy_ver);
+    fclose(f);
+    cil_set_policy_version(db, policy_ver);
+
+    for (const auto &file : collect_split_cil())
+        load_cil(db, std::string(file).data());
 
     if (cil_compile(db))
         return {};
@@ -214,13 +228,29 @@ SePolicy SePolicy::compile_split() noexcept {
     return {std::make_unique<sepol_impl>(&pdb->p)};
 }
 
-SePolicy SePolicy::from_split() noexcept {
+static const char *find_precompiled() {
     const char *odm_pre = ODM_POLICY_DIR "precompiled_sepolicy";
     const char *vend_pre = VEND_POLICY_DIR "precompiled_sepolicy";
     if (access(odm_pre, R_OK) == 0 && check_precompiled(odm_pre))
-        return SePolicy::from_file(odm_pre);
+        return odm_pre;
     else if (access(vend_pre, R_OK) == 0 && check_precompiled(vend_pre))
-        return SePolicy::from_file(vend_pre);
+        return vend_pre;
+    else
+        return nullptr;
+}
+
+rust::Vec<rust::String> SePolicy::split_policy_files() noexcept {
+    if (auto precompiled = find_precompiled()) {
+        rust::Vec<rust::String> files;
+        files.emplace_back(precompiled);
+        return files;
+    }
+    return collect_split_cil();
+}
+
+SePolicy SePolicy::from_split() noexcept {
+    if (auto precompiled = find_precompiled())
+        return SePolicy::from_file(precompiled);
     else
         return SePolicy::compile_split();
 }
@@ -50,6 +50,7 @@ impl SePolicy {
     pub fn magisk_rules(&mut self) {
         // Temp suppress warnings
         set_log_level_state(LogLevel::Warn, false);
+        self.begin_batch();
         rules! {
             use self;
             // Prevent anything to change sepolicy except ourselves
@@ -139,6 +140,7 @@ impl SePolicy {
             deny(["init"], ["adb_data_file"], ["dir"], ["search"]);
             deny(["vendor_init"], ["adb_data_file"], ["dir"], ["search"]);
         }
+        self.commit_batch();
 
         #[cfg(any())]
         self.strip_dontaudit();
@@ -173,11 +173,15 @@ avtab_ptr_t sepol_impl::find_avtab_node(avtab_key_t *key, avtab_extended_perms_t
     return node;
 }
 
+// AUDITDENY, aka DONTAUDIT, are &= assigned, versus |= for others.
+// A node holding its initial value is also redundant.
+static uint32_t av_initial(uint16_t specified) {
+    return specified == AVTAB_AUDITDENY ? ~0U : 0U;
+}
+
 avtab_ptr_t sepol_impl::insert_avtab_node(avtab_key_t *key) {
     avtab_datum_t avdatum{};
-    // AUDITDENY, aka DONTAUDIT, are &= assigned, versus |= for others.
-    // Initialize the data accordingly.
-    avdatum.data = key->specified == AVTAB_AUDITDENY ? ~0U : 0U;
+    avdatum.data = av_initial(key->specified);
     return avtab_insert_nonunique(&db->te_avtab, key, &avdatum);
 }
 
@@ -189,7 +193,170 @@ avtab_ptr_t sepol_impl::get_avtab_node(avtab_key_t *key, avtab_extended_perms_t
     return node;
 }
 
+static uint64_t pack_key(const avtab_key_t *key) {
+    return (uint64_t) key->source_type << 48 | (uint64_t) key->target_type << 32 |
+           (uint64_t) key->target_class << 16 | key->specified;
+}
+
+static avtab_key_t unpack_key(uint64_t k) {
+    avtab_key_t key;
+    key.source_type = k >> 48;
+    key.target_type = k >> 32;
+    key.target_class = k >> 16;
+    key.specified = k;
+    return key;
+}
+
+void sepol_impl::index_batch() {
+    batch->types.clear();
+    batch->attrs.clear();
+    batch->classes.clear();
+    hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
+        type_datum_t *type = auto_cast(node->datum);
+        batch->types.push_back(type);
+        if (type->flavor == TYPE_ATTRIB)
+            batch->attrs.push_back(type);
+    });
+    hashtab_for_each(db->p_classes.table, [&](hashtab_ptr_t node) {
+        batch->classes.push_back(auto_cast(node->datum));
+    });
+}
+
+uint32_t &sepol_impl::batch_av(avtab_key_t *key) {
+    auto [it, inserted] = batch->av.try_emplace(pack_key(key));
+    if (inserted) {
+        avtab_ptr_t node = find_avtab_node(key, nullptr);
+        it->second = node ? node->datum.data : av_initial(key->specified);
+    }
+    return it->second;
+}
+
+void sepol_impl::begin_batch() {
+    if (!batch) {
+        batch = std::make_unique<rule_batch>();
+        index_batch();
+    }
+    ++batch->depth;
+}
+
+// Same sizing as avtab_alloc(), which is also what the kernel picks when loading the policy
+static uint32_t avtab_slots(uint32_t nel) {
+    uint32_t shift = 0;
+    for (uint32_t work = nel; work; work >>= 1)
+        ++shift;
+    if (shift > 2)
+        shift -= 2;
+    return std::min(UINT32_C(1) << shift, (uint32_t) MAX_AVTAB_HASH_BUCKETS);
+}
+
+void sepol_impl::rehash_avtab() {
+    avtab_t *h = &db->te_avtab;
+    uint32_t nslot = avtab_slots(h->nel);
+    if (h->htable == nullptr || nslot <= h->nslot)
+        return;
+
+    auto htable = static_cast<avtab_ptr_t *>(calloc(nslot, sizeof(avtab_ptr_t)));
+    if (htable == nullptr)
+        return;
+    uint32_t mask = nslot - 1;
+
+    // Chains have to stay sorted for avtab_search. As the table only grows, every new
+    // chain is fed from a single old chain, so appending in the old order keeps it sorted.
+    vector<avtab_ptr_t> tails(nslot);
+    for (uint32_t i = 0; i < h->nslot; ++i) {
+        for (avtab_ptr_t cur = h->htable[i], next; cur; cur = next) {
+            next = cur->next;
+            cur->next = nullptr;
+            int hvalue = avtab_hash(&cur->key, mask);
+            if (tails[hvalue])
+                tails[hvalue]->next = cur;
+            else
+                htable[hvalue] = cur;
+            tails[hvalue] = cur;
+        }
+    }
+
+    free(h->htable);
+    h->htable = htable;
+    h->nslot = nslot;
+    h->mask = mask;
+}
+
+void sepol_impl::print_avtab_stats(FILE *fp) {
+    avtab_t *h = &db->te_avtab;
+    // Chain lengths: 0, 1, 2, 3, 4, 5-8, 9-16, 17+
+    static constexpr const char *names[] = { "0", "1", "2", "3", "4", "5-8", "9-16", "17+" };
+    size_t dist[std::size(names)] = {};
+    uint32_t used = 0;
+    uint32_t max_len = 0;
+    uint64_t probes = 0;
+
+    for (uint32_t i = 0; i < h->nslot; ++i) {
+        uint32_t len = 0;
+        for (avtab_ptr_t cur = h->htable[i]; cur; cur = cur->next)
+            ++len;
+        if (len)
+            ++used;
+        max_len = std::max(max_len, len);
+        // Finding every node once costs 1 + 2 + ... + len
+        probes += (uint64_t) len * (len + 1) / 2;
+        if (len <= 4)
+            ++dist[len];
+        else if (len <= 8)
+            ++dist[5];
+        else if (len <= 16)
+            ++dist[6];
+        else
+            ++dist[7];
+    }
+
+    fprintf(fp, "avtab: %u nodes, %u slots, %u used\n", h->nel, h->nslot, used);
+    fprintf(fp, "avtab: max chain %u, avg chain %.2f, avg probes %.2f\n", max_len,
+            used ? (double) h->nel / used : 0.0, h->nel ? (double) probes / h->nel : 0.0);
+    for (size_t i = 0; i < std::size(names); ++i)
+        fprintf(fp, "avtab: chain %-4s %zu\n", names[i], dist[i]);
+    // Interleaved with output from Rust
+    fflush(fp);
+}
+
+void sepol_impl::commit_batch() {
+    if (!batch || --batch->depth > 0)
+        return;
+    for (auto &[k, data] : batch->av) {
+        avtab_key_t key = unpack_key(k);
+        avtab_ptr_t node = find_avtab_node(&key, nullptr);
+        if (data == av_initial(key.specified)) {
+            // Redundant rules are not kept in the avtab
+            if (node)
+                avtab_remove_node(&db->te_avtab, node);
+            continue;
+        }
+        if (node == nullptr)
+            node = insert_avtab_node(&key);
+        node->datum.data = data;
+    }
+    batch.reset();
+
+    // Keep lookups cheap after a large amount of new nodes
+    rehash_avtab();
+}
+
 void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, perm_datum_t *perm, int effect, bool invert) {
+    if (batch && (src == nullptr || tgt == nullptr || cls == nullptr)) {
+        // Expand wildcards with the candidates collected at the start of the batch
+        if (src == nullptr) {
+            for (auto type : strip_av(effect, invert) ? batch->types : batch->attrs)
+                add_rule(type, tgt, cls, perm, effect, invert);
+        } else if (tgt == nullptr) {
+            for (auto type : strip_av(effect, invert) ? batch->types : batch->attrs)
+                add_rule(src, type, cls, perm, effect, invert);
+        } else {
+            for (auto c : batch->classes)
+                add_rule(src, tgt, c, perm, effect, invert);
+        }
+        return;
+    }
+
     if (src == nullptr) {
         if (strip_av(effect, invert)) {
             // Stripping av, have to go through all types for correct results
@@ -223,6 +390,16 @@ void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *c
         key.target_class = cls->s.value;
         key.specified = effect;
 
+        if (batch) {
+            // Merge into the pending access vector, the avtab is updated on commit
+            uint32_t &data = batch_av(&key);
+            if (invert)
+                data = perm ? data & ~(1U << (perm->s.value - 1)) : 0U;
+            else
+                data = perm ? data | 1U << (perm->s.value - 1) : ~0U;
+            return;
+        }
+
         avtab_ptr_t node = get_avtab_node(&key, nullptr);
         if (invert) {
             if (perm)
@@ -616,6 +793,10 @@ bool sepol_impl::add_type(Str type_name, uint32_t flavor) {
         type_set_expand(&db->role_val_to_struct[i]->types, &db->role_val_to_struct[i]->cache, db, 0);
     }
 
+    // The new type has to take part in wildcard expansion
+    if (batch)
+        index_batch();
+
     return true;
 }
 
@@ -688,6 +869,10 @@ void SePolicy::strip_dontaudit() noexcept {
     });
 }
 
+void SePolicy::print_stats() const noexcept {
+    impl->print_avtab_stats(stdout);
+}
+
 void SePolicy::print_rules() const noexcept {
     hashtab_for_each(impl->db->p_types.table, [this](hashtab_ptr_t node) {
         type_datum_t *type = auto_cast(node->datum);
@@ -287,10 +287,13 @@ impl SePolicy {
     }
 
     fn load_rules_from_reader<T: BufRead>(&mut self, reader: &mut T) {
+        // Merge all AV rules and only update the avtab once
+        self.begin_batch();
         reader.foreach_lines(|line| {
             self.parse_statement(line);
             true
         });
+        self.commit_batch();
     }
 
     fn parse_statement(&mut self, statement: &str) {
@@ -7,6 +7,9 @@
 # With an emulator booted and accessible via ADB, usage:
 # ./build.py avd_patch path/to/booted/avd-image/ramdisk.img
 #
+# Set PAYLOADCOMP=lz4 (build.py avd_patch --lz4) to embed the binaries
+# compressed with LZ4 instead of xz, like boot_patch.sh.
+#
 # The purpose of this script is to patch AVD ramdisk.img and do a
 # full integration test of magiskinit under several circumstances.
 # After patching ramdisk.img, close the emulator, then select
@@ -76,23 +79,26 @@ echo "PREINITDEVICE=$(./magisk --preinit-device)" >> config
 [ $API = "28" ] && echo 'RECOVERYMODE=true' >> config
 cat config
 
-./magiskboot compress=xz magisk magisk.xz
-./magiskboot compress=xz stub.apk stub.xz
-./magiskboot compress=xz init-ld init-ld.xz
+# Same payload compression switch as boot_patch.sh
+[ "$PAYLOADCOMP" = "lz4" ] || PAYLOADCOMP=xz
+
+./magiskboot compress=$PAYLOADCOMP magisk magisk.$PAYLOADCOMP
+./magiskboot compress=$PAYLOADCOMP stub.apk stub.$PAYLOADCOMP
+./magiskboot compress=$PAYLOADCOMP init-ld init-ld.$PAYLOADCOMP
 
 ./magiskboot cpio ramdisk.cpio \
 "add 0750 init magiskinit" \
 "mkdir 0750 overlay.d" \
 "mkdir 0750 overlay.d/sbin" \
-"add 0644 overlay.d/sbin/magisk.xz magisk.xz" \
-"add 0644 overlay.d/sbin/stub.xz stub.xz" \
-"add 0644 overlay.d/sbin/init-ld.xz init-ld.xz" \
+"add 0644 overlay.d/sbin/magisk.$PAYLOADCOMP magisk.$PAYLOADCOMP" \
+"add 0644 overlay.d/sbin/stub.$PAYLOADCOMP stub.$PAYLOADCOMP" \
+"add 0644 overlay.d/sbin/init-ld.$PAYLOADCOMP init-ld.$PAYLOADCOMP" \
 "patch" \
 "backup ramdisk.cpio.orig" \
 "mkdir 000 .backup" \
 "add 000 .backup/.magisk config"
 
-rm -f ramdisk.cpio.orig config *.xz
+rm -f ramdisk.cpio.orig config *.$PAYLOADCOMP
 if $IS_RAMDISK; then
   ./magiskboot compress=gzip ramdisk.cpio "$OUTPUT_FILE"
 else
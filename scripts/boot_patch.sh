@@ -6,7 +6,10 @@
 # Usage: boot_patch.sh <bootimage>
 #
 # The following environment variables can configure the installation:
-# KEEPVERITY, KEEPFORCEENCRYPT, PATCHVBMETAFLAG, RECOVERYMODE, LEGACYSAR
+# KEEPVERITY, KEEPFORCEENCRYPT, PATCHVBMETAFLAG, RECOVERYMODE, LEGACYSAR, PAYLOADCOMP
+#
+# PAYLOADCOMP selects how binaries embedded into the ramdisk are compressed:
+# xz (default) is the smallest, lz4 is larger but much faster to extract during boot
 #
 # This script should be placed in a directory with the following files:
 #
@@ -75,6 +78,7 @@ fi
 [ -z $PATCHVBMETAFLAG ] && PATCHVBMETAFLAG=false
 [ -z $RECOVERYMODE ] && RECOVERYMODE=false
 [ -z $LEGACYSAR ] && LEGACYSAR=false
+[ "$PAYLOADCOMP" = "lz4" ] || PAYLOADCOMP=xz
 export KEEPVERITY
 export KEEPFORCEENCRYPT
 export PATCHVBMETAFLAG
@@ -163,9 +167,9 @@ ui_print "- Patching ramdisk"
 $BOOTMODE && [ -z "$PREINITDEVICE" ] && PREINITDEVICE=$(./magisk --preinit-device)
 
 # Compress to save precious ramdisk space
-./magiskboot compress=xz magisk magisk.xz
-./magiskboot compress=xz stub.apk stub.xz
-./magiskboot compress=xz init-ld init-ld.xz
+./magiskboot compress=$PAYLOADCOMP magisk magisk.$PAYLOADCOMP
+./magiskboot compress=$PAYLOADCOMP stub.apk stub.$PAYLOADCOMP
+./magiskboot compress=$PAYLOADCOMP init-ld init-ld.$PAYLOADCOMP
 
 echo "KEEPVERITY=$KEEPVERITY" > config
 echo "KEEPFORCEENCRYPT=$KEEPFORCEENCRYPT" >> config
@@ -180,16 +184,16 @@ fi
 "add 0750 init magiskinit" \
 "mkdir 0750 overlay.d" \
 "mkdir 0750 overlay.d/sbin" \
-"add 0644 overlay.d/sbin/magisk.xz magisk.xz" \
-"add 0644 overlay.d/sbin/stub.xz stub.xz" \
-"add 0644 overlay.d/sbin/init-ld.xz init-ld.xz" \
+"add 0644 overlay.d/sbin/magisk.$PAYLOADCOMP magisk.$PAYLOADCOMP" \
+"add 0644 overlay.d/sbin/stub.$PAYLOADCOMP stub.$PAYLOADCOMP" \
+"add 0644 overlay.d/sbin/init-ld.$PAYLOADCOMP init-ld.$PAYLOADCOMP" \
 "patch" \
 "$SKIP_BACKUP backup ramdisk.cpio.orig" \
 "mkdir 000 .backup" \
 "add 000 .backup/.magisk config" \
 || abort "! Unable to patch ramdisk"
 
-rm -f ramdisk.cpio.orig config *.xz
+rm -f ramdisk.cpio.orig config *.$PAYLOADCOMP
 
 #################
 # Binary Patches
@@ -210,19 +214,17 @@ done
 if [ -f kernel ]; then
   PATCHEDKERNEL=false
   # Remove Samsung RKP
-  ./magiskboot hexpatch kernel \
-  49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054 \
-  A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054 \
-  && PATCHEDKERNEL=true
-
   # Remove Samsung defex
-  # Before: [mov w2, #-221]   (-__NR_execve)
-  # After:  [mov w2, #-32768]
-  ./magiskboot hexpatch kernel 821B8012 E2FF8F12 && PATCHEDKERNEL=true
-
+  #   Before: [mov w2, #-221]   (-__NR_execve)
+  #   After:  [mov w2, #-32768]
   # Disable Samsung PROCA
-  # proca_config -> proca_magisk
+  #   proca_config -> proca_magisk
+  # All pairs are applied in a single pass, so a pattern is never matched
+  # against bytes written by another pair's replacement
   ./magiskboot hexpatch kernel \
+  49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054 \
+  A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054 \
+  821B8012 E2FF8F12 \
   70726F63615F636F6E66696700 \
   70726F63615F6D616769736B00 \
   && PATCHEDKERNEL=true
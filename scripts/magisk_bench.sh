@@ -0,0 +1,444 @@
+#!/system/bin/sh
+#######################################################################################
+# Magisk Daemon Benchmark
+#######################################################################################
+#
+# Usage: magisk_bench.sh [benchmark...]
+#
+# Times operations served by a running magiskd. It has to run as root on a device
+# with Magisk installed. Run it once on each build to compare them.
+# Results are printed to stdout as JSON, progress and errors go to stderr.
+#
+# Available benchmarks (default: all):
+#
+# log: lines/sec the log daemon writes to /cache/magisk.log, fed straight
+#      through the log pipe
+#
+# modules: the two module scans of post-fs-data on a synthetic module tree,
+#          keeping unchanged scan results and checking every module again.
+#          Needs a debug build, syscalls are counted if strace is available
+#
+# restorecon: files checked and skipped by the boot restorecon walk over a tmpfs
+#             tree, with a user xattr in place of the label. Needs a debug build
+#
+# su_sessions: many concurrent root shells, checking that each gets its own
+#              exit code, that new requests are served while they all run,
+#              and that no session is left unreaped
+#
+# su_server: commands/sec through one su --server session against one
+#            su -c process per command
+#
+# su_cache: root requests from the shell uid served from the cached su info,
+#           and after a database write. Checks that root access and policy
+#           changes apply to the very next request
+#
+# sqlite: rows/sec streamed back by magisk --sqlite. If strace is available,
+#         checks that the rows are not read with a syscall each, and counts
+#         the writes of a su client request
+#
+# The following environment variables are optional:
+#
+# LOG_LINES: number of log lines to write (default: 20000)
+# MODULES: number of synthetic modules (default: 200)
+# LABEL_FILES: number of files in the restorecon tree (default: 1000)
+# SU_SESSIONS: number of concurrent su sessions (default: 64)
+# SU_COMMANDS: number of commands run by su_server (default: 10000)
+# SU_CACHE_ROUNDS: number of requests in each su_cache case (default: 200)
+# SQLITE_ROWS: number of rows returned by sqlite (default: 20000)
+#
+#######################################################################################
+
+MAGISKTMP="$(magisk --path)"
+if [ -z "$MAGISKTMP" ] || [ "$(id -u)" != 0 ]; then
+  echo "! Run as root with Magisk installed" >&2
+  exit 1
+fi
+
+[ -z "$LOG_LINES" ] && LOG_LINES=20000
+[ -z "$MODULES" ] && MODULES=200
+[ -z "$LABEL_FILES" ] && LABEL_FILES=1000
+[ -z "$SU_SESSIONS" ] && SU_SESSIONS=64
+[ -z "$SU_COMMANDS" ] && SU_COMMANDS=10000
+[ -z "$SU_CACHE_ROUNDS" ] && SU_CACHE_ROUNDS=200
+[ -z "$SQLITE_ROWS" ] && SQLITE_ROWS=20000
+
+BENCHES="$*"
+[ -z "$BENCHES" ] && BENCHES="log modules restorecon su_sessions su_server su_cache sqlite"
+
+WORK="${TMPDIR:-/data/local/tmp}/magisk_bench"
+rm -rf "$WORK"
+mkdir -p "$WORK" || exit 1
+cd "$WORK" || exit 1
+RESULTS="$WORK/results"
+: > "$RESULTS"
+
+##################
+# Helpers
+##################
+
+# Little endian integers
+u32() {
+  local v=$(($1))
+  printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+    $((v & 255)) $((v >> 8 & 255)) $((v >> 16 & 255)) $((v >> 24 & 255)))"
+}
+
+now() {
+  date +%s%N
+}
+
+# $1 = SQL
+sql() {
+  magisk --sqlite "$1"
+}
+
+# $1 = action, $2 = case, $3 = operations, $4 = start ns, $5 = end ns
+report() {
+  awk -v a=$1 -v n=$2 -v c=$3 -v ns=$(($5 - $4)) 'BEGIN {
+    printf "{\"action\":\"%s\",\"case\":\"%s\",\"count\":%d,\"ms\":%.3f,\"per_s\":%.1f}\n",
+      a, n, c, ns / 1000000, (ns > 0 ? c * 1000000000 / ns : 0)
+  }' >> "$RESULTS"
+}
+
+##################
+# Benchmarks
+##################
+
+bench_log() {
+  local logfile=/cache/magisk.log marker="magisk_bench_$$_$(now)" msg n=1 start end
+  echo "- log: $LOG_LINES lines" >&2
+
+  # A raw record as written by magisk_log_to_pipe: prio, len, pid, tid, message
+  msg="$marker: the quick brown fox jumps over the lazy dog
+"
+  { u32 4; u32 ${#msg}; u32 $$; u32 $$; printf '%s' "$msg"; } > record
+  cp record records
+  while [ $n -lt $LOG_LINES ]; do
+    cat records records > records.tmp
+    mv records.tmp records
+    n=$((n * 2))
+  done
+  head -c $((LOG_LINES * $(stat -c %s record))) records > records.tmp
+  mv records.tmp records
+
+  start=$(now)
+  cat records > "$MAGISKTMP/.magisk/device/log"
+  end=$(now)
+  report log pipe_write $LOG_LINES $start $end
+
+  # The file may be rotated into magisk.log.bak halfway through
+  while [ $(cat $logfile.bak $logfile 2>/dev/null | grep -c "$marker") -lt $LOG_LINES ]; do
+    if [ $(($(now) - start)) -gt 60000000000 ]; then
+      echo "! log: timed out waiting for $logfile" >&2
+      return 1
+    fi
+    sleep 0.05
+  done
+  end=$(now)
+  report log on_disk $LOG_LINES $start $end
+  rm -f record records
+}
+
+bench_modules() {
+  local i m disable= variant out same=true memfds=
+  echo "- modules: $MODULES modules" >&2
+  if ! magisk -c | grep -q ':MAGISK:D'; then
+    echo "! modules: needs a debug build" >&2
+    return 1
+  fi
+
+  # Every other module has zygisk libraries, every tenth is disabled by its
+  # post-fs-data script, which the second scan has to notice
+  i=0
+  while [ $i -lt $MODULES ]; do
+    m=modules/mod$i
+    mkdir -p $m/system/bin
+    printf 'id=mod%d\nname=mod%d\nversion=1\nversionCode=1\n' $i $i > $m/module.prop
+    echo "#!/system/bin/sh" > $m/post-fs-data.sh
+    echo bench > $m/system/bin/bench_mod$i
+    if [ $((i % 2)) -eq 0 ]; then
+      mkdir $m/zygisk
+      for abi in armeabi-v7a arm64-v8a x86 x86_64 riscv64; do
+        head -c 65536 /dev/urandom > $m/zygisk/$abi.so
+      done
+    fi
+    [ $((i % 10)) -eq 1 ] && disable="$disable mod$i"
+    i=$((i + 1))
+  done
+
+  for variant in "" --full; do
+    rm -f modules/*/disable
+    if command -v strace >/dev/null; then
+      out=$(strace -f -o trace magisk --test-module-scan $variant "$WORK/modules" $disable)
+    else
+      out=$(magisk --test-module-scan $variant "$WORK/modules" $disable)
+    fi || same=false
+    [ -z "$out" ] && continue
+    [ -z "$memfds" ] && memfds=${out##*\"memfds\":}
+    [ "${out##*\"memfds\":}" = "$memfds" ] || same=false
+    if [ -f trace ]; then
+      out="${out%\}},\"syscalls\":$(wc -l < trace),\"openat\":$(grep -c 'openat(' trace)"
+      out="$out,\"faccessat\":$(grep -c 'faccessat' trace),\"memfd_create\":$(grep -c 'memfd_create' trace)}"
+      rm -f trace
+    fi
+    echo "{\"action\":\"module_scan\",${out#\{}" >> "$RESULTS"
+  done
+  # Both variants have to enable the same modules with the same zygisk libraries
+  [ $same = true ] || echo "! modules: scans with kept results differ from full scans" >&2
+  printf '{"action":"verify","case":"module_scan","same":%s}\n' $same >> "$RESULTS"
+  rm -rf modules
+}
+
+# $1 = run, $2 = expected checked, $3 = expected fixed
+restorecon_run() {
+  local out start end
+  # Timestamps of the previous run have to fall behind the manifest it wrote
+  sleep 0.1
+  start=$(now)
+  out=$(magisk --test-restorecon "$WORK/tree" "$WORK/manifest") || restorecon_ok=false
+  end=$(now)
+  report restorecon $1 $((LABEL_FILES + LABEL_FILES / 50 + 1)) $start $end
+  echo "{\"action\":\"restorecon_walk\",\"case\":\"$1\",${out#\{}" >> "$RESULTS"
+  case "$out" in
+    *\"checked\":$2,*\"fixed\":$3\}) ;;
+    *)
+      echo "! restorecon [$1]: expected $2 checked and $3 fixed, got $out" >&2
+      restorecon_ok=false
+      ;;
+  esac
+}
+
+bench_restorecon() {
+  local i d total
+  restorecon_ok=true
+  echo "- restorecon: $LABEL_FILES files" >&2
+  if ! magisk -c | grep -q ':MAGISK:D'; then
+    echo "! restorecon: needs a debug build" >&2
+    return 1
+  fi
+  mkdir tree
+  mount -t tmpfs tmpfs tree || return 1
+  if ! setfattr -n user.magisk.test -v unlabeled tree; then
+    echo "! restorecon: tmpfs has no user xattr support" >&2
+    umount tree
+    return 1
+  fi
+
+  # 50 files per directory, every file and directory starts unlabeled
+  i=0
+  while [ $i -lt $LABEL_FILES ]; do
+    d=tree/d$((i / 50))
+    if [ $((i % 50)) -eq 0 ]; then
+      mkdir $d
+      setfattr -n user.magisk.test -v unlabeled $d
+    fi
+    echo $i > $d/f$i
+    setfattr -n user.magisk.test -v unlabeled $d/f$i
+    i=$((i + 1))
+  done
+  total=$((LABEL_FILES + LABEL_FILES / 50 + 1))
+
+  restorecon_run first $total $total
+  # Entries relabeled in the last timestamp tick of a run are checked again once
+  restorecon_run settle '[0-9]*' 0
+  restorecon_run unchanged 0 0
+  # A relabel only changes the file itself, not its directory
+  setfattr -n user.magisk.test -v unlabeled tree/d3/f150
+  restorecon_run relabeled 1 1
+  restorecon_run settle '[0-9]*' 0
+  echo new > tree/d5/new
+  setfattr -n user.magisk.test -v unlabeled tree/d5/new
+  restorecon_run added 2 1
+
+  printf '{"action":"verify","case":"restorecon","same":%s}\n' $restorecon_ok >> "$RESULTS"
+  umount tree
+  rm -rf tree manifest
+}
+
+bench_su_sessions() {
+  local i pid ok=true start end daemon=$(pidof magiskd) zombies threads
+  echo "- su_sessions: $SU_SESSIONS sessions" >&2
+
+  # Each session holds its shell open, then exits with its own code
+  start=$(now)
+  i=0
+  while [ $i -lt $SU_SESSIONS ]; do
+    su -c "sleep 3; exit $((i % 100 + 1))" >/dev/null 2>&1 &
+    eval pid_$i=\$!
+    i=$((i + 1))
+  done
+  sleep 1
+  threads=$(awk '/^Threads:/ { print $2 }' /proc/$daemon/status)
+
+  # Sessions no longer hold a worker thread each, so a new request
+  # is served while all of them are still running
+  i=$(now)
+  su -c true || ok=false
+  end=$(now)
+  report su_sessions busy_request 1 $i $end
+  if [ $((end - i)) -gt 2000000000 ]; then
+    echo "! su_sessions: a request waited behind the running sessions" >&2
+    ok=false
+  fi
+
+  i=0
+  while [ $i -lt $SU_SESSIONS ]; do
+    eval pid=\$pid_$i
+    wait $pid
+    if [ $? -ne $((i % 100 + 1)) ]; then
+      echo "! su_sessions: session $i returned the wrong exit code" >&2
+      ok=false
+    fi
+    i=$((i + 1))
+  done
+  end=$(now)
+  report su_sessions concurrent $SU_SESSIONS $start $end
+
+  # Every session has to be reaped by the daemon
+  zombies=$(grep -l '^State:.*Z' /proc/[0-9]*/status 2>/dev/null | \
+    xargs grep -l "^PPid:[[:space:]]*$daemon\$" 2>/dev/null | wc -l)
+  [ $zombies -eq 0 ] || { echo "! su_sessions: $zombies unreaped sessions" >&2; ok=false; }
+  magisk -v >/dev/null || ok=false
+  # threads is the daemon thread count while all sessions were running
+  printf '{"action":"verify","case":"su_sessions","same":%s,"zombies":%d,"threads":%d}\n' \
+    $ok $zombies $threads >> "$RESULTS"
+}
+
+bench_su_server() {
+  local i n=1 start end ok=true
+  echo "- su_server: $SU_COMMANDS commands" >&2
+
+  start=$(now)
+  i=0
+  while [ $i -lt $SU_COMMANDS ]; do
+    su -c true || ok=false
+    i=$((i + 1))
+  done
+  end=$(now)
+  report su_server su_c $SU_COMMANDS $start $end
+
+  # Requests are [id][len][command], every reply to 'true' is
+  # [id][0][0][][0][] and takes 16 bytes
+  { u32 0; u32 4; printf true; } > request
+  cp request requests
+  while [ $n -lt $SU_COMMANDS ]; do
+    cat requests requests > requests.tmp
+    mv requests.tmp requests
+    n=$((n * 2))
+  done
+  head -c $((SU_COMMANDS * 12)) requests > requests.tmp
+  mv requests.tmp requests
+
+  start=$(now)
+  su --server < requests > replies || ok=false
+  end=$(now)
+  report su_server server $SU_COMMANDS $start $end
+  [ $(stat -c %s replies) -eq $((SU_COMMANDS * 16)) ] || ok=false
+  [ $ok = true ] || echo "! su_server: missing or failed replies" >&2
+  printf '{"action":"verify","case":"su_server","same":%s}\n' $ok >> "$RESULTS"
+  rm -f request requests replies
+}
+
+# Root request from the shell uid, which goes through the cached su info of uid 2000
+shell_su() {
+  su 2000 -c 'su -c true' >/dev/null 2>&1
+}
+
+bench_su_cache() {
+  local i start end total ok=true access policy
+  echo "- su_cache: $SU_CACHE_ROUNDS requests" >&2
+
+  access=$(sql "SELECT value FROM settings WHERE key='root_access'" | sed 's/^value=//')
+  policy=$(sql "SELECT policy,until,logging,notification FROM policies WHERE uid=2000" | \
+    sed 's/[a-z]*=//g; s/|/,/g')
+  sql "REPLACE INTO settings (key,value) VALUES('root_access',3)"
+  sql "REPLACE INTO policies (uid,policy,until,logging,notification) VALUES(2000,2,0,0,0)"
+
+  # Every change has to apply to the very next request, cached or not
+  shell_su || { echo "! su_cache: allowed request was denied" >&2; ok=false; }
+  sql "REPLACE INTO settings (key,value) VALUES('root_access',1)"
+  shell_su && { echo "! su_cache: request allowed after root access was limited to apps" >&2; ok=false; }
+  sql "REPLACE INTO settings (key,value) VALUES('root_access',3)"
+  shell_su || { echo "! su_cache: request denied after root access was restored" >&2; ok=false; }
+  sql "UPDATE policies SET policy=1 WHERE uid=2000"
+  shell_su && { echo "! su_cache: request allowed after the policy was denied" >&2; ok=false; }
+  sql "UPDATE policies SET policy=2 WHERE uid=2000"
+
+  # Requests served from the cache
+  shell_su
+  start=$(now)
+  i=0
+  while [ $i -lt $SU_CACHE_ROUNDS ]; do
+    shell_su || ok=false
+    i=$((i + 1))
+  done
+  end=$(now)
+  report su_cache cached $SU_CACHE_ROUNDS $start $end
+
+  # Requests after a database write, each rebuilds the su info. Only the requests are timed.
+  total=0
+  i=0
+  while [ $i -lt $SU_CACHE_ROUNDS ]; do
+    sql "UPDATE settings SET value=value WHERE key='root_access'"
+    start=$(now)
+    shell_su || ok=false
+    end=$(now)
+    total=$((total + end - start))
+    i=$((i + 1))
+  done
+  report su_cache invalidated $SU_CACHE_ROUNDS 0 $total
+
+  if [ -z "$access" ]; then
+    sql "DELETE FROM settings WHERE key='root_access'"
+  else
+    sql "REPLACE INTO settings (key,value) VALUES('root_access',$access)"
+  fi
+  if [ -z "$policy" ]; then
+    sql "DELETE FROM policies WHERE uid=2000"
+  else
+    sql "REPLACE INTO policies (uid,policy,until,logging,notification) VALUES(2000,$policy)"
+  fi
+  printf '{"action":"verify","case":"su_cache","same":%s}\n' $ok >> "$RESULTS"
+}
+
+bench_sqlite() {
+  local query start end rows reads=-1 writes=-1 ok=true
+  echo "- sqlite: $SQLITE_ROWS rows" >&2
+
+  # Rows generated by sqlite itself, nothing is read from or written to the database
+  query="WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM n WHERE x<$SQLITE_ROWS)
+    SELECT x, 'the quick brown fox jumps over the lazy dog' AS s FROM n"
+  start=$(now)
+  sql "$query" > rows || ok=false
+  end=$(now)
+  report sqlite rows $SQLITE_ROWS $start $end
+  rows=$(wc -l < rows)
+  [ $rows -eq $SQLITE_ROWS ] || { echo "! sqlite: got $rows of $SQLITE_ROWS rows" >&2; ok=false; }
+
+  if command -v strace >/dev/null; then
+    # Streamed rows are read through a buffer, not with two reads each
+    strace -o trace magisk --sqlite "$query" > /dev/null
+    reads=$(grep -c '^read(' trace)
+    if [ $reads -ge $SQLITE_ROWS ]; then
+      echo "! sqlite: $reads reads for $SQLITE_ROWS rows" >&2
+      ok=false
+    fi
+    # The su request goes out in one write, the rest is the client setup
+    strace -o trace su -c true
+    writes=$(grep -cE '^writev?\(' trace)
+  fi
+  printf '{"action":"verify","case":"sqlite","same":%s,"reads":%d,"su_writes":%d}\n' \
+    $ok $reads $writes >> "$RESULTS"
+  rm -f rows trace
+}
+
+for b in $BENCHES; do
+  bench_$b
+done
+
+echo '{"results":['
+sed '$!s/$/,/' "$RESULTS"
+echo ']}'
+
+cd /
+rm -rf "$WORK"
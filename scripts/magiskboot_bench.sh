@@ -0,0 +1,607 @@
+#!/system/bin/sh
+#######################################################################################
+# MagiskBoot Benchmark
+#######################################################################################
+#
+# Usage: magiskboot_bench.sh <magiskboot> [workdir]
+#
+# Generates a synthetic corpus of boot images and times magiskboot actions on it.
+# Results are printed to stdout as JSON, progress and errors go to stderr.
+#
+# This script can run on devices or any Linux host that can execute <magiskboot>.
+# The following environment variables are optional:
+#
+# FORMATS: compression formats to benchmark (default: all except zopfli)
+# KERNEL_MB: size of the synthetic kernel in MB (default: 16)
+# PAD_MB: size of the unknown pre-header in front of padded boot images in MB,
+#         which the header scan has to skip (default: 1)
+# CPIO_FILES: number of files in the generated ramdisk used to benchmark
+#             loading, patching and dumping a large cpio (default: 2000)
+# HEXPATCH_MB: size of the file 20 hexpatch patterns are applied to in MB (default: 40)
+# SHA_MB: size of the file hashed by "sha1" in MB (default: 256)
+# DTB: a dtb file to benchmark "dtb patch" on
+# PAYLOAD: a payload.bin or OTA zip to benchmark "extract" on
+# PAYLOAD_MB: size of the system partition in the generated full OTA payload in MB,
+#             0 to skip it (default: 64)
+# PAYLOADS: files embedded by magiskinit (e.g. "magisk stub.apk init-ld") to compare
+#           xz and lz4 extraction time and size on
+#
+# Peak RSS is only reported when GNU time is installed as /usr/bin/time.
+#
+#######################################################################################
+
+if [ -z "$1" ]; then
+  echo "Usage: $0 <magiskboot> [workdir]" >&2
+  exit 1
+fi
+
+MAGISKBOOT="$(readlink -f "$1")"
+WORK="${2:-${TMPDIR:-/data/local/tmp}/magiskboot_bench}"
+[ -z "$FORMATS" ] && FORMATS="gzip xz lzma bzip2 lz4 lz4_legacy lz4_lg"
+[ -z "$KERNEL_MB" ] && KERNEL_MB=16
+[ -z "$PAD_MB" ] && PAD_MB=1
+[ -z "$PAYLOAD_MB" ] && PAYLOAD_MB=64
+[ -z "$CPIO_FILES" ] && CPIO_FILES=2000
+[ -z "$HEXPATCH_MB" ] && HEXPATCH_MB=40
+[ -z "$SHA_MB" ] && SHA_MB=256
+
+EMBEDDED=
+for f in $PAYLOADS; do
+  [ -f "$f" ] && EMBEDDED="$EMBEDDED $(readlink -f "$f")"
+done
+
+CMDLINE="console=ttyMSM0,115200n8 androidboot.hardware=bench"
+
+rm -rf "$WORK"
+mkdir -p "$WORK" || exit 1
+cd "$WORK" || exit 1
+RESULTS="$WORK/results"
+: > "$RESULTS"
+
+TIME=
+if /usr/bin/time -f %M true >/dev/null 2>&1; then
+  TIME=/usr/bin/time
+fi
+
+##################
+# Binary helpers
+##################
+
+# Little endian integers
+u32() {
+  local v=$(($1))
+  printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+    $((v & 255)) $((v >> 8 & 255)) $((v >> 16 & 255)) $((v >> 24 & 255)))"
+}
+
+u64() {
+  u32 $1
+  u32 0
+}
+
+u16() {
+  local v=$(($1))
+  printf "$(printf '\\%03o\\%03o' $((v & 255)) $((v >> 8 & 255)))"
+}
+
+# Big endian integers
+be32() {
+  local v=$(($1))
+  printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+    $((v >> 24 & 255)) $((v >> 16 & 255)) $((v >> 8 & 255)) $((v & 255)))"
+}
+
+be64() {
+  be32 $(($1 >> 32))
+  be32 $(($1 & 0xFFFFFFFF))
+}
+
+# Protobuf encoding
+varint() {
+  local v=$(($1)) s=
+  while [ $v -ge 128 ]; do
+    s="$s$(printf '\\%03o' $((v & 127 | 128)))"
+    v=$((v >> 7))
+  done
+  printf "$s$(printf '\\%03o' $v)"
+}
+
+# $1 = field number, $2 = value
+pb_int() {
+  varint $(($1 << 3))
+  varint $2
+}
+
+# $1 = field number, $2 = string
+pb_str() {
+  varint $(($1 << 3 | 2))
+  varint ${#2}
+  printf '%s' "$2"
+}
+
+# $1 = field number, $2 = file with the embedded message
+pb_msg() {
+  varint $(($1 << 3 | 2))
+  varint $(fsize $2)
+  cat $2
+}
+
+zeros() {
+  [ $1 -gt 0 ] && head -c $1 /dev/zero
+}
+
+# $1 = string, $2 = field size
+str() {
+  printf '%s' "$1"
+  zeros $(($2 - ${#1}))
+}
+
+# $1 = size, $2 = page size
+pad() {
+  zeros $(((($1 + $2 - 1) / $2) * $2 - $1))
+}
+
+fsize() {
+  stat -c %s "$1"
+}
+
+##################
+# Image builders
+##################
+
+# $1 = header version, $2 = kernel, $3 = ramdisk
+mk_boot() {
+  local ver=$1 ksz=$(fsize $2) rsz=$(fsize $3) page=2048 hsz
+  printf 'ANDROID!'
+  if [ $ver -ge 3 ]; then
+    page=4096
+    hsz=1580
+    [ $ver -eq 4 ] && hsz=1584
+    u32 $ksz; u32 $rsz; u32 0; u32 $hsz
+    zeros 16; u32 $ver
+    str "$CMDLINE" 1536
+    [ $ver -eq 4 ] && u32 0
+  else
+    hsz=1632
+    [ $ver -eq 1 ] && hsz=1648
+    [ $ver -eq 2 ] && hsz=1660
+    u32 $ksz; u32 0x10008000; u32 $rsz; u32 0x11000000
+    u32 0; u32 0x10f00000; u32 0x10000100; u32 $page; u32 $ver; u32 0
+    str bench 16; str "$CMDLINE" 512; zeros 32; zeros 1024
+    [ $ver -ge 1 ] && { u32 0; u64 0; u32 $hsz; }
+    [ $ver -eq 2 ] && { u32 0; u64 0; }
+  fi
+  pad $hsz $page
+  cat $2; pad $ksz $page
+  cat $3; pad $rsz $page
+}
+
+# $1 = header version, rest = ramdisks
+mk_vendor_boot() {
+  local ver=$1 page=4096 hsz=2112 total=0 off=0 n=0 r
+  shift
+  for r in "$@"; do total=$((total + $(fsize $r))); done
+  [ $ver -eq 4 ] && hsz=2128
+  printf 'VNDRBOOT'
+  u32 $ver; u32 $page; u32 0x10008000; u32 0x11000000; u32 $total
+  str "$CMDLINE" 2048
+  u32 0x10000100; str bench 16; u32 $hsz; u32 0; u64 0
+  [ $ver -eq 4 ] && { u32 $((108 * $#)); u32 $#; u32 108; u32 0; }
+  pad $hsz $page
+  for r in "$@"; do cat $r; done
+  pad $total $page
+  if [ $ver -eq 4 ]; then
+    for r in "$@"; do
+      u32 $(fsize $r); u32 $off; u32 1; str "ramdisk$n" 32; zeros 64
+      off=$((off + $(fsize $r)))
+      n=$((n + 1))
+    done
+    pad $((108 * $#)) $page
+  fi
+}
+
+# $1 = name, $2 = file
+mk_mtk() {
+  printf '\210\026\210\130'
+  u32 $(fsize $2)
+  str $1 32
+  zeros 472
+  cat $2
+}
+
+# $1 = image
+mk_dhtb() {
+  printf 'DHTB\001\000\000\000'
+  zeros 40
+  u32 $(fsize $1)
+  zeros 460
+  cat $1
+}
+
+# Full OTA payloads, like the ones produced by brillo_update_payload
+
+# $1 = partition name, $2 = image, a multiple of the 4K block size
+# Data blobs are appended to blobs, the PartitionUpdate message is written to $1.part
+mk_partition() {
+  local name=$1 size=$(fsize $2) chunk=$((2 * 1024 * 1024)) off=0 n type
+  : > $name.ops
+  while [ $off -lt $size ]; do
+    n=$((size - off))
+    [ $n -gt $chunk ] && n=$chunk
+    dd if=$2 of=chunk bs=4096 skip=$((off / 4096)) count=$((n / 4096)) 2>/dev/null
+    { pb_int 1 $((off / 4096)); pb_int 2 $((n / 4096)); } > extent
+    if zeros $n | cmp -s - chunk; then
+      { pb_int 1 6; pb_msg 6 extent; } > op
+    else
+      # Keep whichever is smaller, as the payload generator does
+      "$MAGISKBOOT" compress=xz chunk chunk.xz 2>/dev/null
+      if [ $(fsize chunk.xz) -lt $n ]; then
+        type=8
+        mv chunk.xz data
+      else
+        type=0
+        mv chunk data
+      fi
+      { pb_int 1 $type; pb_int 2 $(fsize blobs); pb_int 3 $(fsize data); pb_msg 6 extent; } > op
+      cat data >> blobs
+    fi
+    pb_msg 8 op >> $name.ops
+    off=$((off + n))
+  done
+  pb_int 1 $size > info
+  { pb_str 1 $name; pb_msg 7 info; cat $name.ops; } > $name.part
+  rm -f chunk chunk.xz data extent op info $name.ops
+}
+
+# rest = partitions as <name>:<image>
+mk_payload() {
+  local p
+  : > blobs
+  pb_int 3 4096 > manifest
+  for p in "$@"; do
+    mk_partition ${p%%:*} ${p#*:}
+    pb_msg 13 ${p%%:*}.part >> manifest
+    rm -f ${p%%:*}.part
+  done
+  printf 'CrAU'
+  be64 2
+  be64 $(fsize manifest)
+  be32 16
+  cat manifest
+  zeros 16
+  cat blobs
+  rm -f blobs manifest
+}
+
+# $1 = Android sparse image, the raw image is written to stdout
+unsparse() {
+  local hdr=$(od -An -tu2 -j8 -N2 $1) chdr=$(od -An -tu2 -j10 -N2 $1)
+  local blk=$(od -An -tu4 -j12 -N4 $1) chunks=$(od -An -tu4 -j20 -N4 $1)
+  local off=$hdr i=0 type n total
+  while [ $i -lt $chunks ]; do
+    type=$(od -An -tu2 -j$off -N2 $1)
+    n=$(od -An -tu4 -j$((off + 4)) -N4 $1)
+    total=$(od -An -tu4 -j$((off + 8)) -N4 $1)
+    case $((type)) in
+      # Raw
+      51905) tail -c +$((off + chdr + 1)) $1 | head -c $((n * blk)) ;;
+      # Fill, only zero fills are ever written
+      51906) [ $(od -An -tu4 -j$((off + chdr)) -N4 $1) -eq 0 ] || return 1; zeros $((n * blk)) ;;
+      *) return 1 ;;
+    esac
+    off=$((off + total))
+    i=$((i + 1))
+  done
+}
+
+# $1 = payload, stored uncompressed as payload.bin like in OTA packages
+mk_ota_zip() {
+  local size=$(fsize $1) name=payload.bin
+  u32 0x04034b50; u16 20; u16 0; u16 0; u32 0; u32 0; u32 $size; u32 $size
+  u16 ${#name}; u16 0
+  printf '%s' $name
+  cat $1
+  u32 0x02014b50; u16 20; u16 20; u16 0; u16 0; u32 0; u32 0; u32 $size; u32 $size
+  u16 ${#name}; u16 0; u16 0; u16 0; u16 0; u32 0; u32 0
+  printf '%s' $name
+  u32 0x06054b50; u16 0; u16 0; u16 1; u16 1
+  u32 $((46 + ${#name})); u32 $((30 + ${#name} + size)); u16 0
+}
+
+##################
+# Measurements
+##################
+
+# $1 = action, $2 = case, $3 = bytes processed, rest = command
+run() {
+  local action=$1 name=$2 bytes=$3 start end rss=null ret
+  shift 3
+  start=$(date +%s%N)
+  if [ -n "$TIME" ]; then
+    $TIME -f %M -o "$WORK/rss" "$@" >/dev/null 2>>"$WORK/log"
+    ret=$?
+    rss=$(tail -n 1 "$WORK/rss")
+  else
+    "$@" >/dev/null 2>>"$WORK/log"
+    ret=$?
+  fi
+  end=$(date +%s%N)
+  [ $ret -eq 0 ] || echo "! $action [$name] returned $ret" >&2
+  awk -v a=$action -v n=$name -v b=$bytes -v ns=$((end - start)) -v rss=$rss -v ret=$ret 'BEGIN {
+    printf "{\"action\":\"%s\",\"case\":\"%s\",\"bytes\":%d,\"ms\":%.3f,\"mb_per_s\":%.2f,\"max_rss_kb\":%s,\"ret\":%d}\n",
+      a, n, b, ns / 1000000, (ns > 0 ? b * 1000 / ns : 0), rss, ret
+  }' >> "$RESULTS"
+  return $ret
+}
+
+# $1 = case, $2 = image
+bench_image() {
+  local size=$(fsize $2)
+  mkdir $1
+  cd $1
+  run unpack $1 $size "$MAGISKBOOT" unpack -h $2
+  run repack $1 $size "$MAGISKBOOT" repack $2 new-boot.img
+  cd "$WORK"
+  rm -rf $1
+}
+
+##################
+# Corpus
+##################
+
+echo "- Generating corpus in $WORK" >&2
+
+# Native code compresses roughly like a real kernel
+: > kernel
+while [ $(fsize kernel) -lt $((KERNEL_MB * 1024 * 1024)) ]; do
+  cat "$MAGISKBOOT" >> kernel
+done
+head -c $((KERNEL_MB * 1024 * 1024)) kernel > kernel.raw
+mv kernel.raw kernel
+
+head -c 65536 /dev/urandom > random
+printf '/dev/block/by-name/system /system ext4 ro wait,verify,avb=vbmeta\n' > fstab
+"$MAGISKBOOT" cpio ramdisk.cpio \
+  "mkdir 0755 sbin" "mkdir 0755 system" "mkdir 0755 system/bin" \
+  "add 0750 init $MAGISKBOOT" "add 0755 system/bin/init $MAGISKBOOT" \
+  "add 0644 fstab.bench fstab" "add 0644 random random" 2>/dev/null || exit 1
+
+# A ramdisk with many small entries, like a vendor ramdisk full of modules
+mkdir many
+set --
+i=0
+while [ $i -lt $CPIO_FILES ]; do
+  d=d$((i / 100))
+  if [ $((i % 100)) -eq 0 ]; then
+    mkdir many/$d
+    set -- "$@" "mkdir 0755 $d"
+  fi
+  head -c $((i % 16 * 1024 + 100)) kernel > many/$d/f$i
+  set -- "$@" "add 0644 $d/f$i many/$d/f$i"
+  i=$((i + 1))
+done
+"$MAGISKBOOT" cpio many.cpio "$@" 2>/dev/null || exit 1
+rm -rf many
+
+"$MAGISKBOOT" compress=gzip kernel kernel.gz 2>/dev/null
+"$MAGISKBOOT" compress=lz4_legacy ramdisk.cpio ramdisk.lz4 2>/dev/null
+cp ramdisk.lz4 ramdisk2.lz4
+cp ramdisk.lz4 ramdisk3.lz4
+mk_mtk KERNEL kernel.gz > kernel.mtk
+mk_mtk ROOTFS ramdisk.lz4 > ramdisk.mtk
+
+for ver in 0 1 2 3 4; do
+  mk_boot $ver kernel.gz ramdisk.lz4 > boot_v$ver.img
+done
+for ver in 0 1 2; do
+  mk_boot $ver kernel.mtk ramdisk.mtk > boot_v${ver}_mtk.img
+  mk_dhtb boot_v$ver.img > boot_v${ver}_dhtb.img
+done
+# Pre-headers like the ones on Nook/Acclaim images, both a run of zeros
+# and noise where bytes often match the first byte of a magic
+{ zeros $((PAD_MB * 1024 * 1024)); cat boot_v0.img; } > boot_v0_pad_zero.img
+{ head -c $((PAD_MB * 1024 * 1024)) /dev/urandom; cat boot_v0.img; } > boot_v0_pad_random.img
+mk_vendor_boot 3 ramdisk.lz4 > vendor_boot_v3.img
+mk_vendor_boot 4 ramdisk.lz4 ramdisk2.lz4 ramdisk3.lz4 > vendor_boot_v4.img
+
+if [ $PAYLOAD_MB -gt 0 ]; then
+  { cat boot_v2.img; pad $(fsize boot_v2.img) 4096; } > ota_boot.img
+  # Compressible, empty and incompressible 2M chunks
+  : > ota_system.img
+  i=0
+  while [ $i -lt $((PAYLOAD_MB / 2)) ]; do
+    case $((i % 4)) in
+      0) head -c 2097152 kernel ;;
+      2) head -c 2097152 /dev/urandom ;;
+      *) zeros 2097152 ;;
+    esac >> ota_system.img
+    i=$((i + 1))
+  done
+  mk_payload boot:ota_boot.img system:ota_system.img > payload.bin
+  mk_ota_zip payload.bin > ota.zip
+fi
+
+##################
+# Benchmarks
+##################
+
+echo "- Running benchmarks" >&2
+
+ksize=$(fsize kernel)
+for fmt in $FORMATS; do
+  run compress $fmt $ksize "$MAGISKBOOT" compress=$fmt kernel kernel.$fmt
+  run decompress $fmt $ksize "$MAGISKBOOT" decompress kernel.$fmt kernel.out
+  rm -f kernel.$fmt kernel.out
+done
+
+# Digest throughput, mb_per_s / 1000 is GB/s. The sha1 and sha2 crates use the
+# SHA-NI or ARMv8 crypto extensions when the CPU has them.
+sha_ext=false
+grep -qwE 'sha_ni|sha2' /proc/cpuinfo 2>/dev/null && sha_ext=true
+printf '{"action":"cpu","case":"sha_extensions","present":%s}\n' $sha_ext >> "$RESULTS"
+i=0
+while [ $i -lt $((SHA_MB / KERNEL_MB)) ]; do
+  cat kernel
+  i=$((i + 1))
+done > sha.img
+run sha1 file $(fsize sha.img) "$MAGISKBOOT" sha1 sha.img
+rm -f sha.img
+cp boot_v2.img sign.img
+run sign boot_v2 $(fsize sign.img) "$MAGISKBOOT" sign sign.img
+run verify boot_v2 $(fsize sign.img) "$MAGISKBOOT" verify sign.img
+rm -f sign.img
+
+for img in boot_v*.img vendor_boot_v*.img; do
+  bench_image ${img%.img} "$WORK/$img"
+done
+
+cp ramdisk.cpio patch.cpio
+run cpio_patch ramdisk $(fsize ramdisk.cpio) "$MAGISKBOOT" cpio patch.cpio patch
+run cpio_backup ramdisk $(fsize ramdisk.cpio) "$MAGISKBOOT" cpio patch.cpio "backup ramdisk.cpio"
+
+# Load, patch and dump a ramdisk with many entries, written through a symlink
+# to an archive with non-default permissions, which both have to survive the dump
+cp many.cpio patch_many.cpio
+chmod 0600 patch_many.cpio
+ln -s patch_many.cpio link.cpio
+run cpio_patch many $(fsize many.cpio) "$MAGISKBOOT" cpio link.cpio patch
+kept=false
+[ -L link.cpio ] && [ "$(stat -c %a patch_many.cpio)" = 600 ] && kept=true
+[ $kept = true ] || echo "! cpio [many] replaced the symlink or lost the file mode" >&2
+printf '{"action":"verify","case":"cpio_many","kept":%s}\n' $kept >> "$RESULTS"
+rm -f link.cpio patch_many.cpio
+
+# 20 patterns applied in one call, and one call per pattern like before.
+# Random data keeps the matches apart, so both give the same result.
+head -c 1048576 /dev/urandom > block
+: > hex.img
+i=0
+while [ $i -lt $HEXPATCH_MB ]; do
+  cat block >> hex.img
+  i=$((i + 1))
+done
+set --
+i=0
+while [ $i -lt 20 ]; do
+  set -- "$@" $(od -An -tx1 -j$((i * 50000 + 17)) -N8 block | tr -d ' \n') \
+    $(head -c 8 /dev/urandom | od -An -tx1 | tr -d ' \n')
+  i=$((i + 1))
+done
+rm -f block
+
+# $1 = file, rest = pattern pairs
+hexpatch_each() {
+  local f=$1
+  shift
+  while [ $# -gt 0 ]; do
+    "$MAGISKBOOT" hexpatch $f $1 $2 || return 1
+    shift 2
+  done
+}
+
+cp hex.img hex_all.img
+run hexpatch single_pass $(fsize hex.img) "$MAGISKBOOT" hexpatch hex_all.img "$@"
+cp hex.img hex_each.img
+run hexpatch per_pattern $(fsize hex.img) hexpatch_each hex_each.img "$@"
+same=false
+cmp -s hex_all.img hex_each.img && ! cmp -s hex.img hex_all.img && same=true
+[ $same = true ] || echo "! hexpatch [single_pass] output differs from per_pattern" >&2
+printf '{"action":"verify","case":"hexpatch","same":%s}\n' $same >> "$RESULTS"
+rm -f hex.img hex_all.img hex_each.img
+
+# A patch flow as separate processes, like boot_patch.sh runs it, and the same
+# actions in one batch where the components stay in memory
+kpat=$(od -An -tx1 -j4096 -N8 kernel | tr -d ' \n')
+{
+  echo "unpack $WORK/boot_v2.img"
+  echo "cpio ramdisk.cpio patch \"mkdir 0750 overlay.d\" \"add 0644 overlay.d/fstab.bench $WORK/fstab\""
+  echo "hexpatch kernel $kpat 0000000000000000"
+  echo "repack $WORK/boot_v2.img new-boot.img"
+} > flow.txt
+
+# $1 = action list
+flow_each() {
+  local line
+  while read -r line; do
+    eval "\"\$MAGISKBOOT\" $line" || return 1
+  done < $1
+}
+
+mkdir script batch
+cd script
+run patch_flow script $(fsize "$WORK/boot_v2.img") flow_each "$WORK/flow.txt"
+cd "$WORK/batch"
+echo cleanup >> "$WORK/flow.txt"
+run patch_flow batch $(fsize "$WORK/boot_v2.img") "$MAGISKBOOT" batch "$WORK/flow.txt"
+cd "$WORK"
+same=false
+cmp -s script/new-boot.img batch/new-boot.img && same=true
+[ $same = true ] || echo "! patch_flow [batch] image differs from the script flow" >&2
+# cleanup is last, so the batch should leave nothing but the image
+printf '{"action":"verify","case":"patch_flow","same":%s,"batch_files":%d}\n' \
+  $same $(ls batch | wc -l) >> "$RESULTS"
+rm -rf script batch flow.txt
+
+if [ -f "$DTB" ]; then
+  cp "$DTB" bench.dtb
+  run dtb_patch dtb $(fsize bench.dtb) "$MAGISKBOOT" dtb bench.dtb patch
+fi
+
+if [ -f "$PAYLOAD" ]; then
+  run extract payload $(fsize "$PAYLOAD") "$MAGISKBOOT" extract "$PAYLOAD" boot "$WORK/extract.img"
+fi
+
+# $1 = case, $2 = input, rest = command
+bench_payload() {
+  local name=$1 size=$(fsize $2) same=true
+  shift 2
+  rm -rf extract
+  mkdir extract
+  run extract $name $size "$@"
+  cmp -s extract/boot.img ota_boot.img || same=false
+  cmp -s extract/system.img ota_system.img || same=false
+  [ $same = true ] || echo "! extract [$name] output differs from the partition images" >&2
+  printf '{"action":"verify","case":"%s","same":%s}\n' $name $same >> "$RESULTS"
+  # ZERO operations are left as holes, so the output should take up fewer blocks
+  printf '{"action":"blocks","case":"%s","bytes":%d,"allocated_kb":%d,"source_allocated_kb":%d}\n' \
+    $name $(fsize extract/system.img) $(($(stat -c '%b * %B' extract/system.img) / 1024)) \
+    $(($(stat -c '%b * %B' ota_system.img) / 1024)) >> "$RESULTS"
+  rm -rf extract
+}
+
+if [ -f payload.bin ]; then
+  bench_payload ota_payload payload.bin "$MAGISKBOOT" extract payload.bin boot,system extract
+  bench_payload ota_zip ota.zip "$MAGISKBOOT" extract ota.zip boot,system extract
+  bench_payload ota_stream payload.bin \
+    sh -c "cat payload.bin | \"$MAGISKBOOT\" extract - boot,system extract"
+
+  run extract ota_sparse $(fsize payload.bin) \
+    "$MAGISKBOOT" extract -s payload.bin system system.simg
+  same=false
+  unsparse system.simg | cmp -s - ota_system.img && same=true
+  [ $same = true ] || echo "! extract [ota_sparse] output differs from the partition image" >&2
+  printf '{"action":"verify","case":"ota_sparse","same":%s,"bytes":%d}\n' \
+    $same $(fsize system.simg) >> "$RESULTS"
+  rm -f system.simg
+fi
+
+for f in $EMBEDDED; do
+  name=${f##*/}
+  cp "$f" embedded
+  size=$(fsize embedded)
+  for fmt in xz lz4; do
+    run compress ${name}_$fmt $size "$MAGISKBOOT" compress=$fmt embedded embedded.$fmt
+    run decompress ${name}_$fmt $size "$MAGISKBOOT" decompress embedded.$fmt embedded.out
+    printf '{"action":"size","case":"%s_%s","bytes":%d,"compressed_bytes":%d}\n' \
+      $name $fmt $size $(fsize embedded.$fmt) >> "$RESULTS"
+    rm -f embedded.$fmt embedded.out
+  done
+  rm -f embedded
+done
+
+echo '{"results":['
+sed '$!s/$/,/' "$RESULTS"
+echo ']}'
+
+cd /
+rm -rf "$WORK"
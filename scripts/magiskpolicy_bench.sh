@@ -0,0 +1,119 @@
+#!/system/bin/sh
+#######################################################################################
+# MagiskPolicy Benchmark
+#######################################################################################
+#
+# Usage: magiskpolicy_bench.sh <magiskpolicy> [baseline magiskpolicy] [workdir]
+#
+# Times patching a stock policy with the built-in Magisk rules and with a large
+# generated rule set. If a baseline binary is given, it is timed on the same inputs
+# and the rules of both patched policies are compared.
+# Results are printed to stdout as JSON, progress and errors go to stderr.
+#
+# This script can run on devices or any Linux host that can execute <magiskpolicy>.
+# The following environment variables are optional:
+#
+# POLICY: the monolithic policy to patch (default: /sys/fs/selinux/policy)
+# RULES: number of generated rules (default: 5000)
+# RULE_FILES: number of files the generated rules are split into (default: 50)
+#
+#######################################################################################
+
+if [ -z "$1" ]; then
+  echo "Usage: $0 <magiskpolicy> [baseline magiskpolicy] [workdir]" >&2
+  exit 1
+fi
+
+MAGISKPOLICY="$(readlink -f "$1")"
+BASELINE=
+[ -n "$2" ] && BASELINE="$(readlink -f "$2")"
+WORK="${3:-${TMPDIR:-/data/local/tmp}/magiskpolicy_bench}"
+[ -z "$POLICY" ] && POLICY=/sys/fs/selinux/policy
+[ -z "$RULES" ] && RULES=5000
+[ -z "$RULE_FILES" ] && RULE_FILES=50
+
+rm -rf "$WORK"
+mkdir -p "$WORK" || exit 1
+cd "$WORK" || exit 1
+RESULTS="$WORK/results"
+: > "$RESULTS"
+
+# Read instead of copy, selinuxfs nodes report a size of 0
+cat "$POLICY" > policy || exit 1
+
+##################
+# Measurements
+##################
+
+# $1 = binary name, $2 = case, $3 = rules applied, rest = command
+run() {
+  local bin=$1 name=$2 rules=$3 start end ret
+  shift 3
+  start=$(date +%s%N)
+  "$@" >/dev/null 2>>"$WORK/log"
+  ret=$?
+  end=$(date +%s%N)
+  [ $ret -eq 0 ] || echo "! $bin [$name] returned $ret" >&2
+  awk -v b=$bin -v n=$name -v r=$rules -v ns=$((end - start)) -v ret=$ret 'BEGIN {
+    printf "{\"binary\":\"%s\",\"case\":\"%s\",\"rules\":%d,\"ms\":%.3f,\"ret\":%d}\n",
+      b, n, r, ns / 1000000, ret
+  }' >> "$RESULTS"
+  return $ret
+}
+
+##################
+# Rule set
+##################
+
+echo "- Generating $RULES rules from $POLICY" >&2
+
+"$MAGISKPOLICY" --load policy --print-rules > stock.te 2>/dev/null || exit 1
+grep '^type ' stock.te | awk '{ print $2 }' > types
+[ -s types ] || { echo "! No types found in $POLICY" >&2; exit 1; }
+
+# Existing allow rules retargeted onto other types, like module rules granting
+# access to new domains, with a wildcard rule every 100 rules
+mkdir rules
+grep '^allow ' stock.te | head -n $RULES | awk -v files=$RULE_FILES '
+  NR == FNR { types[n++] = $1; next }
+  {
+    $3 = types[(FNR * 7919) % n]
+    f = sprintf("rules/%03d.te", FNR % files)
+    print > f
+    if (FNR % 100 == 0)
+      printf "allow %s * file { getattr }\n", types[FNR % n] > f
+  }' types -
+nrules=$(cat rules/*.te | wc -l)
+APPLY=
+for f in rules/*.te; do
+  APPLY="$APPLY --apply $f"
+done
+
+##################
+# Benchmarks
+##################
+
+# $1 = binary name, $2 = binary
+bench() {
+  run $1 magisk 0 "$2" --load policy --magisk --save $1_magisk.policy
+  run $1 rules $nrules "$2" --load policy --magisk $APPLY --save $1_rules.policy
+  "$2" --load $1_rules.policy --print-rules 2>/dev/null | sort > $1_rules.te
+}
+
+echo "- Running benchmarks" >&2
+
+bench current "$MAGISKPOLICY"
+if [ -n "$BASELINE" ]; then
+  bench baseline "$BASELINE"
+  same=false
+  cmp -s current_rules.te baseline_rules.te && same=true
+  [ $same = true ] || echo "! Patched rules differ from baseline" >&2
+  printf '{"compare":"rules","same":%s}\n' $same >> "$RESULTS"
+fi
+
+echo '{"results":['
+sed '$!s/$/,/' "$RESULTS"
+echo ']}'
+
+cd /
+rm -rf "$WORK"